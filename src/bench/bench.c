@@ -0,0 +1,522 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "neuron.h"
+#include "matrix.h"
+#include "pool.h"
+#include "split.h"
+#include "pipeline.h"
+#include "harness.h"
+#include "perf.h"
+#include "mem.h"
+
+/* bench: microbenchmarks of the hot paths of the library, over several
+ * network topologies, batch sizes and thread counts. The results are
+ * written as JSON to stdout (or to the file given with -o).
+ *
+ * Every benchmark has a name and a topology ("kernels" for the matrix.c
+ * functions); -f runs only those whose "name/topology" contains the given
+ * string.
+ *
+ * With -p, hardware counters are read for every benchmark (see perf.c),
+ * and the peak throughput of the machine is measured to place each one in
+ * the roofline model.
+ *
+ * -H huge (or hugetlb) puts the weights, the workspaces and the training
+ * sets on huge pages, and -N binds them to a NUMA node (see mem.h), to
+ * compare the dTLB misses and times with those of the default placement.
+ */
+
+#define MAX_LIST 16
+#define KERNEL_LEN 4096
+#define KERNEL_DIM 64
+#define ETA 0.01
+
+struct topology {
+    char *name;
+    int n_layers;
+    int sizes[32];
+    int train_size;     /* samples in an epoch of network_SGD */
+};
+
+static struct topology topologies[] = {
+    { "tiny", 3, { 16, 8, 4 }, 1024 },
+    { "mnist", 3, { 784, 30, 10 }, 1024 },
+    { "wide", 2, { 4096, 4096 }, 32 },
+    { "deep", 20, { 256, 256, 256, 256, 256, 256, 256, 256, 256, 256,
+                    256, 256, 256, 256, 256, 256, 256, 256, 256, 10 }, 256 },
+};
+
+#define N_TOPOLOGIES (sizeof(topologies) / sizeof(topologies[0]))
+
+#define SPLIT_WIDTH 1024    /* layers split by split_create */
+#define PIPELINE_DEPTH 2    /* micro-batches per stage in a batch */
+
+struct ctx {
+    struct topology *topo;
+    struct network *net;
+    int n_in, n_out;
+    int n_samples;      /* samples in inputs and outputs */
+    float *inputs, *outputs, *out;
+    int *labels;
+    float **activs, **deltas;       /* for calc_activs_deltas */
+    float ***bactivs, ***bdeltas;   /* for network_backprop */
+    float *scratch;
+    int batch, threads;
+    struct pool *pool;
+    struct split *split;
+    struct pipeline *pipeline;
+    char path[64];
+    /* matrix.c kernels */
+    float *v1, *v2, *v3;
+    double (*m1)[KERNEL_DIM], (*m2)[KERNEL_DIM], (*m3)[KERNEL_DIM];
+};
+
+static char *filter;
+static FILE *out;
+static struct harness_opts opts;
+static char memory[32];
+
+static float **alloc_layers(struct network *net)
+{
+    float **v = malloc(net->n_layers * sizeof(float *));
+    int l;
+    for (l = 0; l < net->n_layers; l++)
+        v[l] = calloc(net->layers[l]->n_neurons, sizeof(float));
+    return v;
+}
+
+static void free_layers(struct network *net, float **v)
+{
+    int l;
+    for (l = 0; l < net->n_layers; l++)
+        free(v[l]);
+    free(v);
+}
+
+static void fill_random(int n, float *v)
+{
+    while (n-- > 0)
+        v[n] = (float)rand() / (float)RAND_MAX;
+}
+
+/* The benchmarked calls */
+
+static void run_feedforward(void *arg)
+{
+    struct ctx *c = arg;
+    feedforward(c->net, c->inputs, c->out);
+}
+
+static void batch_task(void *arg, int i, int thread)
+{
+    struct ctx *c = arg;
+    int chunk = (c->batch + c->threads - 1) / c->threads;
+    int start = i * chunk;
+    int n = (start + chunk < c->batch) ? chunk : c->batch - start;
+
+    feedforward_batch(c->net, n,
+                      (float (*)[c->n_in])(c->inputs + start * c->n_in),
+                      (float (*)[c->n_out])(c->out + start * c->n_out),
+                      pool_scratch(c->pool, thread,
+                                   2 * n * network_max_neurons(c->net)));
+}
+
+static void run_feedforward_batch(void *arg)
+{
+    struct ctx *c = arg;
+    int chunk;
+
+    if (c->threads == 1) {
+        feedforward_batch(c->net, c->batch, (float (*)[c->n_in])c->inputs,
+                          (float (*)[c->n_out])c->out, c->scratch);
+        return;
+    }
+    chunk = (c->batch + c->threads - 1) / c->threads;
+    pool_run(c->pool, (c->batch + chunk - 1) / chunk, batch_task, c);
+}
+
+static void run_split_feedforward(void *arg)
+{
+    struct ctx *c = arg;
+    split_feedforward(c->split, c->batch, c->inputs, c->out);
+}
+
+static void run_split_update_minibatch(void *arg)
+{
+    struct ctx *c = arg;
+    split_update_minibatch(c->split, c->batch, c->inputs, c->outputs, 0.1);
+}
+
+static void run_pipeline(void *arg)
+{
+    struct ctx *c = arg;
+    pipeline_run(c->pipeline, c->batch, c->inputs, c->out);
+}
+
+static void run_classify(void *arg)
+{
+    struct ctx *c = arg;
+    network_classify(c->net, c->batch, (float (*)[c->n_in])c->inputs,
+                     c->labels, 1, NULL, 0);
+}
+
+static void run_calc_activs_deltas(void *arg)
+{
+    struct ctx *c = arg;
+    calc_activs_deltas(c->net, c->inputs, c->outputs, c->activs, c->deltas);
+}
+
+static void run_backprop(void *arg)
+{
+    struct ctx *c = arg;
+    network_backprop(c->net, c->batch, c->n_out,
+                     (float (*)[c->n_in])c->inputs,
+                     (float (*)[c->n_out])c->outputs, ETA, 0,
+                     c->bactivs, c->bdeltas);
+}
+
+static void run_update_minibatch(void *arg)
+{
+    struct ctx *c = arg;
+    network_update_minibatch(c->net, c->batch, (float (*)[c->n_in])c->inputs,
+                             (float (*)[c->n_out])c->outputs, ETA, 0);
+}
+
+static void run_sgd_epoch(void *arg)
+{
+    struct ctx *c = arg;
+    network_SGD(c->net, c->topo->train_size, c->batch, 1,
+                (float (*)[c->n_in])c->inputs,
+                (float (*)[c->n_out])c->outputs, ETA, NULL);
+}
+
+static void run_save(void *arg)
+{
+    struct ctx *c = arg;
+    network_save_to_file(c->net, c->path);
+}
+
+static void run_load(void *arg)
+{
+    struct ctx *c = arg;
+    network_load_from_file(c->net, c->path);
+}
+
+static void run_create_from_file(void *arg)
+{
+    struct ctx *c = arg;
+    destroy_network(network_create_from_file(c->path));
+}
+
+static void run_vprod(void *arg)
+{
+    struct ctx *c = arg;
+    c->v3[0] = vprod(KERNEL_LEN, c->v1, c->v2);
+}
+
+static void run_vscalarprod(void *arg)
+{
+    struct ctx *c = arg;
+    vscalarprod(KERNEL_LEN, c->v3, c->v1, c->v2);
+}
+
+static void run_vsubstract(void *arg)
+{
+    struct ctx *c = arg;
+    vsubstract(KERNEL_LEN, c->v3, c->v1, c->v2);
+}
+
+static void run_madd(void *arg)
+{
+    struct ctx *c = arg;
+    madd(KERNEL_DIM, KERNEL_DIM, c->m1, c->m2, c->m3);
+}
+
+static void run_mprod(void *arg)
+{
+    struct ctx *c = arg;
+    mprod(KERNEL_DIM, KERNEL_DIM, c->m1, KERNEL_DIM, KERNEL_DIM, c->m2, c->m3);
+}
+
+static void run_transp(void *arg)
+{
+    struct ctx *c = arg;
+    transp(KERNEL_DIM, KERNEL_DIM, c->m1, c->m3);
+}
+
+/* bench: run one benchmark, if it passes the filter, and write its
+ * result */
+static void bench(char *name, void fn(void *), struct ctx *c, long samples,
+                  double flops)
+{
+    struct bench_info info;
+    struct measurement m;
+    char full[128];
+
+    snprintf(full, sizeof(full), "%s/%s", name,
+             c->topo ? c->topo->name : "kernels");
+    if (filter && !strstr(full, filter))
+        return;
+    fprintf(stderr, "%s batch %d threads %d\n", full, c->batch, c->threads);
+    harness_measure(fn, c, &opts, &m);
+    info.name = name;
+    info.topology = c->topo ? c->topo->name : "kernels";
+    info.batch = c->batch;
+    info.threads = c->threads;
+    info.samples = samples;
+    info.flops = flops;
+    info.memory = memory[0] ? memory : NULL;
+    harness_json_result(out, &info, &m);
+    harness_free(&m);
+}
+
+static void bench_topology(struct topology *topo, int n_batches, int *batches,
+                           int n_threads, int *threads)
+{
+    struct ctx c = { 0 };
+    int i, t, max_batch = 1;
+    double w;
+
+    for (i = 0; i < n_batches; i++)
+        if (batches[i] > max_batch)
+            max_batch = batches[i];
+    c.topo = topo;
+    c.net = create_network(topo->n_layers, topo->sizes);
+    c.n_in = topo->sizes[0];
+    c.n_out = topo->sizes[topo->n_layers-1];
+    c.n_samples = max_batch > topo->train_size ? max_batch : topo->train_size;
+    c.inputs = mem_alloc((size_t)c.n_samples * c.n_in * sizeof(float));
+    c.outputs = mem_alloc((size_t)c.n_samples * c.n_out * sizeof(float));
+    c.out = malloc((size_t)c.n_samples * c.n_out * sizeof(float));
+    c.labels = malloc(c.n_samples * sizeof(int));
+    c.scratch = malloc(2 * (size_t)max_batch * network_max_neurons(c.net)
+                       * sizeof(float));
+    fill_random(c.n_samples * c.n_in, c.inputs);
+    fill_random(c.n_samples * c.n_out, c.outputs);
+    c.activs = alloc_layers(c.net);
+    c.deltas = alloc_layers(c.net);
+    c.bactivs = malloc(max_batch * sizeof(float **));
+    c.bdeltas = malloc(max_batch * sizeof(float **));
+    for (i = 0; i < max_batch; i++) {
+        c.bactivs[i] = alloc_layers(c.net);
+        c.bdeltas[i] = alloc_layers(c.net);
+    }
+    snprintf(c.path, sizeof(c.path), "/tmp/bench-%d-%s.net", (int)getpid(),
+             topo->name);
+
+    /* flops of a forward pass; backpropagating the deltas takes as many
+     * again, and computing the gradient as many again */
+    w = 2.0 * network_n_weights(c.net);
+    c.batch = c.threads = 1;
+    bench("feedforward", run_feedforward, &c, 1, w);
+    bench("calc_activs_deltas", run_calc_activs_deltas, &c, 1, 2 * w);
+    for (i = 0; i < n_batches; i++) {
+        if (batches[i] > c.n_samples)
+            continue;
+        c.batch = batches[i];
+        for (t = 0; t < n_threads; t++) {
+            c.threads = threads[t];
+            if (c.threads > 1)
+                c.pool = pool_create(c.threads);
+            bench("feedforward_batch", run_feedforward_batch, &c, c.batch,
+                  w * c.batch);
+            if (c.pool)
+                pool_destroy(c.pool);
+            c.pool = NULL;
+            /* a stage per thread, each fed with PIPELINE_DEPTH
+             * micro-batches in flight */
+            if (topo->n_layers - 1 >= c.threads && c.threads > 1) {
+                c.pipeline = pipeline_create(c.net, c.threads,
+                        (c.batch + c.threads * PIPELINE_DEPTH - 1)
+                        / (c.threads * PIPELINE_DEPTH));
+                bench("pipeline_run", run_pipeline, &c, c.batch,
+                      w * c.batch);
+                pipeline_destroy(c.pipeline);
+                c.pipeline = NULL;
+            }
+            /* layers split among the threads, for the wide topologies */
+            if (network_max_neurons(c.net) < SPLIT_WIDTH)
+                continue;
+            c.split = split_create(c.net, c.threads, SPLIT_WIDTH);
+            bench("split_feedforward", run_split_feedforward, &c, c.batch,
+                  w * c.batch);
+            if (c.batch <= topo->train_size)
+                bench("split_update_minibatch", run_split_update_minibatch,
+                      &c, c.batch, 3 * w * c.batch);
+            split_destroy(c.split);
+            c.split = NULL;
+        }
+        c.threads = 1;
+        bench("network_classify", run_classify, &c, c.batch, w * c.batch);
+        /* training batches are limited by the size of the training set,
+         * which keeps the large topologies affordable */
+        if (c.batch > topo->train_size)
+            continue;
+        bench("network_backprop", run_backprop, &c, c.batch,
+              3 * w * c.batch);
+        bench("network_update_minibatch", run_update_minibatch, &c, c.batch,
+              3 * w * c.batch);
+        bench("network_SGD_epoch", run_sgd_epoch, &c,
+              topo->train_size / c.batch * c.batch,
+              3 * w * (topo->train_size / c.batch * c.batch));
+    }
+    c.batch = 1;
+    network_save_to_file(c.net, c.path);
+    bench("network_save_to_file", run_save, &c, 0, 0);
+    bench("network_load_from_file", run_load, &c, 0, 0);
+    bench("network_create_from_file", run_create_from_file, &c, 0, 0);
+    unlink(c.path);
+
+    for (i = 0; i < max_batch; i++) {
+        free_layers(c.net, c.bactivs[i]);
+        free_layers(c.net, c.bdeltas[i]);
+    }
+    free(c.bactivs);
+    free(c.bdeltas);
+    free_layers(c.net, c.activs);
+    free_layers(c.net, c.deltas);
+    mem_free(c.inputs);
+    mem_free(c.outputs);
+    free(c.out);
+    free(c.labels);
+    free(c.scratch);
+    destroy_network(c.net);
+}
+
+static void bench_kernels(void)
+{
+    struct ctx c = { 0 };
+    int i, j;
+
+    c.batch = c.threads = 1;
+    c.v1 = malloc(KERNEL_LEN * sizeof(float));
+    c.v2 = malloc(KERNEL_LEN * sizeof(float));
+    c.v3 = malloc(KERNEL_LEN * sizeof(float));
+    fill_random(KERNEL_LEN, c.v1);
+    fill_random(KERNEL_LEN, c.v2);
+    c.m1 = malloc(KERNEL_DIM * sizeof(*c.m1));
+    c.m2 = malloc(KERNEL_DIM * sizeof(*c.m2));
+    c.m3 = malloc(KERNEL_DIM * sizeof(*c.m3));
+    for (i = 0; i < KERNEL_DIM; i++)
+        for (j = 0; j < KERNEL_DIM; j++)
+            c.m1[i][j] = c.m2[j][i] = (double)rand() / RAND_MAX;
+
+    bench("vprod", run_vprod, &c, 0, 2 * KERNEL_LEN);
+    bench("vscalarprod", run_vscalarprod, &c, 0, KERNEL_LEN);
+    bench("vsubstract", run_vsubstract, &c, 0, KERNEL_LEN);
+    bench("madd", run_madd, &c, 0, KERNEL_DIM * KERNEL_DIM);
+    bench("mprod", run_mprod, &c, 0,
+          (double)KERNEL_DIM * KERNEL_DIM * (KERNEL_DIM + 1));
+    bench("transp", run_transp, &c, 0, 0);
+
+    free(c.v1);
+    free(c.v2);
+    free(c.v3);
+    free(c.m1);
+    free(c.m2);
+    free(c.m3);
+}
+
+/* parse_list: parse a comma separated list of positive ints. Returns the
+ * number of elements */
+static int parse_list(char *s, int *list)
+{
+    int n = 0;
+    char *tok;
+    for (tok = strtok(s, ","); tok && n < MAX_LIST; tok = strtok(NULL, ","))
+        if ((list[n] = atoi(tok)) > 0)
+            n++;
+    return n;
+}
+
+static void usage(char *prog)
+{
+    fprintf(stderr, "usage: %s [-f filter] [-T topology,...] " \
+            "[-b batch,...] [-t threads,...]\n" \
+            "\t[-r reps] [-w warmup] [-m max_seconds] [-o output.json] [-p]\n" \
+            "\t[-H huge|hugetlb] [-N node]\n" \
+            "topologies:", prog);
+    for (int i = 0; i < N_TOPOLOGIES; i++)
+        fprintf(stderr, " %s", topologies[i].name);
+    fprintf(stderr, "\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    int batches[MAX_LIST] = { 1, 16, 256 }, n_batches = 3;
+    int threads[MAX_LIST] = { 1 }, n_threads = 1;
+    char *names = NULL;
+    struct perf_counters perf;
+    struct machine_peaks peaks, *have_peaks = NULL;
+    int opt, i, counters = 0, mem_flags = 0, node = MEM_NODE_ANY;
+
+    harness_default_opts(&opts);
+    out = stdout;
+    if (pool_default_threads() > 1)
+        threads[n_threads++] = pool_default_threads();
+    while ((opt = getopt(argc, argv, "f:T:b:t:r:w:m:o:pH:N:")) != -1) {
+        switch (opt) {
+        case 'f': filter = optarg; break;
+        case 'T': names = optarg; break;
+        case 'b': n_batches = parse_list(optarg, batches); break;
+        case 't': n_threads = parse_list(optarg, threads); break;
+        case 'r': opts.reps = atoi(optarg); break;
+        case 'w': opts.warmup = atoi(optarg); break;
+        case 'm': opts.max_time = atof(optarg); break;
+        case 'p': counters = 1; break;
+        case 'H':
+            if (strcmp(optarg, "huge") == 0) mem_flags = MEM_HUGEPAGES;
+            else if (strcmp(optarg, "hugetlb") == 0) mem_flags = MEM_HUGETLB;
+            else usage(argv[0]);
+            break;
+        case 'N': node = atoi(optarg); break;
+        case 'o':
+            if (!(out = fopen(optarg, "w"))) {
+                perror(optarg);
+                return 1;
+            }
+            break;
+        default: usage(argv[0]);
+        }
+    }
+    if (optind != argc || opts.reps < 1 || opts.warmup < 0)
+        usage(argv[0]);
+    if (opts.min_reps > opts.reps)
+        opts.min_reps = opts.reps;
+    if (mem_flags || node != MEM_NODE_ANY) {
+        mem_set_policy(mem_flags, node);
+        strcpy(memory, mem_flags == MEM_HUGETLB ? "hugetlb" :
+                       mem_flags ? "huge" : "default");
+        if (node != MEM_NODE_ANY)
+            sprintf(memory + strlen(memory), " node %d", node);
+    }
+
+    if (counters) {
+        /* opened before any pool, so that its threads inherit them */
+        if (perf_open(&perf) > 0) {
+            opts.perf = &perf;
+        } else {
+            fprintf(stderr, "bench: hardware counters not available " \
+                    "(see /proc/sys/kernel/perf_event_paranoid), " \
+                    "reporting times only\n");
+        }
+        harness_measure_peaks(&peaks);
+        have_peaks = &peaks;
+    }
+    harness_json_begin(out, have_peaks);
+    for (i = 0; i < N_TOPOLOGIES; i++)
+        if (!names || strstr(names, topologies[i].name))
+            bench_topology(&topologies[i], n_batches, batches,
+                           n_threads, threads);
+    if (!names || strstr(names, "kernels"))
+        bench_kernels();
+    harness_json_end(out);
+    if (opts.perf)
+        perf_close(opts.perf);
+    if (out != stdout)
+        fclose(out);
+    return 0;
+}
@@ -0,0 +1,254 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/utsname.h>
+#include "harness.h"
+#include "io.h"
+
+static int n_results;
+static struct machine_peaks *machine;
+
+void harness_default_opts(struct harness_opts *opts)
+{
+    opts->warmup = 1;
+    opts->reps = 10;
+    opts->min_reps = 3;
+    opts->min_rep = 1e-3;
+    opts->max_time = 2;
+    opts->perf = NULL;
+}
+
+double harness_now(void)
+{
+    return io_now();
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/* quantile: the q quantile of n sorted values, interpolating linearly */
+static double quantile(int n, double *sorted, double q)
+{
+    double pos = q * (n - 1);
+    int i = (int)pos;
+    if (i >= n - 1)
+        return sorted[n-1];
+    return sorted[i] + (pos - i) * (sorted[i+1] - sorted[i]);
+}
+
+/* harness_measure: time fn(arg). After the warmup calls, the number of
+ * calls per repetition is doubled until a repetition takes min_rep seconds,
+ * so that the resolution of the clock does not matter. Then opts->reps
+ * repetitions are timed, or as many as fit in max_time (but at least
+ * min_reps) */
+void harness_measure(void fn(void *), void *arg, struct harness_opts *opts,
+                     struct measurement *m)
+{
+    double start, t, elapsed, sum, sq;
+    double *sorted;
+    long i;
+    int r;
+
+    for (i = 0; i < opts->warmup; i++)
+        fn(arg);
+    for (m->inner = 1; ; m->inner *= 2) {
+        t = harness_now();
+        for (i = 0; i < m->inner; i++)
+            fn(arg);
+        if (harness_now() - t >= opts->min_rep || m->inner >= 1 << 24)
+            break;
+    }
+    m->samples = malloc(opts->reps * sizeof(double));
+    if (opts->perf)
+        perf_start(opts->perf);
+    start = harness_now();
+    for (r = 0; r < opts->reps; r++) {
+        t = harness_now();
+        for (i = 0; i < m->inner; i++)
+            fn(arg);
+        elapsed = harness_now() - t;
+        m->samples[r] = elapsed / m->inner;
+        if (r + 1 >= opts->min_reps && harness_now() - start > opts->max_time) {
+            r++;
+            break;
+        }
+    }
+    m->reps = r;
+    for (i = 0; i < N_PERF; i++)
+        m->counters[i] = -1;
+    if (opts->perf) {
+        perf_stop(opts->perf, m->counters);
+        for (i = 0; i < N_PERF; i++)
+            if (m->counters[i] >= 0)
+                m->counters[i] /= (double)m->reps * m->inner;
+    }
+
+    sorted = malloc(m->reps * sizeof(double));
+    for (r = 0, sum = 0; r < m->reps; r++) {
+        sorted[r] = m->samples[r];
+        sum += m->samples[r];
+    }
+    qsort(sorted, m->reps, sizeof(double), compare_double);
+    m->mean = sum / m->reps;
+    for (r = 0, sq = 0; r < m->reps; r++)
+        sq += (m->samples[r] - m->mean) * (m->samples[r] - m->mean);
+    m->stddev = m->reps > 1 ? sqrt(sq / (m->reps - 1)) : 0;
+    m->min = sorted[0];
+    m->median = quantile(m->reps, sorted, 0.5);
+    m->q1 = quantile(m->reps, sorted, 0.25);
+    m->q3 = quantile(m->reps, sorted, 0.75);
+    free(sorted);
+}
+
+void harness_free(struct measurement *m)
+{
+    free(m->samples);
+    m->samples = NULL;
+}
+
+#define PEAK_N 4096
+#define PEAK_BYTES (256 << 20)
+
+/* harness_measure_peaks: estimate the peak throughput of the machine, one
+ * core, with independent multiply-adds that the compiler can vectorize,
+ * and the memory bandwidth with a sum over an array much larger than the
+ * caches */
+void harness_measure_peaks(struct machine_peaks *peaks)
+{
+    static float a[PEAK_N], b[PEAK_N];
+    float *big;
+    double t, best;
+    volatile float sink;
+    float sum;
+    long i, n = PEAK_BYTES / sizeof(float);
+    int r, k;
+
+    for (i = 0; i < PEAK_N; i++)
+        a[i] = b[i] = 1e-3 * i;
+    for (r = 0, best = 1e9; r < 5; r++) {
+        t = harness_now();
+        for (k = 0; k < 1000; k++)
+            for (i = 0; i < PEAK_N; i++)
+                a[i] = a[i] * 0.999f + b[i];
+        t = harness_now() - t;
+        if (t < best)
+            best = t;
+    }
+    sink = a[PEAK_N / 2];
+    peaks->gflops = 2.0 * PEAK_N * 1000 / best * 1e-9;
+
+    big = malloc(PEAK_BYTES);
+    memset(big, 0, PEAK_BYTES);
+    for (r = 0, best = 1e9; r < 3; r++) {
+        t = harness_now();
+        for (i = 0, sum = 0; i < n; i++)
+            sum += big[i];
+        t = harness_now() - t;
+        sink = sum;
+        if (t < best)
+            best = t;
+    }
+    (void)sink;
+    free(big);
+    peaks->gbytes = PEAK_BYTES / best * 1e-9;
+}
+
+void harness_json_begin(FILE *fp, struct machine_peaks *peaks)
+{
+    struct utsname u;
+    char host[256] = "unknown";
+
+    gethostname(host, sizeof(host));
+    uname(&u);
+    fprintf(fp, "{\n  \"host\": \"%s\",\n  \"system\": \"%s %s %s\",\n" \
+            "  \"cpus\": %ld,\n", host, u.sysname,
+            u.release, u.machine, sysconf(_SC_NPROCESSORS_ONLN));
+    if (peaks)
+        fprintf(fp, "  \"peak_gflops\": %.3f,\n  \"peak_gbytes_per_s\": %.3f,\n",
+                peaks->gflops, peaks->gbytes);
+    fprintf(fp, "  \"benchmarks\": [");
+    machine = peaks;
+    n_results = 0;
+}
+
+/* print_counters: print the hardware counters per call, if any, and the
+ * figures derived from them and from the flops of the call */
+static void print_counters(FILE *fp, struct bench_info *info,
+                           struct measurement *m)
+{
+    double *c = m->counters, gflops, bytes, intensity, roof;
+    int i, any = 0;
+
+    for (i = 0; i < N_PERF; i++) {
+        if (c[i] < 0)
+            continue;
+        fprintf(fp, "%s\"%s\": %.1f", any++ ? ", " : ",\n     \"counters\": {",
+                perf_names[i], c[i]);
+    }
+    if (any)
+        fprintf(fp, "}");
+    if (c[PERF_CYCLES] > 0 && c[PERF_INSTRUCTIONS] >= 0)
+        fprintf(fp, ", \"ipc\": %.3f", c[PERF_INSTRUCTIONS] / c[PERF_CYCLES]);
+    if (info->flops <= 0)
+        return;
+    gflops = info->flops / m->median * 1e-9;
+    fprintf(fp, ", \"gflops\": %.3f", gflops);
+    /* memory traffic is estimated from the misses of the last level cache,
+     * one cache line each */
+    if (c[PERF_LLC_MISSES] < 0)
+        return;
+    bytes = c[PERF_LLC_MISSES] * 64;
+    if (info->samples > 0)
+        fprintf(fp, ", \"bytes_per_sample\": %.1f", bytes / info->samples);
+    if (bytes <= 0 || !machine)
+        return;
+    intensity = info->flops / bytes;
+    roof = intensity * machine->gbytes;
+    if (roof > machine->gflops)
+        roof = machine->gflops;
+    fprintf(fp, ", \"arithmetic_intensity\": %.3f, \"roofline_gflops\": " \
+            "%.3f, \"roofline_fraction\": %.3f, \"bound\": \"%s\"",
+            intensity, roof, gflops / roof,
+            intensity * machine->gbytes < machine->gflops ?
+            "memory" : "compute");
+}
+
+void harness_json_result(FILE *fp, struct bench_info *info,
+                         struct measurement *m)
+{
+    int r;
+
+    fprintf(fp, "%s\n    {\"name\": \"%s\", \"topology\": \"%s\", " \
+            "\"batch\": %d, \"threads\": %d,\n", n_results++ ? "," : "",
+            info->name, info->topology ? info->topology : "",
+            info->batch, info->threads);
+    if (info->memory)
+        fprintf(fp, "     \"memory\": \"%s\",\n", info->memory);
+    fprintf(fp, "     \"reps\": %d, \"inner\": %ld, \"median_ns\": %.1f, " \
+            "\"min_ns\": %.1f, \"mean_ns\": %.1f, \"stddev_ns\": %.1f,\n",
+            m->reps, m->inner, m->median * 1e9, m->min * 1e9,
+            m->mean * 1e9, m->stddev * 1e9);
+    fprintf(fp, "     \"q1_ns\": %.1f, \"q3_ns\": %.1f", m->q1 * 1e9,
+            m->q3 * 1e9);
+    if (info->samples > 0)
+        fprintf(fp, ", \"ns_per_sample\": %.2f, \"samples_per_s\": %.1f",
+                m->median * 1e9 / info->samples,
+                info->samples / m->median);
+    print_counters(fp, info, m);
+    fprintf(fp, ",\n     \"samples_ns\": [");
+    for (r = 0; r < m->reps; r++)
+        fprintf(fp, "%s%.1f", r ? ", " : "", m->samples[r] * 1e9);
+    fprintf(fp, "]}");
+    fflush(fp);
+}
+
+void harness_json_end(FILE *fp)
+{
+    fprintf(fp, "\n  ]\n}\n");
+}
@@ -0,0 +1,65 @@
+#ifndef __HARNESS__
+#define __HARNESS__
+
+#include <stdio.h>
+#include "perf.h"
+
+/* Timing harness shared by the benchmark programs. */
+
+struct harness_opts {
+    int warmup;         /* calls before measuring */
+    int reps;           /* repetitions to measure */
+    int min_reps;       /* repetitions to measure even over max_time */
+    double min_rep;     /* seconds; calls are grouped to last at least this */
+    double max_time;    /* seconds; stop repeating after this long */
+    struct perf_counters *perf; /* counters to read, or NULL */
+};
+
+/* Peak floating point throughput and memory bandwidth of the machine, used
+ * to place the benchmarks in the roofline model */
+struct machine_peaks {
+    double gflops;
+    double gbytes;      /* GB/s */
+};
+
+struct measurement {
+    int reps;
+    long inner;         /* calls per repetition */
+    double median;      /* seconds per call */
+    double min;
+    double mean;
+    double stddev;
+    double q1, q3;      /* quartiles */
+    double *samples;    /* seconds per call of each repetition */
+    double counters[N_PERF];    /* per call, -1 if not available */
+};
+
+struct bench_info {
+    const char *name;
+    const char *topology;
+    int batch;
+    int threads;
+    long samples;       /* samples processed per call */
+    double flops;       /* floating point operations per call, or 0 */
+    const char *memory; /* placement of the memory (see mem.h), or NULL */
+};
+
+void harness_default_opts(struct harness_opts *opts);
+
+double harness_now(void);
+
+void harness_measure(void fn(void *), void *arg, struct harness_opts *opts,
+                     struct measurement *m);
+
+void harness_free(struct measurement *m);
+
+void harness_measure_peaks(struct machine_peaks *peaks);
+
+void harness_json_begin(FILE *fp, struct machine_peaks *peaks);
+
+void harness_json_result(FILE *fp, struct bench_info *info,
+                         struct measurement *m);
+
+void harness_json_end(FILE *fp);
+
+#endif
@@ -0,0 +1,117 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "perf.h"
+
+const char *perf_names[N_PERF] = { "cycles", "instructions", "l1d_misses",
+                                   "llc_misses", "dtlb_misses",
+                                   "fp_vector" };
+
+static int open_counter(uint32_t type, uint64_t config)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.inherit = 1;   /* count the threads of the pool too */
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED
+                       | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+#define CACHE_EVENT(cache, op, result) \
+    ((cache) | (op) << 8 | (result) << 16)
+
+/* is_intel: whether the processor is an Intel one, which is where we know
+ * the raw event for vector floating point instructions */
+static int is_intel(void)
+{
+    char line[256];
+    int intel = 0;
+    FILE *fp = fopen("/proc/cpuinfo", "r");
+
+    if (!fp)
+        return 0;
+    while (fgets(line, sizeof(line), fp))
+        if (strncmp(line, "vendor_id", 9) == 0) {
+            intel = strstr(line, "GenuineIntel") != NULL;
+            break;
+        }
+    fclose(fp);
+    return intel;
+}
+
+/* perf_open: open the counters. Returns how many could be opened */
+int perf_open(struct perf_counters *pc)
+{
+    int i;
+
+    pc->fd[PERF_CYCLES] = open_counter(PERF_TYPE_HARDWARE,
+                                       PERF_COUNT_HW_CPU_CYCLES);
+    pc->fd[PERF_INSTRUCTIONS] = open_counter(PERF_TYPE_HARDWARE,
+                                             PERF_COUNT_HW_INSTRUCTIONS);
+    pc->fd[PERF_L1D_MISSES] = open_counter(PERF_TYPE_HW_CACHE,
+            CACHE_EVENT(PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_OP_READ,
+                        PERF_COUNT_HW_CACHE_RESULT_MISS));
+    pc->fd[PERF_LLC_MISSES] = open_counter(PERF_TYPE_HARDWARE,
+                                           PERF_COUNT_HW_CACHE_MISSES);
+    pc->fd[PERF_DTLB_MISSES] = open_counter(PERF_TYPE_HW_CACHE,
+            CACHE_EVENT(PERF_COUNT_HW_CACHE_DTLB, PERF_COUNT_HW_CACHE_OP_READ,
+                        PERF_COUNT_HW_CACHE_RESULT_MISS));
+    /* FP_ARITH_INST_RETIRED, 128 and 256 bit packed, single and double */
+    pc->fd[PERF_FP_VECTOR] = is_intel() ?
+            open_counter(PERF_TYPE_RAW, 0x3cc7) : -1;
+    for (i = pc->n_open = 0; i < N_PERF; i++)
+        if (pc->fd[i] >= 0)
+            pc->n_open++;
+    return pc->n_open;
+}
+
+void perf_close(struct perf_counters *pc)
+{
+    int i;
+    for (i = 0; i < N_PERF; i++)
+        if (pc->fd[i] >= 0)
+            close(pc->fd[i]);
+    pc->n_open = 0;
+}
+
+void perf_start(struct perf_counters *pc)
+{
+    int i;
+    for (i = 0; i < N_PERF; i++) {
+        if (pc->fd[i] < 0)
+            continue;
+        ioctl(pc->fd[i], PERF_EVENT_IOC_RESET, 0);
+        ioctl(pc->fd[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+}
+
+/* perf_stop: stop the counters and save their values since perf_start
+ * (-1 for the ones not available). When the kernel had to multiplex the
+ * counters, the values are scaled to the whole time */
+void perf_stop(struct perf_counters *pc, double values[N_PERF])
+{
+    uint64_t data[3];   /* value, time enabled, time running */
+    int i;
+
+    for (i = 0; i < N_PERF; i++) {
+        values[i] = -1;
+        if (pc->fd[i] < 0)
+            continue;
+        ioctl(pc->fd[i], PERF_EVENT_IOC_DISABLE, 0);
+        if (read(pc->fd[i], data, sizeof(data)) != sizeof(data)
+                || data[2] == 0)
+            continue;
+        values[i] = (double)data[0] * data[1] / data[2];
+    }
+}
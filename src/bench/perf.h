@@ -0,0 +1,33 @@
+#ifndef __PERF__
+#define __PERF__
+
+/* Hardware performance counters, read through perf_event_open. Each
+ * counter is opened on its own, so that the ones the machine (or the
+ * permissions of the user) do not allow are simply left out. */
+
+enum perf_counter {
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_L1D_MISSES,
+    PERF_LLC_MISSES,
+    PERF_DTLB_MISSES,
+    PERF_FP_VECTOR,     /* packed floating point instructions retired */
+    N_PERF
+};
+
+struct perf_counters {
+    int fd[N_PERF];     /* -1 if the counter is not available */
+    int n_open;
+};
+
+extern const char *perf_names[N_PERF];
+
+int perf_open(struct perf_counters *pc);
+
+void perf_close(struct perf_counters *pc);
+
+void perf_start(struct perf_counters *pc);
+
+void perf_stop(struct perf_counters *pc, double values[N_PERF]);
+
+#endif
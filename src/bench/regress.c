@@ -0,0 +1,452 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <sched.h>
+#include <unistd.h>
+#include "neuron.h"
+#include "matrix.h"
+#include "harness.h"
+
+/* regress: performance regression check. Runs a fixed set of benchmarks
+ * and compares them with the results of an earlier run saved as baseline:
+ *
+ *      regress baseline.json   compare, saving the baseline if there is
+ *                              none yet
+ *      regress -s baseline.json        save a new baseline
+ *
+ * To keep the noise down the process is pinned to a single CPU, every
+ * benchmark is repeated many times, and the results are summarized by
+ * their median and interquartile range. A benchmark has regressed if its
+ * times are larger than those of the baseline according to a one-sided
+ * Mann-Whitney U test at level alpha, and its median is slower by more
+ * than min_change. The exit status is 1 if any benchmark regressed.
+ *
+ * The baseline is the same JSON written by bench, so it can be looked at
+ * with the same tools.
+ */
+
+#define DEFAULT_REPS 15
+#define DEFAULT_ALPHA 0.01
+#define DEFAULT_MIN_CHANGE 0.05
+#define MAX_RESULTS 32
+/* A tenth of an MNIST epoch, which is as slow as a whole one per sample
+ * but affordable to repeat */
+#define EPOCH_SIZE 6000
+#define EPOCH_BATCH 10
+#define KERNEL_LEN 4096
+#define KERNEL_DIM 64
+#define ETA 0.01
+
+struct result {
+    char name[64];
+    char topology[32];
+    int batch;
+    int n;
+    double *samples;    /* nanoseconds per call */
+};
+
+struct ctx {
+    struct network *net;
+    int batch;
+    float *inputs, *outputs, *out, *scratch;
+    char path[64];
+    float *v1, *v2, *v3;
+    double (*m1)[KERNEL_DIM], (*m2)[KERNEL_DIM], (*m3)[KERNEL_DIM];
+};
+
+static struct harness_opts opts;
+static struct result current[MAX_RESULTS];
+static int n_current;
+static FILE *out;
+
+static void fill_random(int n, float *v)
+{
+    while (n-- > 0)
+        v[n] = (float)rand() / (float)RAND_MAX;
+}
+
+static void run_sgd_epoch(void *arg)
+{
+    struct ctx *c = arg;
+    network_SGD(c->net, EPOCH_SIZE, EPOCH_BATCH, 1,
+                (float (*)[784])c->inputs, (float (*)[10])c->outputs, ETA,
+                NULL);
+}
+
+static void run_infer(void *arg)
+{
+    struct ctx *c = arg;
+    feedforward_batch(c->net, c->batch, (float (*)[784])c->inputs,
+                      (float (*)[10])c->out, c->scratch);
+}
+
+static void run_save(void *arg)
+{
+    struct ctx *c = arg;
+    network_save_to_file(c->net, c->path);
+}
+
+static void run_load(void *arg)
+{
+    struct ctx *c = arg;
+    network_load_from_file(c->net, c->path);
+}
+
+static void run_vprod(void *arg)
+{
+    struct ctx *c = arg;
+    c->v3[0] = vprod(KERNEL_LEN, c->v1, c->v2);
+}
+
+static void run_mprod(void *arg)
+{
+    struct ctx *c = arg;
+    mprod(KERNEL_DIM, KERNEL_DIM, c->m1, KERNEL_DIM, KERNEL_DIM, c->m2, c->m3);
+}
+
+/* bench: measure fn, write the result and keep its samples for the
+ * comparison */
+static void bench(char *name, char *topology, int batch, void fn(void *),
+                  struct ctx *c, long samples, double flops)
+{
+    struct bench_info info = { name, topology, batch, 1, samples, flops,
+                               NULL };
+    struct measurement m;
+    struct result *r = &current[n_current++];
+    int i;
+
+    fprintf(stderr, "%s/%s batch %d\n", name, topology, batch);
+    harness_measure(fn, c, &opts, &m);
+    harness_json_result(out, &info, &m);
+    snprintf(r->name, sizeof(r->name), "%s", name);
+    snprintf(r->topology, sizeof(r->topology), "%s", topology);
+    r->batch = batch;
+    r->n = m.reps;
+    r->samples = malloc(m.reps * sizeof(double));
+    for (i = 0; i < m.reps; i++)
+        r->samples[i] = m.samples[i] * 1e9;
+    harness_free(&m);
+}
+
+static void run_all(void)
+{
+    int sizes[3] = { 784, 30, 10 };
+    struct ctx c = { 0 };
+    double w;
+    int i, j;
+
+    srand(1);
+    c.net = create_network(3, sizes);
+    w = 2.0 * network_n_weights(c.net);
+    c.inputs = malloc(EPOCH_SIZE * 784 * sizeof(float));
+    c.outputs = malloc(EPOCH_SIZE * 10 * sizeof(float));
+    c.out = malloc(256 * 10 * sizeof(float));
+    c.scratch = malloc(2 * 256 * network_max_neurons(c.net) * sizeof(float));
+    fill_random(EPOCH_SIZE * 784, c.inputs);
+    fill_random(EPOCH_SIZE * 10, c.outputs);
+    snprintf(c.path, sizeof(c.path), "/tmp/regress-%d.net", (int)getpid());
+
+    bench("network_SGD_epoch", "mnist", EPOCH_BATCH, run_sgd_epoch, &c,
+          EPOCH_SIZE, 3 * w * EPOCH_SIZE);
+    c.batch = 1;
+    bench("feedforward_batch", "mnist", 1, run_infer, &c, 1, w);
+    c.batch = 256;
+    bench("feedforward_batch", "mnist", 256, run_infer, &c, 256, w * 256);
+    network_save_to_file(c.net, c.path);
+    bench("network_save_to_file", "mnist", 1, run_save, &c, 0, 0);
+    bench("network_load_from_file", "mnist", 1, run_load, &c, 0, 0);
+    unlink(c.path);
+
+    c.v1 = malloc(KERNEL_LEN * sizeof(float));
+    c.v2 = malloc(KERNEL_LEN * sizeof(float));
+    c.v3 = malloc(KERNEL_LEN * sizeof(float));
+    fill_random(KERNEL_LEN, c.v1);
+    fill_random(KERNEL_LEN, c.v2);
+    c.m1 = malloc(KERNEL_DIM * sizeof(*c.m1));
+    c.m2 = malloc(KERNEL_DIM * sizeof(*c.m2));
+    c.m3 = malloc(KERNEL_DIM * sizeof(*c.m3));
+    for (i = 0; i < KERNEL_DIM; i++)
+        for (j = 0; j < KERNEL_DIM; j++)
+            c.m1[i][j] = c.m2[j][i] = (double)rand() / RAND_MAX;
+    bench("vprod", "kernels", 1, run_vprod, &c, 0, 2 * KERNEL_LEN);
+    bench("mprod", "kernels", 1, run_mprod, &c, 0,
+          (double)KERNEL_DIM * KERNEL_DIM * (KERNEL_DIM + 1));
+
+    free(c.v1);
+    free(c.v2);
+    free(c.v3);
+    free(c.m1);
+    free(c.m2);
+    free(c.m3);
+    free(c.inputs);
+    free(c.outputs);
+    free(c.out);
+    free(c.scratch);
+    destroy_network(c.net);
+}
+
+/* read_baseline: read the results in a JSON file written by the harness.
+ * Only the fields needed here are looked for. Returns the number of
+ * results, or -1 if the file cannot be read */
+static int read_baseline(char *filename, struct result *results)
+{
+    FILE *fp = fopen(filename, "r");
+    char *buf, *p, *q, *end;
+    long size;
+    int n = 0, cap;
+
+    if (!fp)
+        return -1;
+    fseek(fp, 0, SEEK_END);
+    size = ftell(fp);
+    rewind(fp);
+    buf = malloc(size + 1);
+    if (fread(buf, 1, size, fp) != size) {
+        free(buf);
+        fclose(fp);
+        return -1;
+    }
+    buf[size] = '\0';
+    fclose(fp);
+
+    for (p = buf; n < MAX_RESULTS && (p = strstr(p, "{\"name\": \"")); n++) {
+        if (sscanf(p, "{\"name\": \"%63[^\"]\", \"topology\": \"%31[^\"]\", " \
+                   "\"batch\": %d", results[n].name, results[n].topology,
+                   &results[n].batch) != 3
+                || !(p = strstr(p, "\"samples_ns\": [")))
+            break;
+        p += strlen("\"samples_ns\": [");
+        cap = 16;
+        results[n].samples = malloc(cap * sizeof(double));
+        for (results[n].n = 0; ; results[n].n++) {
+            q = p;
+            while (*q == ' ' || *q == ',')
+                q++;
+            if (*q == ']')
+                break;
+            if (results[n].n == cap) {
+                cap *= 2;
+                results[n].samples = realloc(results[n].samples,
+                                             cap * sizeof(double));
+            }
+            results[n].samples[results[n].n] = strtod(q, &end);
+            if (end == q)
+                break;
+            p = end;
+        }
+    }
+    free(buf);
+    return n;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/* quartiles: the median and the interquartile range of n values */
+static void quartiles(int n, double *values, double *median, double *iqr)
+{
+    double sorted[n];
+    memcpy(sorted, values, n * sizeof(double));
+    qsort(sorted, n, sizeof(double), compare_double);
+    *median = n % 2 ? sorted[n/2] : (sorted[n/2-1] + sorted[n/2]) / 2;
+    *iqr = sorted[(3 * n) / 4] - sorted[n / 4];
+}
+
+struct ranked {
+    double value;
+    int from_a;
+};
+
+static int compare_ranked(const void *a, const void *b)
+{
+    return compare_double(&((const struct ranked *)a)->value,
+                          &((const struct ranked *)b)->value);
+}
+
+/* mann_whitney: p-value of the one-sided Mann-Whitney U test of whether
+ * the values of a tend to be larger than those of b, by the normal
+ * approximation with correction for ties */
+static double mann_whitney(int na, double *a, int nb, double *b)
+{
+    int n = na + nb, i, j, k;
+    struct ranked pooled[n];
+    double u, mean, var, ties = 0, rank_a = 0, z;
+
+    for (i = 0; i < n; i++) {
+        pooled[i].value = i < na ? a[i] : b[i - na];
+        pooled[i].from_a = i < na;
+    }
+    qsort(pooled, n, sizeof(struct ranked), compare_ranked);
+    /* tied values get the average of their ranks */
+    for (i = 0; i < n; i = k) {
+        for (k = i + 1; k < n && pooled[k].value == pooled[i].value; k++)
+            ;
+        for (j = i; j < k; j++)
+            if (pooled[j].from_a)
+                rank_a += (i + k + 1) / 2.0;
+        ties += (double)(k - i) * (k - i) * (k - i) - (k - i);
+    }
+    u = rank_a - na * (na + 1) / 2.0;
+    mean = na * nb / 2.0;
+    var = na * nb / 12.0 * ((n + 1) - ties / ((double)n * (n - 1)));
+    if (var <= 0)
+        return 1;
+    z = (u - mean - 0.5) / sqrt(var);
+    return 0.5 * erfc(z / sqrt(2));
+}
+
+/* compare: compare the current results with the baseline and print a
+ * table. Returns the number of regressions */
+static int compare(struct result *base, int n_base, double alpha,
+                   double min_change)
+{
+    double bmed, biqr, cmed, ciqr, change, p;
+    int i, j, regressions = 0;
+    char *verdict;
+
+    printf("%-24s %-8s %5s %14s %12s %14s %12s %8s %9s\n", "benchmark",
+           "topology", "batch", "baseline_ns", "iqr", "current_ns", "iqr",
+           "change", "p_slower");
+    for (i = 0; i < n_current; i++) {
+        for (j = 0; j < n_base; j++)
+            if (strcmp(base[j].name, current[i].name) == 0
+                    && strcmp(base[j].topology, current[i].topology) == 0
+                    && base[j].batch == current[i].batch)
+                break;
+        if (j == n_base || base[j].n < 2 || current[i].n < 2) {
+            printf("%-24s %-8s %5d   not in the baseline\n",
+                   current[i].name, current[i].topology, current[i].batch);
+            continue;
+        }
+        quartiles(base[j].n, base[j].samples, &bmed, &biqr);
+        quartiles(current[i].n, current[i].samples, &cmed, &ciqr);
+        change = cmed / bmed - 1;
+        if ((p = mann_whitney(current[i].n, current[i].samples,
+                              base[j].n, base[j].samples)) < alpha
+                && change > min_change) {
+            verdict = "REGRESSION";
+            regressions++;
+        } else if (mann_whitney(base[j].n, base[j].samples, current[i].n,
+                                current[i].samples) < alpha
+                   && -change > min_change) {
+            verdict = "faster";
+        } else {
+            verdict = "";
+        }
+        printf("%-24s %-8s %5d %14.1f %12.1f %14.1f %12.1f %+7.1f%% %9.4f %s\n",
+               current[i].name, current[i].topology, current[i].batch, bmed,
+               biqr, cmed, ciqr, change * 100, p, verdict);
+    }
+    return regressions;
+}
+
+/* pin: run on a single CPU, by default the last one we are allowed to use,
+ * which usually gets fewer interrupts than the first. Returns the CPU, or
+ * -1 if we could not pin */
+static int pin(int cpu)
+{
+    cpu_set_t set;
+    int i;
+
+    if (sched_getaffinity(0, sizeof(set), &set) < 0)
+        return -1;
+    if (cpu < 0)
+        for (i = 0; i < CPU_SETSIZE; i++)
+            if (CPU_ISSET(i, &set))
+                cpu = i;
+    if (cpu < 0)
+        return -1;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return sched_setaffinity(0, sizeof(set), &set) < 0 ? -1 : cpu;
+}
+
+/* check_governor: warn if the frequency of the CPU may change under us */
+static void check_governor(int cpu)
+{
+    char path[128], governor[32] = "";
+    FILE *fp;
+
+    snprintf(path, sizeof(path),
+             "/sys/devices/system/cpu/cpu%d/cpufreq/scaling_governor", cpu);
+    if (!(fp = fopen(path, "r")))
+        return;
+    if (fscanf(fp, "%31s", governor) == 1
+            && strcmp(governor, "performance") != 0)
+        fprintf(stderr, "regress: cpu %d uses the %s governor, results " \
+                "may be noisy\n", cpu, governor);
+    fclose(fp);
+}
+
+static void usage(char *prog)
+{
+    fprintf(stderr, "usage: %s [-s] [-c cpu] [-r reps] [-a alpha] " \
+            "[-d min_change] [-o results.json] baseline.json\n", prog);
+    exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+    struct result base[MAX_RESULTS];
+    double alpha = DEFAULT_ALPHA, min_change = DEFAULT_MIN_CHANGE;
+    char *baseline, *output = NULL, tmp[64];
+    int save = 0, cpu = -1, n_base = -1, regressions;
+    int opt;
+
+    harness_default_opts(&opts);
+    opts.reps = opts.min_reps = DEFAULT_REPS;
+    opts.max_time = 1e9;
+    opts.min_rep = 0.01;
+    while ((opt = getopt(argc, argv, "sc:r:a:d:o:")) != -1) {
+        switch (opt) {
+        case 's': save = 1; break;
+        case 'c': cpu = atoi(optarg); break;
+        case 'r': opts.reps = opts.min_reps = atoi(optarg); break;
+        case 'a': alpha = atof(optarg); break;
+        case 'd': min_change = atof(optarg); break;
+        case 'o': output = optarg; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (optind != argc-1 || opts.reps < 2 || alpha <= 0)
+        usage(argv[0]);
+    baseline = argv[optind];
+    if (!save && (n_base = read_baseline(baseline, base)) < 0) {
+        fprintf(stderr, "regress: no baseline in %s, saving one\n", baseline);
+        save = 1;
+    }
+
+    if ((cpu = pin(cpu)) < 0)
+        fprintf(stderr, "regress: could not pin to a cpu\n");
+    else
+        check_governor(cpu);
+    /* the results go to the baseline, to the given file, or nowhere */
+    if (!save && !output) {
+        snprintf(tmp, sizeof(tmp), "/tmp/regress-%d.json", (int)getpid());
+        output = tmp;
+    }
+    if (!(out = fopen(save ? baseline : output, "w"))) {
+        perror(save ? baseline : output);
+        return 2;
+    }
+    harness_json_begin(out, NULL);
+    run_all();
+    harness_json_end(out);
+    fclose(out);
+    if (output == tmp)
+        unlink(tmp);
+    if (save) {
+        fprintf(stderr, "regress: baseline saved in %s\n", baseline);
+        return 0;
+    }
+
+    regressions = compare(base, n_base, alpha, min_change);
+    if (regressions)
+        printf("%d regression%s\n", regressions, regressions > 1 ? "s" : "");
+    return regressions ? 1 : 0;
+}
@@ -0,0 +1,317 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "cache.h"
+#include "neuron.h"
+#include "trace.h"
+
+#define CACHE_BATCH 64   /* samples computed by each task */
+
+struct build_job {
+    struct network *net;
+    struct pool *pool;
+    int layer;
+    int encoding;
+    long n;
+    float *input;
+    char *data;
+};
+
+/* to_half: x as a half precision float, rounded to the nearest even */
+static uint16_t to_half(float x)
+{
+    uint32_t u, mant, rem, half, halfway;
+    uint16_t sign;
+    int exp, shift;
+
+    memcpy(&u, &x, sizeof(u));
+    sign = (u >> 16) & 0x8000;
+    if ((u & 0x7fffffff) > 0x7f800000)
+        return sign | 0x7e00;
+    exp = (int)((u >> 23) & 0xff) - 127 + 15;
+    mant = u & 0x7fffff;
+    if (exp >= 31)
+        return sign | 0x7c00;
+    if (exp <= 0) {
+        /* subnormal, or too small even for that */
+        if (exp < -10)
+            return sign;
+        mant |= 0x800000;
+        shift = 14 - exp;
+        half = mant >> shift;
+        rem = mant & ((1u << shift) - 1);
+        halfway = 1u << (shift - 1);
+        if (rem > halfway || (rem == halfway && (half & 1)))
+            half++;
+        return sign | half;
+    }
+    half = (uint32_t)exp << 10 | mant >> 13;
+    rem = mant & 0x1fff;
+    /* a carry into the exponent is still right, up to infinity */
+    if (rem > 0x1000 || (rem == 0x1000 && (half & 1)))
+        half++;
+    return sign | half;
+}
+
+static float from_half(uint16_t h)
+{
+    uint32_t u, sign = (uint32_t)(h & 0x8000) << 16;
+    int exp = (h >> 10) & 0x1f, mant = h & 0x3ff;
+    float x;
+
+    if (exp == 0) {
+        x = ldexpf(mant, -24);
+        return sign ? -x : x;
+    }
+    if (exp == 31)
+        u = sign | 0x7f800000 | (uint32_t)mant << 13;
+    else
+        u = sign | (uint32_t)(exp - 15 + 127) << 23 | (uint32_t)mant << 13;
+    memcpy(&x, &u, sizeof(x));
+    return x;
+}
+
+static size_t value_size(int encoding)
+{
+    return encoding == CACHE_F16 ? sizeof(uint16_t) : sizeof(float);
+}
+
+/* build_task: the activations of a batch of samples, into the file */
+static void build_task(void *arg, int task, int thread)
+{
+    struct build_job *job = arg;
+    struct network *net = job->net;
+    long first = (long)task * CACHE_BATCH;
+    int n = job->n - first < CACHE_BATCH ? job->n - first : CACHE_BATCH;
+    int max = network_max_neurons(net), l, i;
+    int dim = net->layers[job->layer]->n_neurons;
+    float *scratch = pool_scratch(job->pool, thread, 2 * n * max);
+    float *cur = job->input + first * net->layers[0]->n_neurons, *next;
+    uint16_t *half;
+
+    for (l = 1; l <= job->layer; l++) {
+        next = scratch + (l % 2) * n * max;
+        feedforward_layer(net, l, n, cur, next, 1);
+        cur = next;
+    }
+    if (job->encoding == CACHE_F32) {
+        memcpy(job->data + first * dim * sizeof(float), cur,
+               (size_t)n * dim * sizeof(float));
+        return;
+    }
+    half = (uint16_t *)job->data + first * dim;
+    for (i = 0; i < n * dim; i++)
+        half[i] = to_half(cur[i]);
+}
+
+/* cache_build: compute the activations of the given layer of net for
+ * the n samples of input, and write them to a feature cache in path, as
+ * 32 or 16 bit floats. The batches are spread among the threads of pool,
+ * or of a pool of one per processor if it is NULL. Returns -1 on error */
+int cache_build(struct network *net, int layer, int encoding, long n,
+                float *input, char *path, struct pool *pool)
+{
+    struct cache_header header;
+    struct build_job job;
+    struct pool *own = NULL;
+    size_t len;
+    char *map;
+    int fd;
+
+    if (layer < 1 || layer >= net->n_layers || n < 1
+            || (encoding != CACHE_F32 && encoding != CACHE_F16)) {
+        fprintf(stderr, "cache_build: layer %d of %d, %ld samples\n",
+                layer, net->n_layers, n);
+        return -1;
+    }
+    header.magic = CACHE_MAGIC;
+    header.encoding = encoding;
+    header.layer = layer;
+    header.dim = net->layers[layer]->n_neurons;
+    header.n_samples = n;
+    len = sizeof(header) + n * header.dim * value_size(encoding);
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || ftruncate(fd, len) < 0) {
+        fprintf(stderr, "Could not create file %s\n", path);
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Could not map file %s\n", path);
+        return -1;
+    }
+    memcpy(map, &header, sizeof(header));
+    if (!pool)
+        pool = own = pool_create(0);
+    job.net = net;
+    job.pool = pool;
+    job.layer = layer;
+    job.encoding = encoding;
+    job.n = n;
+    job.input = input;
+    job.data = map + sizeof(header);
+    TRACE_BEGIN("cache", layer);
+    pool_run(pool, (n + CACHE_BATCH - 1) / CACHE_BATCH, build_task,
+             &job);
+    TRACE_END();
+    if (own)
+        pool_destroy(own);
+    if (munmap(map, len) < 0) {
+        fprintf(stderr, "Could not write file %s\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+/* cache_open: map a feature cache written by cache_build. Returns
+ * NULL on error */
+struct cache *cache_open(char *path)
+{
+    struct cache *f;
+    struct cache_header header;
+    struct stat st;
+    void *map;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0 || fstat(fd, &st) < 0
+            || (size_t)st.st_size < sizeof(header)) {
+        fprintf(stderr, "Could not open file %s\n", path);
+        if (fd >= 0)
+            close(fd);
+        return NULL;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Could not map file %s\n", path);
+        return NULL;
+    }
+    memcpy(&header, map, sizeof(header));
+    if (header.magic != CACHE_MAGIC
+            || (header.encoding != CACHE_F32
+                && header.encoding != CACHE_F16)
+            || (size_t)st.st_size != sizeof(header) + header.n_samples
+                                     * header.dim
+                                     * value_size(header.encoding)) {
+        fprintf(stderr, "%s is not a feature cache\n", path);
+        munmap(map, st.st_size);
+        return NULL;
+    }
+    f = malloc(sizeof(struct cache));
+    f->header = header;
+    f->map = map;
+    f->len = st.st_size;
+    f->data = (char *)map + sizeof(header);
+    return f;
+}
+
+void cache_close(struct cache *f)
+{
+    if (!f)
+        return;
+    munmap(f->map, f->len);
+    free(f);
+}
+
+/* cache_get: the activations of count samples, from the given one, as
+ * 32 bit floats */
+void cache_get(struct cache *f, long sample, int count, float *out)
+{
+    size_t first = sample * f->header.dim, n = (size_t)count * f->header.dim;
+    uint16_t *half = (uint16_t *)f->data + first;
+    size_t i;
+
+    if (f->header.encoding == CACHE_F32) {
+        memcpy(out, (float *)f->data + first, n * sizeof(float));
+        return;
+    }
+    for (i = 0; i < n; i++)
+        out[i] = from_half(half[i]);
+}
+
+/* cache_SGD: train the layers of net above the layer of the cache, as
+ * network_SGD would with the activations of the cache as their input and
+ * output as the expected outputs of each sample. The samples are visited
+ * in a new random order in every epoch; the cache is not modified. If fun
+ * is given, it is called at the end of every epoch with the whole
+ * network */
+void cache_SGD(struct network *net, struct cache *f, int batch_size,
+               int epochs, float *output, float eta,
+               void fun(struct network *, int))
+{
+    int layer = f->header.layer, dim = f->header.dim;
+    int n_out = net->layers[net->n_layers-1]->n_neurons;
+    int sizes[net->n_layers], l, b, epoch;
+    long n = f->header.n_samples, offset = 0, i, j, k, *order;
+    struct network *head;
+    float *input, *target;
+
+    if (layer >= net->n_layers-1 || net->layers[layer]->n_neurons != dim
+            || batch_size < 1 || batch_size > n) {
+        fprintf(stderr, "cache_SGD: the cache does not fit the " \
+                "network\n");
+        return;
+    }
+    /* a network of the layers from the cached one up, whose parameters
+     * are the tail of those of net */
+    for (l = layer; l < net->n_layers; l++)
+        sizes[l - layer] = net->layers[l]->n_neurons;
+    head = create_network(net->n_layers - layer, sizes);
+    for (l = 1; l <= layer; l++)
+        offset += (long)(net->layers[l-1]->n_neurons + 1)
+                  * net->layers[l]->n_neurons;
+    memcpy(head->params, net->params + offset, head->n_params * sizeof(float));
+    for (l = 1; l < head->n_layers; l++)
+        head->layers[l]->trainable = net->layers[layer + l]->trainable;
+    head->stats = net->stats;
+    order = malloc(n * sizeof(long));
+    input = malloc((size_t)batch_size * dim * sizeof(float));
+    target = malloc((size_t)batch_size * n_out * sizeof(float));
+    for (i = 0; i < n; i++)
+        order[i] = i;
+    for (epoch = 0; epoch < epochs; epoch++) {
+        TRACE_BEGIN("epoch", epoch);
+        train_loss_reset(&head->epoch_loss);
+        for (i = n - 1; i > 0; i--) {
+            j = rand() % (i + 1);
+            k = order[i];
+            order[i] = order[j];
+            order[j] = k;
+        }
+        for (i = 0; i + batch_size <= n; i += batch_size) {
+            TRACE_BEGIN("minibatch", i / batch_size);
+            for (b = 0; b < batch_size; b++) {
+                cache_get(f, order[i + b], 1, input + (size_t)b * dim);
+                memcpy(target + (size_t)b * n_out,
+                       output + order[i + b] * n_out, n_out * sizeof(float));
+            }
+            network_update_minibatch(head, batch_size,
+                                     (float (*)[dim])input,
+                                     (float (*)[n_out])target, eta, 0);
+            TRACE_END();
+        }
+        memcpy(net->params + offset, head->params,
+               head->n_params * sizeof(float));
+        net->batch_loss = head->batch_loss;
+        net->epoch_loss = head->epoch_loss;
+        if (fun) {
+            TRACE_BEGIN("eval", epoch);
+            fun(net, epoch);
+            TRACE_END();
+        }
+        TRACE_END();
+    }
+    head->stats = NULL;
+    destroy_network(head);
+    free(order);
+    free(input);
+    free(target);
+}
@@ -0,0 +1,55 @@
+#ifndef __CACHE__
+#define __CACHE__
+
+#include <stdint.h>
+#include <stddef.h>
+#include "neuron.h"
+#include "pool.h"
+
+/* Feature caches, for training only the top layers of a network (see
+ * network_set_trainable) on a large dataset.
+ *
+ * When the layers up to some layer l are frozen, their activations on
+ * every sample are the same in every epoch. cache_build computes them
+ * once, in batches spread among the threads of a pool, and stores them in
+ * a file, as 32 bit floats or, to halve its size, as IEEE half precision
+ * floats. cache_open maps that file, and cache_SGD trains the
+ * layers above l reading its minibatches from it.
+ *
+ * The file is a header (struct cache_header, in native byte order)
+ * followed by the activations of each sample, one after the other.
+ */
+
+#define CACHE_MAGIC 0x4e464331   /* "NFC1" */
+
+enum { CACHE_F32, CACHE_F16 };
+
+struct cache_header {
+    uint32_t magic;
+    uint32_t encoding;
+    uint32_t layer;     /* of the network, whose activations are stored */
+    uint32_t dim;       /* neurons in that layer */
+    uint64_t n_samples;
+};
+
+struct cache {
+    struct cache_header header;
+    void *map;
+    size_t len;
+    void *data;         /* the activations, after the header */
+};
+
+int cache_build(struct network *net, int layer, int encoding, long n,
+                float *input, char *path, struct pool *pool);
+
+struct cache *cache_open(char *path);
+
+void cache_close(struct cache *f);
+
+void cache_get(struct cache *f, long sample, int count, float *out);
+
+void cache_SGD(struct network *net, struct cache *f, int batch_size,
+               int epochs, float *output, float eta,
+               void fun(struct network *, int));
+
+#endif
@@ -0,0 +1,85 @@
+#include <stdlib.h>
+#include <string.h>
+#include "cascade.h"
+#include "trace.h"
+
+/* cascade_classify_batch:
+ *      Classify n inputs with the cascade of small and large, saving the
+ *      label of each one in labels and, unless it is NULL, its confidence
+ *      in confidence. The inputs the small network is not confident about
+ *      (confidence below threshold) are gathered into a dense batch, which
+ *      is classified at once by the large network.
+ *      stats, if not NULL, is updated with the work done.
+ */
+void cascade_classify_batch(struct network *small, struct network *large,
+                     float threshold, int n,
+                     float input[][small->layers[0]->n_neurons],
+                     int labels[], float confidence[],
+                     struct cascade_stats *stats)
+{
+    int n_in = small->layers[0]->n_neurons;
+    float *scores = malloc(n * sizeof(float));
+    int *escalated = malloc(n * sizeof(int));
+    int *hard_labels;
+    float *hard_scores;
+    float (*hard)[n_in];
+    int i, m;
+
+    network_classify(small, n, input, labels, 1, scores, 1);
+    for (i = m = 0; i < n; i++)
+        if (scores[i] < threshold)
+            escalated[m++] = i;
+    if (m > 0) {
+        hard = malloc(m * sizeof(*hard));
+        hard_labels = malloc(m * sizeof(int));
+        hard_scores = malloc(m * sizeof(float));
+        TRACE_BEGIN("escalate", m);
+        for (i = 0; i < m; i++)
+            memcpy(hard[i], input[escalated[i]], sizeof(*hard));
+        network_classify(large, m, hard, hard_labels, 1, hard_scores, 1);
+        TRACE_END();
+        for (i = 0; i < m; i++) {
+            labels[escalated[i]] = hard_labels[i];
+            scores[escalated[i]] = hard_scores[i];
+        }
+        free(hard);
+        free(hard_labels);
+        free(hard_scores);
+    }
+    if (confidence)
+        memcpy(confidence, scores, n * sizeof(float));
+    if (stats) {
+        stats->samples += n;
+        stats->escalated += m;
+        stats->cost += (double)n * network_n_weights(small)
+                       + (double)m * network_n_weights(large);
+    }
+    free(escalated);
+    free(scores);
+}
+
+/* cascade_classify: classify a single input with the cascade, and return
+ * its label. See cascade_classify_batch */
+int cascade_classify(struct network *small, struct network *large,
+                     float threshold, float input[],
+                     float *confidence, struct cascade_stats *stats)
+{
+    int n_in = small->layers[0]->n_neurons;
+    int label;
+    cascade_classify_batch(small, large, threshold, 1,
+                           (float (*)[n_in])input, &label, confidence, stats);
+    return label;
+}
+
+/* cascade_escalation_rate: fraction of the samples that were passed on to
+ * the large network */
+double cascade_escalation_rate(struct cascade_stats *stats)
+{
+    return stats->samples ? (double)stats->escalated / stats->samples : 0;
+}
+
+/* cascade_cost_per_sample: average number of multiply-adds per sample */
+double cascade_cost_per_sample(struct cascade_stats *stats)
+{
+    return stats->samples ? stats->cost / stats->samples : 0;
+}
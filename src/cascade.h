@@ -0,0 +1,34 @@
+#ifndef __CASCADE__
+#define __CASCADE__
+
+#include "neuron.h"
+
+/* A cascade of two classifiers with the same inputs and outputs: samples go
+ * first through a small network, and only those for which it is not
+ * confident enough are passed on to the large one.
+ *
+ * The confidence is the softmax probability of the top class, computed
+ * from the sums at the output layer of the small network.
+ */
+
+struct cascade_stats {
+    long samples;
+    long escalated;     /* samples that went through the large network */
+    double cost;        /* multiply-adds spent on all the samples */
+};
+
+int cascade_classify(struct network *small, struct network *large,
+                     float threshold, float input[],
+                     float *confidence, struct cascade_stats *stats);
+
+void cascade_classify_batch(struct network *small, struct network *large,
+                     float threshold, int n,
+                     float input[][small->layers[0]->n_neurons],
+                     int labels[], float confidence[],
+                     struct cascade_stats *stats);
+
+double cascade_escalation_rate(struct cascade_stats *stats);
+
+double cascade_cost_per_sample(struct cascade_stats *stats);
+
+#endif
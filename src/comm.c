@@ -0,0 +1,368 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "comm.h"
+
+#define SEGMENT 8192        /* floats in each slot of a queue */
+#define QUEUE 4             /* slots in the queue in front of each rank */
+#define SPINS 200           /* polls before sleeping on a futex */
+#define NAP_MS 100          /* how often sleepers look for dead ranks */
+#define OPEN_MS 10000       /* how long to wait for rank 0 in comm_open */
+
+/* The queue in front of a rank, written by the rank on its left. The
+ * counters are only ever increased, and wrap around harmlessly */
+struct mailbox {
+    atomic_uint posted __attribute__((aligned(64)));
+    atomic_uint consumed __attribute__((aligned(64)));
+    pthread_mutex_t alive;  /* held by the rank while attached */
+    float slots[QUEUE][SEGMENT] __attribute__((aligned(64)));
+};
+
+struct comm_shared {
+    atomic_uint ready;      /* set by rank 0 once the rest is initialized */
+    atomic_uint failed;
+    int size;
+    atomic_uint joined;     /* ranks that hold their mutex */
+    atomic_uint arrived __attribute__((aligned(64)));
+    atomic_uint generation;
+    long values[COMM_MAX_RANKS];
+    struct mailbox boxes[];
+};
+
+static void futex_wait(atomic_uint *word, unsigned old, int ms)
+{
+    struct timespec t = { ms / 1000, (ms % 1000) * 1000000L };
+    syscall(SYS_futex, word, FUTEX_WAIT, old, &t, NULL, 0);
+}
+
+static void futex_wake(atomic_uint *word)
+{
+    syscall(SYS_futex, word, FUTEX_WAKE, COMM_MAX_RANKS, NULL, NULL, 0);
+}
+
+/* check_ranks: whether every rank still holds its mutex. A process that
+ * dies leaves it "owner dead"; one that called comm_close, unlocked. In
+ * both cases the communicator is marked as failed for all the ranks */
+static int check_ranks(struct comm *c)
+{
+    struct comm_shared *s = c->shared;
+    int i, j, err;
+
+    for (i = 0; i < c->size && !atomic_load(&s->failed); i++) {
+        if (i == c->rank)
+            continue;
+        err = pthread_mutex_trylock(&s->boxes[i].alive);
+        if (err == EBUSY)
+            continue;
+        if (err == EOWNERDEAD)
+            pthread_mutex_consistent(&s->boxes[i].alive);
+        if (err == 0 || err == EOWNERDEAD)
+            pthread_mutex_unlock(&s->boxes[i].alive);
+        fprintf(stderr, "comm: rank %d has left\n", i);
+        atomic_store(&s->failed, 1);
+        futex_wake(&s->generation);
+        for (j = 0; j < c->size; j++) {
+            futex_wake(&s->boxes[j].posted);
+            futex_wake(&s->boxes[j].consumed);
+        }
+    }
+    if (atomic_load(&s->failed))
+        c->failed = 1;
+    return c->failed ? -1 : 0;
+}
+
+/* wait_until: wait until *word is no longer old. Returns -1 if some rank
+ * has left in the meantime */
+static int wait_until(struct comm *c, atomic_uint *word, unsigned old)
+{
+    int spins = 0;
+
+    while (atomic_load_explicit(word, memory_order_acquire) == old) {
+        if (c->failed || atomic_load(&c->shared->failed))
+            return check_ranks(c);
+        if (++spins < SPINS)
+            continue;
+        futex_wait(word, old, NAP_MS);
+        if (atomic_load_explicit(word, memory_order_acquire) == old
+                && check_ranks(c) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/* post: queue n floats (at most SEGMENT) to the rank on the right */
+static int post(struct comm *c, const float *data, long n)
+{
+    struct mailbox *box = &c->shared->boxes[(c->rank + 1) % c->size];
+    unsigned posted = atomic_load_explicit(&box->posted,
+                                           memory_order_relaxed);
+    unsigned consumed;
+
+    while (posted - (consumed = atomic_load_explicit(&box->consumed,
+                                 memory_order_acquire)) >= QUEUE)
+        if (wait_until(c, &box->consumed, consumed) < 0)
+            return -1;
+    memcpy(box->slots[posted % QUEUE], data, n * sizeof(float));
+    atomic_store_explicit(&box->posted, posted + 1, memory_order_release);
+    futex_wake(&box->posted);
+    return 0;
+}
+
+/* take: take n floats from the rank on the left, adding them to data or
+ * copying them over it */
+static int take(struct comm *c, float *data, long n, int add)
+{
+    struct mailbox *box = &c->shared->boxes[c->rank];
+    unsigned consumed = atomic_load_explicit(&box->consumed,
+                                             memory_order_relaxed);
+    float *slot;
+    long i;
+
+    if (wait_until(c, &box->posted, consumed) < 0)
+        return -1;
+    slot = box->slots[consumed % QUEUE];
+    if (add) {
+        for (i = 0; i < n; i++)
+            data[i] += slot[i];
+    } else {
+        memcpy(data, slot, n * sizeof(float));
+    }
+    atomic_store_explicit(&box->consumed, consumed + 1, memory_order_release);
+    futex_wake(&box->consumed);
+    return 0;
+}
+
+/* chunk: the part of an array of n elements that goes to the i-th of size
+ * ranks */
+static void chunk(long n, int size, int i, long *start, long *count)
+{
+    i = (i % size + size) % size;
+    *start = n * i / size;
+    *count = n * (i + 1) / size - *start;
+}
+
+/* step: send one chunk to the right while receiving another one from the
+ * left, a segment of each in turn */
+static int step(struct comm *c, float *data, long n, int send, int recv,
+                int add)
+{
+    long s_start, s_count, r_start, r_count, off, len;
+
+    chunk(n, c->size, send, &s_start, &s_count);
+    chunk(n, c->size, recv, &r_start, &r_count);
+    for (off = 0; off < s_count || off < r_count; off += SEGMENT) {
+        len = s_count - off < SEGMENT ? s_count - off : SEGMENT;
+        if (len > 0 && post(c, data + s_start + off, len) < 0)
+            return -1;
+        len = r_count - off < SEGMENT ? r_count - off : SEGMENT;
+        if (len > 0 && take(c, data + r_start + off, len, add) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/* comm_allreduce: sum data over all the ranks. After size-1 steps of
+ * reduce-scatter rank r holds the whole sum of chunk r+1, which size-1
+ * steps of allgather pass on to the others */
+int comm_allreduce(struct comm *c, float *data, long n)
+{
+    int s, r = c->rank;
+
+    if (c->failed)
+        return -1;
+    for (s = 0; s < c->size - 1; s++)
+        if (step(c, data, n, r - s, r - s - 1, 1) < 0)
+            return -1;
+    for (s = 0; s < c->size - 1; s++)
+        if (step(c, data, n, r + 1 - s, r - s, 0) < 0)
+            return -1;
+    return 0;
+}
+
+/* comm_broadcast: copy data from rank root to all the others */
+int comm_broadcast(struct comm *c, float *data, long n, int root)
+{
+    if (c->rank != root)
+        memset(data, 0, n * sizeof(float));
+    return comm_allreduce(c, data, n);
+}
+
+int comm_barrier(struct comm *c)
+{
+    struct comm_shared *s = c->shared;
+    unsigned generation = atomic_load(&s->generation);
+
+    if (c->failed)
+        return -1;
+    if (atomic_fetch_add(&s->arrived, 1) == (unsigned)c->size - 1) {
+        atomic_store(&s->arrived, 0);
+        atomic_fetch_add(&s->generation, 1);
+        futex_wake(&s->generation);
+        return 0;
+    }
+    return wait_until(c, &s->generation, generation);
+}
+
+/* comm_min: the smallest of the values of all the ranks, in *value */
+int comm_min(struct comm *c, long *value)
+{
+    long min = *value;
+    int i;
+
+    c->shared->values[c->rank] = *value;
+    if (comm_barrier(c) < 0)
+        return -1;
+    for (i = 0; i < c->size; i++)
+        if (c->shared->values[i] < min)
+            min = c->shared->values[i];
+    /* nobody may write its next value before all have read this one */
+    if (comm_barrier(c) < 0)
+        return -1;
+    *value = min;
+    return 0;
+}
+
+/* comm_shard: the part of n samples that belongs to this rank */
+void comm_shard(struct comm *c, long n, long *start, long *count)
+{
+    chunk(n, c->size, c->rank, start, count);
+}
+
+static void nap(int ms)
+{
+    struct timespec t = { 0, ms * 1000000L };
+    nanosleep(&t, NULL);
+}
+
+/* attach: open the segment created by rank 0, waiting for it to be ready */
+static struct comm_shared *attach(const char *name, size_t len)
+{
+    struct comm_shared *s;
+    struct stat st;
+    int fd = -1, ms;
+
+    for (ms = 0; ms < OPEN_MS; ms++, nap(1)) {
+        if (fd < 0 && (fd = shm_open(name, O_RDWR, 0)) < 0) {
+            if (errno != ENOENT)
+                break;
+            continue;
+        }
+        if (fstat(fd, &st) < 0)
+            break;
+        if ((size_t)st.st_size < len)
+            continue;
+        s = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (s == MAP_FAILED)
+            return NULL;
+        for (; ms < OPEN_MS; ms++, nap(1))
+            if (atomic_load_explicit(&s->ready, memory_order_acquire))
+                return s;
+        munmap(s, len);
+        return NULL;
+    }
+    if (fd >= 0)
+        close(fd);
+    return NULL;
+}
+
+/* create: create the segment, as rank 0 */
+static struct comm_shared *create(const char *name, size_t len, int size)
+{
+    struct comm_shared *s;
+    pthread_mutexattr_t attr;
+    int fd, i;
+
+    shm_unlink(name);   /* left by a run that crashed */
+    if ((fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600)) < 0)
+        return NULL;
+    if (ftruncate(fd, len) < 0) {
+        close(fd);
+        shm_unlink(name);
+        return NULL;
+    }
+    s = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (s == MAP_FAILED) {
+        shm_unlink(name);
+        return NULL;
+    }
+    s->size = size;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    for (i = 0; i < size; i++)
+        pthread_mutex_init(&s->boxes[i].alive, &attr);
+    pthread_mutexattr_destroy(&attr);
+    atomic_store_explicit(&s->ready, 1, memory_order_release);
+    return s;
+}
+
+/* comm_open: join the communicator called name, as rank out of size.
+ * Returns when all the ranks have joined, or NULL on error */
+struct comm *comm_open(const char *name, int rank, int size)
+{
+    struct comm *c;
+    size_t len = sizeof(struct comm_shared) + size * sizeof(struct mailbox);
+    int ms;
+
+    if (size < 1 || size > COMM_MAX_RANKS || rank < 0 || rank >= size) {
+        fprintf(stderr, "comm_open: bad rank %d of %d\n", rank, size);
+        return NULL;
+    }
+    c = malloc(sizeof(struct comm));
+    c->rank = rank;
+    c->size = size;
+    c->failed = 0;
+    c->len = len;
+    c->shared = rank == 0 ? create(name, len, size) : attach(name, len);
+    if (!c->shared) {
+        fprintf(stderr, "comm_open: cannot open %s\n", name);
+        free(c);
+        return NULL;
+    }
+    if (c->shared->size != size) {
+        fprintf(stderr, "comm_open: %s has %d ranks, not %d\n", name,
+                c->shared->size, size);
+        munmap(c->shared, len);
+        free(c);
+        return NULL;
+    }
+    /* the other ranks are only watched once all of them have joined */
+    pthread_mutex_lock(&c->shared->boxes[rank].alive);
+    atomic_fetch_add(&c->shared->joined, 1);
+    for (ms = 0; atomic_load(&c->shared->joined) < (unsigned)size; ms++) {
+        if (ms == OPEN_MS) {
+            fprintf(stderr, "comm_open: %s: only %u of %d ranks joined\n",
+                    name, atomic_load(&c->shared->joined), size);
+            comm_close(c);
+            return NULL;
+        }
+        nap(1);
+    }
+    if (rank == 0)
+        shm_unlink(name);
+    return c;
+}
+
+/* comm_close: leave the communicator. The other ranks see it as a
+ * failure if they are still communicating */
+void comm_close(struct comm *c)
+{
+    if (!c)
+        return;
+    pthread_mutex_unlock(&c->shared->boxes[c->rank].alive);
+    munmap(c->shared, c->len);
+    free(c);
+}
@@ -0,0 +1,53 @@
+#ifndef __COMM__
+#define __COMM__
+
+/* Communication between the processes of a data-parallel training, all on
+ * the same machine, through POSIX shared memory.
+ *
+ * Every process calls comm_open with the same name (such as "/train-1234")
+ * and size, and its own rank in [0, size). Rank 0 creates the segment and
+ * removes it from /dev/shm once all the ranks have attached, so nothing is
+ * left behind when they exit.
+ *
+ * comm_allreduce sums an array of floats over all the ranks, leaving the
+ * same result, bit for bit, in all of them. It is a ring allreduce: the
+ * array is split in size chunks, which go twice around the ring of ranks,
+ * first being summed (reduce-scatter) and then copied (allgather). Chunks
+ * travel in segments through a short queue in front of each rank, so that
+ * a rank adds up one segment while its neighbour copies in the next one.
+ *
+ * A process that dies is noticed by the others, whose calls then fail
+ * with -1 instead of waiting forever; comm->failed stays set from then on.
+ * Each rank must keep the thread that called comm_open alive while using
+ * the communicator, as it is what stands for the process.
+ *
+ * See network_set_comm for training with it.
+ */
+
+#define COMM_MAX_RANKS 64
+
+struct comm_shared;
+
+struct comm {
+    int rank;
+    int size;
+    int failed;
+    struct comm_shared *shared;
+    size_t len;         /* of the mapping */
+};
+
+struct comm *comm_open(const char *name, int rank, int size);
+
+void comm_close(struct comm *c);
+
+int comm_allreduce(struct comm *c, float *data, long n);
+
+int comm_broadcast(struct comm *c, float *data, long n, int root);
+
+int comm_min(struct comm *c, long *value);
+
+int comm_barrier(struct comm *c);
+
+void comm_shard(struct comm *c, long n, long *start, long *count);
+
+#endif
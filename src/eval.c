@@ -0,0 +1,157 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "eval.h"
+#include "neuron.h"
+#include "trace.h"
+
+static void *evaluator_thread(void *arg)
+{
+    struct evaluator *ev = arg;
+    struct network *snap;
+    double score;
+    int i, epoch;
+
+    pthread_mutex_lock(&ev->lock);
+    for (;;) {
+        while (ev->pending < 0 && !ev->quit)
+            pthread_cond_wait(&ev->changed, &ev->lock);
+        if (ev->pending < 0)
+            break;
+        i = ev->running = ev->pending;
+        ev->pending = -1;
+        pthread_cond_broadcast(&ev->changed);
+        snap = ev->snapshots[i];
+        epoch = ev->epochs[i];
+        pthread_mutex_unlock(&ev->lock);
+
+        TRACE_BEGIN("evaluate", epoch);
+        score = ev->score(snap, epoch, ev->arg);
+        TRACE_END();
+
+        pthread_mutex_lock(&ev->lock);
+        ev->last_score = score;
+        ev->last_epoch = epoch;
+        ev->n_scored++;
+        if (ev->best_epoch < 0 || score < ev->best_score) {
+            ev->best_score = score;
+            ev->best_epoch = epoch;
+            memcpy(ev->best, snap->params, snap->n_params * sizeof(float));
+        } else if (ev->patience > 0
+                   && epoch - ev->best_epoch >= ev->patience) {
+            ev->stop = 1;
+        }
+        ev->running = -1;
+        pthread_cond_broadcast(&ev->changed);
+    }
+    pthread_mutex_unlock(&ev->lock);
+    return NULL;
+}
+
+/* evaluator_create: an evaluator of snapshots of net, scored with
+ * score(snapshot, epoch, arg), and with the given patience (0 to never
+ * stop training). Returns NULL on error */
+struct evaluator *evaluator_create(struct network *net,
+                                   double score(struct network *, int,
+                                                void *),
+                                   void *arg, int patience)
+{
+    struct evaluator *ev;
+    int i;
+
+    if (!score || patience < 0) {
+        fprintf(stderr, "evaluator_create: no score, or patience %d\n",
+                patience);
+        return NULL;
+    }
+    ev = calloc(1, sizeof(struct evaluator));
+    ev->score = score;
+    ev->arg = arg;
+    ev->patience = patience;
+    for (i = 0; i < EVAL_SNAPSHOTS; i++)
+        ev->snapshots[i] = network_clone(net, 0, -1);
+    ev->pending = ev->running = -1;
+    ev->best = malloc(net->n_params * sizeof(float));
+    ev->best_epoch = ev->last_epoch = -1;
+    pthread_mutex_init(&ev->lock, NULL);
+    pthread_cond_init(&ev->changed, NULL);
+    pthread_create(&ev->thread, NULL, evaluator_thread, ev);
+    return ev;
+}
+
+/* evaluator_destroy: score the snapshot still waiting, if any, and free
+ * the evaluator */
+void evaluator_destroy(struct evaluator *ev)
+{
+    int i;
+
+    if (!ev)
+        return;
+    pthread_mutex_lock(&ev->lock);
+    ev->quit = 1;
+    pthread_cond_broadcast(&ev->changed);
+    pthread_mutex_unlock(&ev->lock);
+    pthread_join(ev->thread, NULL);
+    pthread_cond_destroy(&ev->changed);
+    pthread_mutex_destroy(&ev->lock);
+    for (i = 0; i < EVAL_SNAPSHOTS; i++)
+        destroy_network(ev->snapshots[i]);
+    free(ev->best);
+    free(ev);
+}
+
+/* evaluator_submit: take a snapshot of the parameters of net after the
+ * given epoch, to be scored. Waits only while the snapshot of an earlier
+ * epoch is still waiting */
+void evaluator_submit(struct evaluator *ev, struct network *net, int epoch)
+{
+    int i;
+
+    pthread_mutex_lock(&ev->lock);
+    while (ev->pending >= 0)
+        pthread_cond_wait(&ev->changed, &ev->lock);
+    /* the snapshot which is not being scored */
+    for (i = 0; i == ev->running; i++)
+        ;
+    memcpy(ev->snapshots[i]->params, net->params,
+           net->n_params * sizeof(float));
+    ev->epochs[i] = epoch;
+    ev->pending = i;
+    pthread_cond_broadcast(&ev->changed);
+    pthread_mutex_unlock(&ev->lock);
+}
+
+/* evaluator_wait: wait until every snapshot taken has been scored */
+void evaluator_wait(struct evaluator *ev)
+{
+    pthread_mutex_lock(&ev->lock);
+    while (ev->pending >= 0 || ev->running >= 0)
+        pthread_cond_wait(&ev->changed, &ev->lock);
+    pthread_mutex_unlock(&ev->lock);
+}
+
+/* evaluator_stopped: whether the patience has run out */
+int evaluator_stopped(struct evaluator *ev)
+{
+    int stop;
+
+    pthread_mutex_lock(&ev->lock);
+    stop = ev->stop;
+    pthread_mutex_unlock(&ev->lock);
+    return stop;
+}
+
+/* evaluator_best: copy the parameters of the best snapshot scored so far
+ * to net, and return its epoch, or -1 (leaving net as it is) if none has
+ * been scored yet */
+int evaluator_best(struct evaluator *ev, struct network *net)
+{
+    int epoch;
+
+    pthread_mutex_lock(&ev->lock);
+    epoch = ev->best_epoch;
+    if (epoch >= 0)
+        memcpy(net->params, ev->best, net->n_params * sizeof(float));
+    pthread_mutex_unlock(&ev->lock);
+    return epoch;
+}
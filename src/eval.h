@@ -0,0 +1,63 @@
+#ifndef __EVAL__
+#define __EVAL__
+
+#include <pthread.h>
+#include "neuron.h"
+
+/* Evaluation of a network while it trains.
+ *
+ * An evaluator attached to a network with network_set_evaluator gets, at
+ * the end of every epoch of network_SGD, a snapshot of its parameters: a
+ * copy into one of two networks of the same structure, which takes no
+ * longer than a memcpy of the parameters. A thread of its own scores the
+ * snapshot with the given function while the next epoch trains; training
+ * only waits if an epoch ends while the snapshot of the previous one is
+ * still waiting for the evaluation of the one before it.
+ *
+ * The scores arrive in the order of the epochs. Lower scores are better
+ * (an error rate, or minus the accuracy): the evaluator keeps the
+ * parameters of the best snapshot so far, and with a patience of p > 0 it
+ * asks network_SGD to stop once p epochs have been scored after the best
+ * one without improving on it. Since the scores come late, training stops
+ * at the end of the first epoch after that is known.
+ */
+
+#define EVAL_SNAPSHOTS 2
+
+struct evaluator {
+    double (*score)(struct network *, int, void *);
+    void *arg;
+    int patience;
+    struct network *snapshots[EVAL_SNAPSHOTS];
+    int epochs[EVAL_SNAPSHOTS];     /* of the parameters in each */
+    int pending;        /* snapshot waiting to be scored, or -1 */
+    int running;        /* snapshot being scored, or -1 */
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    int quit;
+    int stop;           /* the patience ran out */
+    float *best;        /* parameters of the best snapshot */
+    double best_score;
+    int best_epoch;     /* -1 until a snapshot has been scored */
+    double last_score;
+    int last_epoch;
+    int n_scored;
+};
+
+struct evaluator *evaluator_create(struct network *net,
+                                   double score(struct network *, int,
+                                                void *),
+                                   void *arg, int patience);
+
+void evaluator_destroy(struct evaluator *ev);
+
+void evaluator_submit(struct evaluator *ev, struct network *net, int epoch);
+
+void evaluator_wait(struct evaluator *ev);
+
+int evaluator_stopped(struct evaluator *ev);
+
+int evaluator_best(struct evaluator *ev, struct network *net);
+
+#endif
@@ -0,0 +1,74 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "io.h"
+
+/* io_now: seconds on the monotonic clock */
+double io_now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+/* io_read_all, io_write_all: like read and write, but retry until all the
+ * bytes have been transferred. Return 0 on success and -1 on error or EOF */
+int io_read_all(int fd, void *buf, size_t len)
+{
+    ssize_t r;
+    while (len > 0) {
+        r = read(fd, buf, len);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return -1;
+        buf = (char *)buf + r;
+        len -= r;
+    }
+    return 0;
+}
+
+int io_write_all(int fd, const void *buf, size_t len)
+{
+    ssize_t r;
+    while (len > 0) {
+        r = write(fd, buf, len);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return -1;
+        buf = (const char *)buf + r;
+        len -= r;
+    }
+    return 0;
+}
+
+/* io_read_file: read the whole file into a newly allocated buffer, and save
+ * its length in *len. Returns NULL on error */
+char *io_read_file(char *filename, size_t *len)
+{
+    struct stat st;
+    char *buf;
+    int fd = open(filename, O_RDONLY);
+
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        fprintf(stderr, "Could not open file %s\n", filename);
+        if (fd >= 0)
+            close(fd);
+        return NULL;
+    }
+    buf = malloc(st.st_size ? st.st_size : 1);
+    if (io_read_all(fd, buf, st.st_size) < 0) {
+        fprintf(stderr, "Could not read file %s\n", filename);
+        close(fd);
+        free(buf);
+        return NULL;
+    }
+    close(fd);
+    *len = st.st_size;
+    return buf;
+}
@@ -0,0 +1,19 @@
+#ifndef __IO__
+#define __IO__
+
+#include <stddef.h>
+
+/* Small helpers shared by the library and the tools: a monotonic clock,
+ * reads and writes of whole buffers on sockets and pipes, and reads of
+ * whole files.
+ */
+
+double io_now(void);
+
+int io_read_all(int fd, void *buf, size_t len);
+
+int io_write_all(int fd, const void *buf, size_t len);
+
+char *io_read_file(char *filename, size_t *len);
+
+#endif
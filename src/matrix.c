@@ -228,18 +228,15 @@ float vprod(int n, float *first, float *sec)
 }
 
 /* max_index:
- *      return the index of the biggest element
+ *      return the index of the biggest element (the first one, if there
+ *      are several)
  */
 int max_index(int n, float array[n])
 {
     int i, index;
-    float max;
-    for (max = 0; n >= 0; n--) {
-        if (array[n] > max) {
-            max = array[n];
-            index = n;
-        }
-    }
+    for (i = index = 0; i < n; i++)
+        if (array[i] > array[index])
+            index = i;
     return index;
 }
 
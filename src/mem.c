@@ -0,0 +1,218 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <malloc.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "mem.h"
+
+#define HEADER 64           /* keeps the blocks aligned to cache lines */
+#define HUGE_PAGE (2 << 20)
+#define MPOL_BIND 2
+
+/* Every block starts with a header, HEADER bytes before the address given
+ * to the caller, which says how to free it */
+struct header {
+    size_t size;        /* asked for */
+    size_t mapped;      /* bytes mapped, or 0 if it comes from malloc */
+    char *base;         /* start of the allocation */
+};
+
+static int policy_flags;
+static int policy_node = MEM_NODE_ANY;
+
+/* mem_set_policy: flags and node for the blocks allocated from now on. It
+ * is meant to be called at startup, before any thread allocates */
+void mem_set_policy(int flags, int node)
+{
+    policy_flags = flags;
+    policy_node = node;
+}
+
+void mem_get_policy(int *flags, int *node)
+{
+    *flags = policy_flags;
+    *node = policy_node;
+}
+
+void *mem_alloc(size_t size)
+{
+    return mem_alloc_on(size, policy_flags, policy_node);
+}
+
+/* map_aligned: map len bytes starting at a multiple of HUGE_PAGE, so that
+ * the whole block can be backed by huge pages */
+static char *map_aligned(size_t len)
+{
+    char *base, *aligned;
+
+    base = mmap(NULL, len + HUGE_PAGE, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED)
+        return NULL;
+    aligned = (char *)(((uintptr_t)base + HUGE_PAGE - 1)
+                       & ~(uintptr_t)(HUGE_PAGE - 1));
+    if (aligned > base)
+        munmap(base, aligned - base);
+    munmap(aligned + len, base + HUGE_PAGE - aligned);
+    return aligned;
+}
+
+/* bind: ask for the pages of the block to come from node. It is only a
+ * hint: if the kernel has no NUMA support the block stays where it is */
+static void bind(char *base, size_t len, int node)
+{
+    unsigned long mask;
+
+    if (node == MEM_NODE_LOCAL)
+        node = mem_current_node();
+    if (node < 0 || node >= (int)(8 * sizeof(mask)))
+        return;
+    mask = 1UL << node;
+    syscall(SYS_mbind, base, len, MPOL_BIND, &mask, 8 * sizeof(mask), 0);
+}
+
+/* mem_alloc_on: allocate size bytes with the given flags, on the given
+ * node. Returns NULL on error */
+void *mem_alloc_on(size_t size, int flags, int node)
+{
+    struct header *h;
+    char *base = NULL;
+    size_t len, page = sysconf(_SC_PAGESIZE);
+
+    if (!flags && node == MEM_NODE_ANY) {
+        if (posix_memalign((void **)&base, HEADER, size + HEADER) != 0)
+            return NULL;
+        h = (struct header *)base;
+        h->size = size;
+        h->mapped = 0;
+        h->base = base;
+        return base + HEADER;
+    }
+    if (flags) {
+        len = (size + HEADER + HUGE_PAGE - 1) & ~(size_t)(HUGE_PAGE - 1);
+        if (flags & MEM_HUGETLB) {
+            base = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            if (base == MAP_FAILED)
+                base = NULL;
+        }
+        if (!base) {
+            if (!(base = map_aligned(len)))
+                return NULL;
+            madvise(base, len, MADV_HUGEPAGE);
+        }
+    } else {
+        len = (size + HEADER + page - 1) & ~(page - 1);
+        base = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (base == MAP_FAILED)
+            return NULL;
+    }
+    /* before the first touch, which is what places the pages */
+    if (node != MEM_NODE_ANY)
+        bind(base, len, node);
+    h = (struct header *)base;
+    h->size = size;
+    h->mapped = len;
+    h->base = base;
+    return base + HEADER;
+}
+
+void mem_free(void *p)
+{
+    struct header *h;
+
+    if (!p)
+        return;
+    h = (struct header *)((char *)p - HEADER);
+    if (h->mapped)
+        munmap(h->base, h->mapped);
+    else
+        free(h->base);
+}
+
+/* mem_usable_size: the size the block was allocated with */
+size_t mem_usable_size(void *p)
+{
+    return ((struct header *)((char *)p - HEADER))->size;
+}
+
+/* mem_overhead: bytes taken by the block besides its size: the header,
+ * the rounding to pages, and the headers of malloc */
+size_t mem_overhead(void *p)
+{
+    struct header *h = (struct header *)((char *)p - HEADER);
+    if (h->mapped)
+        return h->mapped - h->size;
+    return malloc_usable_size(h->base) + sizeof(size_t) - h->size;
+}
+
+/* mem_parse_nodes: the nodes in a list of nodes as sysfs writes them
+ * ("0-3", "0,2", "0-1,4"). Saves up to max of them in nodes and returns how
+ * many there are */
+int mem_parse_nodes(const char *list, int *nodes, int max)
+{
+    const char *p = list;
+    char *end;
+    long a, b;
+    int n = 0;
+
+    for (;;) {
+        a = strtol(p, &end, 10);
+        if (end == p || a < 0)
+            break;
+        b = a;
+        p = end;
+        if (*p == '-') {
+            b = strtol(p + 1, &end, 10);
+            if (end == p + 1 || b < a)
+                break;
+            p = end;
+        }
+        for (; a <= b; a++, n++)
+            if (n < max)
+                nodes[n] = a;
+        if (*p != ',')
+            break;
+        p++;
+    }
+    return n;
+}
+
+/* mem_nodes: the NUMA nodes online. Saves up to max of them in nodes and
+ * returns how many there are, which is 1 (node 0) if sysfs does not say */
+int mem_nodes(int *nodes, int max)
+{
+    FILE *fp = fopen("/sys/devices/system/node/online", "r");
+    char list[4096];
+    int n = 0;
+
+    if (fp) {
+        if (fgets(list, sizeof(list), fp))
+            n = mem_parse_nodes(list, nodes, max);
+        fclose(fp);
+    }
+    if (n > 0)
+        return n;
+    if (max > 0)
+        nodes[0] = 0;
+    return 1;
+}
+
+/* mem_n_nodes: number of NUMA nodes online */
+int mem_n_nodes(void)
+{
+    return mem_nodes(NULL, 0);
+}
+
+/* mem_current_node: the node of the CPU the calling thread runs on */
+int mem_current_node(void)
+{
+    unsigned int cpu, node;
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) < 0)
+        return 0;
+    return node;
+}
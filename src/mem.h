@@ -0,0 +1,55 @@
+#ifndef __MEM__
+#define __MEM__
+
+#include <stddef.h>
+
+/* Allocator for the large blocks of the library: the weights and biases
+ * of a network, its training workspace, and training sets.
+ *
+ * By default the blocks come from malloc. With MEM_HUGEPAGES they are
+ * mapped on their own and backed by 2 MB transparent huge pages, so that
+ * walking through them at random (minibatch gathers, the columns of the
+ * weights) takes far fewer dTLB misses; MEM_HUGETLB takes them from the
+ * hugetlbfs pool instead (see /proc/sys/vm/nr_hugepages) and falls back to
+ * transparent huge pages when the pool is empty.
+ *
+ * A block can also be bound to a NUMA node: node is the node number,
+ * MEM_NODE_LOCAL for the node the calling thread runs on, or MEM_NODE_ANY
+ * to leave the placement to the kernel (where the memory is first touched).
+ *
+ * mem_set_policy sets the flags and node used by mem_alloc, and thus by
+ * create_network and friends, from then on.
+ *
+ * The node numbers of a machine need not be contiguous: mem_nodes lists
+ * those online, which are the ones worth binding to.
+ */
+
+#define MEM_HUGEPAGES 1
+#define MEM_HUGETLB 2
+
+#define MEM_NODE_ANY -1
+#define MEM_NODE_LOCAL -2
+
+void mem_set_policy(int flags, int node);
+
+void mem_get_policy(int *flags, int *node);
+
+void *mem_alloc(size_t size);
+
+void *mem_alloc_on(size_t size, int flags, int node);
+
+void mem_free(void *p);
+
+size_t mem_usable_size(void *p);
+
+size_t mem_overhead(void *p);
+
+int mem_parse_nodes(const char *list, int *nodes, int max);
+
+int mem_nodes(int *nodes, int max);
+
+int mem_n_nodes(void);
+
+int mem_current_node(void);
+
+#endif
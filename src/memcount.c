@@ -0,0 +1,105 @@
+#include <stdatomic.h>
+#include <errno.h>
+#include <malloc.h>
+#include "memcount.h"
+
+/* The allocator of glibc, under the names it also exports */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *p, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+extern void __libc_free(void *p);
+
+static atomic_long allocs, frees;
+static atomic_size_t bytes, peak;
+
+static void *counted(void *p)
+{
+    size_t now, old;
+
+    if (!p)
+        return p;
+    atomic_fetch_add(&allocs, 1);
+    now = atomic_fetch_add(&bytes, malloc_usable_size(p))
+          + malloc_usable_size(p);
+    old = atomic_load(&peak);
+    while (now > old && !atomic_compare_exchange_weak(&peak, &old, now))
+        ;
+    return p;
+}
+
+static void uncounted(void *p)
+{
+    if (!p)
+        return;
+    atomic_fetch_add(&frees, 1);
+    atomic_fetch_sub(&bytes, malloc_usable_size(p));
+}
+
+void *malloc(size_t size)
+{
+    return counted(__libc_malloc(size));
+}
+
+void *calloc(size_t n, size_t size)
+{
+    return counted(__libc_calloc(n, size));
+}
+
+void *realloc(void *p, size_t size)
+{
+    size_t old = p ? malloc_usable_size(p) : 0;
+    void *q = __libc_realloc(p, size);
+
+    /* accounted as a free of the old block and a new allocation */
+    if (q || size == 0) {
+        if (p) {
+            atomic_fetch_add(&frees, 1);
+            atomic_fetch_sub(&bytes, old);
+        }
+        counted(q);
+    }
+    return q;
+}
+
+void free(void *p)
+{
+    uncounted(p);
+    __libc_free(p);
+}
+
+void *memalign(size_t alignment, size_t size)
+{
+    return counted(__libc_memalign(alignment, size));
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+    return counted(__libc_memalign(alignment, size));
+}
+
+int posix_memalign(void **p, size_t alignment, size_t size)
+{
+    if (alignment % sizeof(void *) || (alignment & (alignment - 1)))
+        return EINVAL;
+    if (!(*p = counted(__libc_memalign(alignment, size))))
+        return ENOMEM;
+    return 0;
+}
+
+/* memcount_reset: start counting the calls again, and the peak from the
+ * bytes in use now */
+void memcount_reset(void)
+{
+    atomic_store(&allocs, 0);
+    atomic_store(&frees, 0);
+    atomic_store(&peak, atomic_load(&bytes));
+}
+
+void memcount_get(struct memcount *mc)
+{
+    mc->allocs = atomic_load(&allocs);
+    mc->frees = atomic_load(&frees);
+    mc->bytes = atomic_load(&bytes);
+    mc->peak = atomic_load(&peak);
+}
@@ -0,0 +1,25 @@
+#ifndef __MEMCOUNT__
+#define __MEMCOUNT__
+
+#include <stddef.h>
+
+/* Allocation counting. Linking memcount.o into a program replaces malloc,
+ * calloc, realloc, free and the aligned allocators by versions that count
+ * the calls of every thread and the bytes in use, so that tests can check
+ * that a piece of code allocates nothing, or how much it needs at most.
+ * It is not part of the library: programs that do not link it explicitly
+ * use the allocator of the C library untouched.
+ */
+
+struct memcount {
+    long allocs;        /* calls to the allocation functions */
+    long frees;
+    size_t bytes;       /* in use, as given by malloc_usable_size */
+    size_t peak;        /* most bytes in use since the last reset */
+};
+
+void memcount_reset(void);
+
+void memcount_get(struct memcount *mc);
+
+#endif
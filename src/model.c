@@ -0,0 +1,283 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <unistd.h>
+#include "model.h"
+#include "io.h"
+
+static unsigned int crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc_init(void)
+{
+    unsigned int c;
+    int i, k;
+    for (i = 0; i < 256; i++) {
+        c = i;
+        for (k = 0; k < 8; k++)
+            c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+        crc_table[i] = c;
+    }
+}
+
+/* model_crc32: update the CRC-32 crc (0 to start) with len bytes of buf.
+ * The result is the same as zlib's crc32 */
+unsigned int model_crc32(unsigned int crc, const char *buf, size_t len)
+{
+    pthread_once(&crc_once, crc_init);
+    crc = ~crc;
+    while (len-- > 0)
+        crc = crc_table[(crc ^ (unsigned char)*buf++) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+/* load_version: load a network from a file, checking that its CRC-32 is
+ * the expected one (unless checksum is 0) */
+static struct network *load_version(char *filename, unsigned int checksum,
+                                    unsigned int *crc)
+{
+    struct network *net;
+    size_t len;
+    char *buf = io_read_file(filename, &len);
+
+    if (!buf)
+        return NULL;
+    *crc = model_crc32(0, buf, len);
+    if (checksum && *crc != checksum) {
+        fprintf(stderr, "model: checksum of %s is %08x, expected %08x\n",
+                filename, *crc, checksum);
+        free(buf);
+        return NULL;
+    }
+    net = network_create_from_memory(buf, len);
+    free(buf);
+    return net;
+}
+
+static struct model *model_init(struct network *net, unsigned int crc)
+{
+    struct model *model = malloc(sizeof(struct model));
+
+    atomic_init(&model->current, NULL);
+    atomic_init(&model->epoch, 0);
+    atomic_init(&model->readers[0], 0);
+    atomic_init(&model->readers[1], 0);
+    pthread_mutex_init(&model->reload_lock, NULL);
+    model->spare = NULL;
+    model_publish(model, net, crc);
+    return model;
+}
+
+/* model_create: create a model whose first version is loaded from a file
+ * saved with network_save_to_file. Returns NULL on error */
+struct model *model_create(char *filename)
+{
+    struct network *net;
+    unsigned int crc;
+
+    if (!(net = load_version(filename, 0, &crc)))
+        return NULL;
+    return model_init(net, crc);
+}
+
+/* model_create_from_network: create a model whose first version is a copy
+ * of net, to be updated with model_update as net trains */
+struct model *model_create_from_network(struct network *net)
+{
+    return model_init(network_clone(net, 0, -1), 0);
+}
+
+/* model_destroy: free the model and its current version. There must be no
+ * readers left */
+void model_destroy(struct model *model)
+{
+    struct model_version *v = atomic_load(&model->current);
+    destroy_network(v->net);
+    free(v);
+    if (model->spare) {
+        destroy_network(model->spare->net);
+        free(model->spare);
+    }
+    pthread_mutex_destroy(&model->reload_lock);
+    free(model);
+}
+
+/* model_acquire: get the current version of the model, which stays valid
+ * until it is returned with model_release(model, *ticket). Never blocks */
+struct model_version *model_acquire(struct model *model, int *ticket)
+{
+    unsigned int epoch;
+    for (;;) {
+        epoch = atomic_load(&model->epoch);
+        atomic_fetch_add(&model->readers[epoch & 1], 1);
+        /* If a writer flipped the epoch meanwhile, it may not wait for us */
+        if (atomic_load(&model->epoch) == epoch)
+            break;
+        atomic_fetch_sub(&model->readers[epoch & 1], 1);
+    }
+    *ticket = epoch & 1;
+    return atomic_load(&model->current);
+}
+
+void model_release(struct model *model, int ticket)
+{
+    atomic_fetch_sub(&model->readers[ticket], 1);
+}
+
+/* same_topology: check whether two networks have the same structure */
+static int same_topology(struct network *a, struct network *b)
+{
+    int l;
+    if (a->n_layers != b->n_layers)
+        return 0;
+    for (l = 0; l < a->n_layers; l++)
+        if (a->layers[l]->n_neurons != b->layers[l]->n_neurons)
+            return 0;
+    return 1;
+}
+
+/* drain: wait until the readers of epochs with the parity of epoch are
+ * gone */
+static void drain(struct model *model, unsigned int epoch)
+{
+    while (atomic_load(&model->readers[epoch & 1]) > 0)
+        sched_yield();
+}
+
+/* model_publish: make net the current version of the model, and free the
+ * previous one once no reader holds it. The model takes ownership of net.
+ * Returns -1 (and leaves net alone) if the topology does not match that of
+ * the current version */
+int model_publish(struct model *model, struct network *net,
+                  unsigned int checksum)
+{
+    struct model_version *new, *old;
+    unsigned int epoch;
+
+    pthread_mutex_lock(&model->reload_lock);
+    old = atomic_load(&model->current);
+    if (old && !same_topology(old->net, net)) {
+        pthread_mutex_unlock(&model->reload_lock);
+        fprintf(stderr, "model_publish: the topology does not match\n");
+        return -1;
+    }
+    new = malloc(sizeof(struct model_version));
+    new->net = net;
+    new->checksum = checksum;
+    new->version = old ? old->version + 1 : 0;
+    /* The readers of the other parity, which may hold the spare, must be
+     * gone before new readers are counted with them */
+    epoch = atomic_load(&model->epoch);
+    drain(model, epoch + 1);
+    atomic_store(&model->current, new);
+    if (old) {
+        /* New readers go to the other parity from now on, so the readers
+         * of the old epoch, the only ones that can hold "old", drain out */
+        atomic_fetch_add(&model->epoch, 1);
+        drain(model, epoch);
+        destroy_network(old->net);
+        free(old);
+    }
+    pthread_mutex_unlock(&model->reload_lock);
+    return 0;
+}
+
+/* model_update: publish a copy of the weights and biases of net, which
+ * must have the topology of the model, as its new version. The copy goes
+ * to the spare, and the version it replaces becomes the spare. Returns -1
+ * if the topology does not match */
+int model_update(struct model *model, struct network *net)
+{
+    struct model_version *new, *old;
+    unsigned int epoch;
+
+    pthread_mutex_lock(&model->reload_lock);
+    old = atomic_load(&model->current);
+    if (!same_topology(old->net, net)) {
+        pthread_mutex_unlock(&model->reload_lock);
+        fprintf(stderr, "model_update: the topology does not match\n");
+        return -1;
+    }
+    /* The readers of the other parity are the only ones that can hold the
+     * spare. They have had since the last update to release it */
+    epoch = atomic_load(&model->epoch);
+    drain(model, epoch + 1);
+    if ((new = model->spare)) {
+        memcpy(new->net->params, net->params, net->n_params * sizeof(float));
+    } else {
+        new = malloc(sizeof(struct model_version));
+        new->net = network_clone(net, 0, -1);
+    }
+    new->checksum = 0;
+    new->version = old->version + 1;
+    atomic_store(&model->current, new);
+    atomic_fetch_add(&model->epoch, 1);
+    model->spare = old;
+    pthread_mutex_unlock(&model->reload_lock);
+    return 0;
+}
+
+/* model_reload: load a new version of the model from a file and publish
+ * it. The file must contain a network with the same topology as the
+ * current one and, unless checksum is 0, have that CRC-32. Returns 0 on
+ * success and -1 on error, in which case the current version is kept */
+int model_reload(struct model *model, char *filename, unsigned int checksum)
+{
+    struct network *net;
+    unsigned int crc;
+
+    if (!(net = load_version(filename, checksum, &crc)))
+        return -1;
+    if (model_publish(model, net, crc) < 0) {
+        destroy_network(net);
+        return -1;
+    }
+    return 0;
+}
+
+struct reload_args {
+    struct model *model;
+    char *filename;
+    unsigned int checksum;
+    void (*done)(struct model *, int);
+};
+
+static void *reload_thread(void *arg)
+{
+    struct reload_args *args = arg;
+    int status = model_reload(args->model, args->filename, args->checksum);
+    if (args->done)
+        args->done(args->model, status);
+    free(args->filename);
+    free(args);
+    return NULL;
+}
+
+/* model_reload_async: same as model_reload, but in a background thread.
+ * When it finishes, done (if not NULL) is called with the model and the
+ * result of model_reload. Returns -1 if the thread could not be started */
+int model_reload_async(struct model *model, char *filename,
+                       unsigned int checksum,
+                       void done(struct model *, int))
+{
+    struct reload_args *args = malloc(sizeof(struct reload_args));
+    pthread_attr_t attr;
+    pthread_t thread;
+    int err;
+
+    args->model = model;
+    args->filename = strdup(filename);
+    args->checksum = checksum;
+    args->done = done;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    err = pthread_create(&thread, &attr, reload_thread, args);
+    pthread_attr_destroy(&attr);
+    if (err) {
+        free(args->filename);
+        free(args);
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,63 @@
+#ifndef __MODEL__
+#define __MODEL__
+
+#include <stdatomic.h>
+#include <pthread.h>
+#include "neuron.h"
+
+/* A model is a handle to the current version of a network, which can be
+ * replaced by a new one while other threads are using it for inference.
+ *
+ * Readers bracket their use of the network with model_acquire and
+ * model_release, which never block. A reload publishes the new version
+ * atomically, waits until every reader that may still see the old one has
+ * released it, and then frees it.
+ *
+ * A trainer doing online learning publishes its weights with model_update
+ * instead, as often as it likes: the model keeps the version replaced by
+ * the last update as a spare, and the next update copies the weights into
+ * the spare and makes it current. Readers always see a whole version, which
+ * nobody writes to while it may be held, and the model never has more than
+ * two copies of the network. The wait for the readers of the spare is done
+ * at the next update rather than right after the flip, so that by then
+ * they have usually gone and the trainer does not block.
+ */
+
+struct model_version {
+    struct network *net;
+    unsigned int checksum;  /* CRC-32 of the file, as computed by zlib */
+    int version;
+};
+
+struct model {
+    _Atomic(struct model_version *) current;
+    atomic_uint epoch;
+    atomic_int readers[2];  /* readers[i]: readers of epochs with parity i */
+    pthread_mutex_t reload_lock;
+    struct model_version *spare;    /* replaced by the last model_update */
+};
+
+struct model *model_create(char *filename);
+
+struct model *model_create_from_network(struct network *net);
+
+void model_destroy(struct model *model);
+
+struct model_version *model_acquire(struct model *model, int *ticket);
+
+void model_release(struct model *model, int ticket);
+
+int model_publish(struct model *model, struct network *net,
+                  unsigned int checksum);
+
+int model_update(struct model *model, struct network *net);
+
+int model_reload(struct model *model, char *filename, unsigned int checksum);
+
+int model_reload_async(struct model *model, char *filename,
+                       unsigned int checksum,
+                       void done(struct model *, int));
+
+unsigned int model_crc32(unsigned int crc, const char *buf, size_t len);
+
+#endif
@@ -1,21 +1,76 @@
+#include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#include <string.h>
+#include <malloc.h>
 #include <time.h>
 #include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include "neuron.h"
 #include "matrix.h"
+#include "trace.h"
+#include "mem.h"
+#include "comm.h"
+#include "eval.h"
+#include "io.h"
 
 #define abs(x) ((x >= 0) ? (x) : (-1*(x)))
 
 #define STOP_STEP 1e-10
 #define STOP_COST 1e-2
 
-struct network *create_network(int n_layers, int n_neurons[n_layers])
+/* Accounting of training stats. STATS_BEGIN(net, t) starts timing a phase
+ * into the local variable t, and STATS_END(net, phase, t) adds the time
+ * elapsed since then to the phase; both do nothing unless the network has
+ * stats attached. TRAIN_MALLOC counts the allocations of the training
+ * path. With NO_TRAIN_STATS defined all of them compile to nothing. */
+#ifdef NO_TRAIN_STATS
+#define STATS_BEGIN(net, t)
+#define STATS_END(net, phase, t)
+#define TRAIN_MALLOC(net, size) malloc(size)
+#else
+#define STATS_BEGIN(net, t) double t = (net)->stats ? io_now() : 0
+#define STATS_END(net, phase, t) \
+    do { \
+        if ((net)->stats) \
+            (net)->stats->time[phase] += io_now() - (t); \
+    } while (0)
+#define TRAIN_MALLOC(net, size) \
+    ((net)->stats ? (net)->stats->allocs++ : 0, malloc(size))
+#endif
+
+/* Training buffers of a network. activs and deltas have room for the
+ * largest minibatch trained on so far, and the other three for a layer of
+ * one sample. They are kept until the network is destroyed, so that once
+ * they have grown the training path does not allocate memory.
+ *
+ * Only the layers the backward pass reaches have room: the deltas from
+ * the lowest trainable layer up, and the activations from the layer below
+ * it. The rows of the others are NULL */
+struct train_workspace {
+    int batch_size;
+    int lowest;         /* network_lowest_trainable when laid out */
+    float ***activs;    /* [batch_size][n_layers][neurons in the layer] */
+    float ***deltas;    /* the second half of activs */
+    float **rows;       /* where activs and deltas point to */
+    float *values;      /* and where those point to, from mem_alloc */
+    float *before;      /* the parameters before the minibatch, when
+                           training with a communicator */
+    float cost;         /* of the last sample of calc_activs_deltas */
+    float *cost_derivs; /* network_max_neurons floats each */
+    float *derivs;
+    float *sums;
+};
+
+/* create_network_on: create_network, with the weights and biases allocated
+ * with the given flags and node (see mem.h) */
+static struct network *create_network_on(int n_layers,
+                                         int n_neurons[n_layers],
+                                         int mem_flags, int node)
 {
     struct network *net;
-    struct layer *layer;
-    struct neuron *neuron;
-    int n_weights, n_biases;
+    float *p;
     int i, n;
 
     /* allocate space for network and pointers to biases, weights, layers */
@@ -25,17 +80,33 @@ struct network *create_network(int n_layers, int n_neurons[n_layers])
     net->layers = malloc(n_layers * sizeof(struct layer *));
     net->n_layers = n_layers;
     net->n_neurons = 0;
+    net->stats = NULL;
+    net->workspace = NULL;
+    net->comm = NULL;
+    net->evaluator = NULL;
+    train_loss_reset(&net->batch_loss);
+    train_loss_reset(&net->epoch_loss);
+    /* the input layer has no weights or biases */
+    net->biases[0] = NULL;
+    net->weights[0] = NULL;
+    net->n_params = 0;
+    for (i = 1; i < n_layers; i++)
+        net->n_params += (long)(n_neurons[i-1] + 1) * n_neurons[i];
+    p = net->params = mem_alloc_on(net->n_params * sizeof(float), mem_flags,
+                                   node);
 
     for (i = 0; i < n_layers; i++) {
         net->layers[i] = malloc(sizeof(struct layer));
         net->layers[i]->n_neurons = n_neurons[i];
+        net->layers[i]->trainable = i > 0;
         net->layers[i]->neurons = malloc(n_neurons[i] * sizeof(struct neuron));
         net->n_neurons += n_neurons[i];
         if (i > 0) {
-            net->biases[i] = malloc(n_neurons[i] * sizeof(float));
             net->weights[i] = malloc(n_neurons[i-1] * sizeof(float *));
-            for (n = 0; n < n_neurons[i-1]; n++)
-                net->weights[i][n] = malloc(n_neurons[i] * sizeof(float));
+            for (n = 0; n < n_neurons[i-1]; n++, p += n_neurons[i])
+                net->weights[i][n] = p;
+            net->biases[i] = p;
+            p += n_neurons[i];
         }
         for (n = 0; n < n_neurons[i]; n++) {
             net->layers[i]->neurons[n] = malloc(sizeof(struct neuron));
@@ -45,26 +116,270 @@ struct network *create_network(int n_layers, int n_neurons[n_layers])
     return net;
 }
 
+struct network *create_network(int n_layers, int n_neurons[n_layers])
+{
+    int flags, node;
+    mem_get_policy(&flags, &node);
+    return create_network_on(n_layers, n_neurons, flags, node);
+}
+
+static void free_workspace(struct network *net);
+
 void destroy_network(struct network *net)
 {
-    int l, n1, n2;
+    int l, n1;
+    free_workspace(net);
     for (l = 0; l < net->n_layers; l++) {
-        for (n1 = 0; n1 < net->layers[l]->n_neurons; n1++) {
+        for (n1 = 0; n1 < net->layers[l]->n_neurons; n1++)
             free(net->layers[l]->neurons[n1]);
-            if (l < net->n_layers-1) {
-                free(net->weights[l+1][n1]);
-            }
-        }
+        free(net->layers[l]->neurons);
         free(net->weights[l]);
-        free(net->biases[l]);
         free(net->layers[l]);
     }
+    mem_free(net->params);
     free(net->weights);
     free(net->biases);
     free(net->layers);
     free(net);
 }
 
+/* network_create_from_file: create a network with the structure stored in
+ * a file written by network_save_to_file, and load its weights and biases.
+ * The whole file is read and checked by network_create_from_memory.
+ * Returns NULL on error.
+ */
+struct network *network_create_from_file(char *str)
+{
+    struct network *net;
+    size_t len;
+    char *buf = io_read_file(str, &len);
+
+    if (!buf)
+        return NULL;
+    net = network_create_from_memory(buf, len);
+    free(buf);
+    return net;
+}
+
+/* network_create_from_memory: same as network_create_from_file, but for
+ * the contents of such a file, of len bytes, already in memory. Returns NULL
+ * if the contents are not a valid network.
+ */
+struct network *network_create_from_memory(char *buf, size_t len)
+{
+    struct network *net;
+    int n_layers, l, n1, n2;
+    size_t expected;
+    int *n_neurons = (int *)buf;
+    float *values;
+
+    if (len < sizeof(int) || (n_layers = n_neurons[0]) < 2
+            || len < ((size_t)n_layers + 1) * sizeof(int)) {
+        fprintf(stderr, "network_create_from_memory: bad header\n");
+        return NULL;
+    }
+    n_neurons++;
+    /* the size must match exactly the one implied by the topology */
+    expected = ((size_t)n_layers + 1) * sizeof(int);
+    for (l = 0; l < n_layers; l++) {
+        if (n_neurons[l] < 1) {
+            fprintf(stderr, "network_create_from_memory: bad header\n");
+            return NULL;
+        }
+        if (l > 0)
+            expected += (n_neurons[l-1] + 1) * (size_t)n_neurons[l]
+                        * sizeof(float);
+        if (expected > len)
+            break;
+    }
+    if (len != expected) {
+        fprintf(stderr, "network_create_from_memory:\n" \
+                "\texpected %zu bytes, but got %zu\n", expected, len);
+        return NULL;
+    }
+    net = create_network(n_layers, n_neurons);
+    values = (float *)(n_neurons + n_layers);
+    for (l = 1; l < n_layers; l++) {
+        for (n2 = 0; n2 < n_neurons[l]; n2++) {
+            for (n1 = 0; n1 < n_neurons[l-1]; n1++)
+                net->weights[l][n1][n2] = *values++;
+            net->biases[l][n2] = *values++;
+        }
+    }
+    return net;
+}
+
+/* network_max_neurons: number of neurons in the widest layer */
+int network_max_neurons(struct network *net)
+{
+    int l, max = 0;
+    for (l = 0; l < net->n_layers; l++)
+        if (net->layers[l]->n_neurons > max)
+            max = net->layers[l]->n_neurons;
+    return max;
+}
+
+/* network_n_weights: number of weights of the network, which is also the
+ * number of multiply-adds of a forward pass */
+long network_n_weights(struct network *net)
+{
+    long n = 0;
+    int l;
+    for (l = 1; l < net->n_layers; l++)
+        n += (long)net->layers[l-1]->n_neurons * net->layers[l]->n_neurons;
+    return n;
+}
+
+/* account: add a block of size bytes at p to *field, and what the
+ * allocator spends on it besides to the overhead */
+static void account(struct network_memory *mem, size_t *field, void *p,
+                    size_t size)
+{
+    if (!p)
+        return;
+    *field += size;
+    mem->blocks++;
+    mem->overhead += malloc_usable_size(p) + sizeof(size_t) - size;
+}
+
+/* account_mem: the same, for a block from mem_alloc */
+static void account_mem(struct network_memory *mem, size_t *field, void *p)
+{
+    if (!p)
+        return;
+    *field += mem_usable_size(p);
+    mem->blocks++;
+    mem->overhead += mem_overhead(p);
+}
+
+/* network_memory_stats: memory allocated for the network, and for its
+ * training workspace if it has been trained. Since every neuron is a block
+ * of its own, the overhead of the allocator is far from negligible for
+ * small layers */
+void network_memory_stats(struct network *net, struct network_memory *mem)
+{
+    struct train_workspace *ws = net->workspace;
+    int l, n, max = network_max_neurons(net);
+
+    memset(mem, 0, sizeof(struct network_memory));
+    account(mem, &mem->structure, net, sizeof(struct network));
+    account(mem, &mem->structure, net->biases, net->n_layers * sizeof(float *));
+    account(mem, &mem->structure, net->weights,
+            net->n_layers * sizeof(float **));
+    account(mem, &mem->structure, net->layers,
+            net->n_layers * sizeof(struct layer *));
+    account_mem(mem, &mem->params, net->params);
+    for (l = 0; l < net->n_layers; l++) {
+        account(mem, &mem->structure, net->layers[l], sizeof(struct layer));
+        account(mem, &mem->structure, net->layers[l]->neurons,
+                net->layers[l]->n_neurons * sizeof(struct neuron *));
+        for (n = 0; n < net->layers[l]->n_neurons; n++)
+            account(mem, &mem->state, net->layers[l]->neurons[n],
+                    sizeof(struct neuron));
+        if (l > 0)
+            account(mem, &mem->structure, net->weights[l],
+                    net->layers[l-1]->n_neurons * sizeof(float *));
+    }
+    if (ws) {
+        account(mem, &mem->workspace, ws, sizeof(struct train_workspace));
+        account(mem, &mem->workspace, ws->cost_derivs,
+                3 * max * sizeof(float));
+        account(mem, &mem->workspace, ws->activs,
+                2 * ws->batch_size * sizeof(float **));
+        account(mem, &mem->workspace, ws->rows,
+                2 * ws->batch_size * net->n_layers * sizeof(float *));
+        account_mem(mem, &mem->workspace, ws->values);
+        account_mem(mem, &mem->workspace, ws->before);
+    }
+    mem->total = mem->params + mem->state + mem->structure + mem->workspace
+                 + mem->overhead;
+}
+
+void network_memory_print(FILE *fp, struct network_memory *mem)
+{
+    fprintf(fp, "%zu bytes in %ld blocks: parameters %zu, neurons %zu, " \
+            "structure %zu, workspace %zu, allocator overhead %zu\n",
+            mem->total, mem->blocks, mem->params, mem->state,
+            mem->structure, mem->workspace, mem->overhead);
+}
+
+/* network_dataset_bytes: memory taken by n_samples inputs and expected
+ * outputs of the network, as passed to network_SGD */
+size_t network_dataset_bytes(struct network *net, long n_samples)
+{
+    return n_samples * (net->layers[0]->n_neurons
+                        + net->layers[net->n_layers-1]->n_neurons)
+           * sizeof(float);
+}
+
+/* network_clone: a copy of the network, weights and biases included, with
+ * those allocated with mem_flags on node (see mem.h) */
+struct network *network_clone(struct network *net, int mem_flags, int node)
+{
+    int sizes[net->n_layers], l;
+    struct network *copy;
+
+    for (l = 0; l < net->n_layers; l++)
+        sizes[l] = net->layers[l]->n_neurons;
+    copy = create_network_on(net->n_layers, sizes, mem_flags, node);
+    memcpy(copy->params, net->params, net->n_params * sizeof(float));
+    for (l = 0; l < net->n_layers; l++)
+        copy->layers[l]->trainable = net->layers[l]->trainable;
+    return copy;
+}
+
+/* network_replicate: a copy of the network on each NUMA node online.
+ * Threads doing inference take theirs with network_local_replica, so that
+ * they read the weights from the memory of their own node */
+struct network_replicas *network_replicate(struct network *net,
+                                           int mem_flags)
+{
+    struct network_replicas *r = malloc(sizeof(struct network_replicas));
+    int i;
+
+    r->n_nodes = mem_n_nodes();
+    r->nodes = malloc(r->n_nodes * sizeof(int));
+    /* in case a node went offline meanwhile */
+    i = mem_nodes(r->nodes, r->n_nodes);
+    if (i < r->n_nodes)
+        r->n_nodes = i;
+    r->nets = malloc(r->n_nodes * sizeof(struct network *));
+    for (i = 0; i < r->n_nodes; i++)
+        r->nets[i] = network_clone(net, mem_flags, r->nodes[i]);
+    return r;
+}
+
+/* network_replicas_update: copy the weights and biases of net, which must
+ * have the same topology, into every replica */
+void network_replicas_update(struct network_replicas *r, struct network *net)
+{
+    int i;
+    for (i = 0; i < r->n_nodes; i++)
+        memcpy(r->nets[i]->params, net->params,
+               net->n_params * sizeof(float));
+}
+
+/* network_local_replica: the replica on the node of the calling thread,
+ * or the first one if there is none there */
+struct network *network_local_replica(struct network_replicas *r)
+{
+    int node = mem_current_node(), i;
+    for (i = 0; i < r->n_nodes; i++)
+        if (r->nodes[i] == node)
+            return r->nets[i];
+    return r->nets[0];
+}
+
+void network_replicas_destroy(struct network_replicas *r)
+{
+    int i;
+    for (i = 0; i < r->n_nodes; i++)
+        destroy_network(r->nets[i]);
+    free(r->nodes);
+    free(r->nets);
+    free(r);
+}
+
 /* feedforward:
  *      Input:
  *              net   -> a (trained) network
@@ -84,6 +399,7 @@ void feedforward(struct network *net, float input[net->layers[0]->n_neurons],
     
     /* For each layer (except the input layer)... */
     for (l = 1; l < net->n_layers; l++) {
+        TRACE_BEGIN("forward", l);
         layer = net->layers[l];
         layer_prev = net->layers[l-1];
         /* For each neuron in the layer... */
@@ -99,12 +415,174 @@ void feedforward(struct network *net, float input[net->layers[0]->n_neurons],
             neuron->in_sum += net->biases[l][n2];
             neuron->out = activation_function(neuron->in_sum);
         }
+        TRACE_END();
     }
     /* Save network output into output array */
     for (n1 = 0; n1 < layer->n_neurons; n1++)
         output[n1] = layer->neurons[n1]->out;
 }
 
+#define FF_BLOCK 64
+
+/* feedforward_layer:
+ *      Compute layer l (l > 0) of the network for batch_size inputs, without
+ *      modifying the state of the network.
+ *      Input:
+ *              input    -> batch_size activation vectors of layer l-1,
+ *                          one after the other
+ *              output   -> where the batch_size vectors of layer l are saved
+ *              activate -> whether to apply the activation function. If
+ *                          not, the weighted sums (biases included) are
+ *                          saved instead.
+ */
+void feedforward_layer(struct network *net, int l, int batch_size,
+                       float *input, float *output, int activate)
+{
+    int n1, n2, b, block, end;
+    int n_prev = net->layers[l-1]->n_neurons;
+    int n_cur = net->layers[l]->n_neurons;
+    float *in, *out, *w, a;
+
+    for (b = 0; b < batch_size; b++)
+        for (n2 = 0; n2 < n_cur; n2++)
+            output[b*n_cur + n2] = 0;
+    /* Go through the weights in blocks of rows, so that each block
+     * stays in cache while it is applied to every input of the batch */
+    for (block = 0; block < n_prev; block += FF_BLOCK) {
+        end = (block + FF_BLOCK < n_prev) ? block + FF_BLOCK : n_prev;
+        for (b = 0; b < batch_size; b++) {
+            in = input + b*n_prev;
+            out = output + b*n_cur;
+            for (n1 = block; n1 < end; n1++) {
+                a = in[n1];
+                w = net->weights[l][n1];
+                for (n2 = 0; n2 < n_cur; n2++)
+                    out[n2] += a * w[n2];
+            }
+        }
+    }
+    /* Add bias and compute the activation function */
+    for (b = 0; b < batch_size; b++) {
+        out = output + b*n_cur;
+        for (n2 = 0; n2 < n_cur; n2++)
+            out[n2] += net->biases[l][n2];
+        if (activate)
+            for (n2 = 0; n2 < n_cur; n2++)
+                out[n2] = activation_function(out[n2]);
+    }
+}
+
+/* feedforward_batch:
+ *      Same as feedforward, but for batch_size inputs at once. The state of
+ *      the network is not modified, so several threads can share a network
+ *      as long as each of them uses its own scratch space.
+ *      Input:
+ *              net     -> a (trained) network
+ *              input   -> batch_size input vectors
+ *              output  -> where the batch_size output vectors are saved
+ *              scratch -> 2 * batch_size * network_max_neurons(net) floats,
+ *                         or NULL to allocate them on each call.
+ */
+void feedforward_batch(struct network *net, int batch_size,
+             float input[][net->layers[0]->n_neurons],
+             float output[][net->layers[net->n_layers-1]->n_neurons],
+             float *scratch)
+{
+    int l, max = network_max_neurons(net);
+    float *cur, *next, *alloc = NULL;
+
+    if (!scratch)
+        scratch = alloc = malloc(2 * batch_size * max * sizeof(float));
+    cur = &input[0][0];
+    for (l = 1; l < net->n_layers; l++) {
+        if (l == net->n_layers-1)
+            next = &output[0][0];
+        else
+            next = scratch + (l % 2) * batch_size * max;
+        TRACE_BEGIN("forward", l);
+        feedforward_layer(net, l, batch_size, cur, next, 1);
+        TRACE_END();
+        cur = next;
+    }
+    free(alloc);
+}
+
+#define CLASSIFY_BATCH 64
+
+/* top_k: save in labels the indices of the k largest of the n values, from
+ * the largest down. Ties go to the lowest index */
+static void top_k(int n, float *values, int k, int *labels)
+{
+    int i, j, found = 0;
+    for (i = 0; i < n; i++) {
+        if (found == k && !(values[i] > values[labels[k-1]]))
+            continue;
+        /* insert i in its place, dropping the smallest if full */
+        j = (found < k) ? found++ : k-1;
+        for (; j > 0 && values[i] > values[labels[j-1]]; j--)
+            labels[j] = labels[j-1];
+        labels[j] = i;
+    }
+}
+
+/* network_classify:
+ *      Classify n inputs: for each of them, save in labels the topk output
+ *      neurons with the highest activation, from the highest down.
+ *      Input:
+ *              labels  -> n * topk ints
+ *              scores  -> n * topk floats where the activations of those
+ *                         neurons are saved, or NULL if only the labels are
+ *                         needed.
+ *              softmax -> if set, the scores are the softmax of the sums
+ *                         at the output layer, instead of the activations.
+ *      Since the activation function is monotonic, the labels are picked
+ *      from the sums at the output layer, and the activation (or softmax)
+ *      is only computed for the scores actually requested.
+ */
+void network_classify(struct network *net, int n,
+                 float input[][net->layers[0]->n_neurons],
+                 int labels[], int topk, float scores[], int softmax)
+{
+    int n_out = net->layers[net->n_layers-1]->n_neurons;
+    int max = network_max_neurons(net);
+    int start, batch, l, b, i;
+    float *scratch, *cur, *next, *sums, *s, norm, top;
+
+    if (topk < 1)
+        return;
+    if (topk > n_out)
+        topk = n_out;
+    scratch = malloc(3 * CLASSIFY_BATCH * max * sizeof(float));
+    for (start = 0; start < n; start += CLASSIFY_BATCH) {
+        batch = (start + CLASSIFY_BATCH < n) ? CLASSIFY_BATCH : n - start;
+        cur = &input[start][0];
+        for (l = 1; l < net->n_layers-1; l++) {
+            next = scratch + (l % 2) * CLASSIFY_BATCH * max;
+            feedforward_layer(net, l, batch, cur, next, 1);
+            cur = next;
+        }
+        sums = scratch + 2 * CLASSIFY_BATCH * max;
+        feedforward_layer(net, net->n_layers-1, batch, cur, sums, 0);
+        for (b = 0; b < batch; b++) {
+            s = sums + b * n_out;
+            top_k(n_out, s, topk, labels + (start + b) * topk);
+            if (!scores)
+                continue;
+            if (softmax) {
+                top = s[labels[(start + b) * topk]];
+                for (i = 0, norm = 0; i < n_out; i++)
+                    norm += exp(s[i] - top);
+            }
+            for (i = 0; i < topk; i++) {
+                l = labels[(start + b) * topk + i];
+                scores[(start + b) * topk + i] = softmax ?
+                        exp(s[l] - top) / norm : activation_function(s[l]);
+            }
+        }
+    }
+    free(scratch);
+}
+
 /* network_set_random_weights_biases: Assign random weights to the network, uniformly
  *                             distributed between min and max
  * Input:
@@ -166,42 +644,151 @@ void network_get_biases(struct network *net, float biases[
             biases[i++] = net->biases[l][n];
 }
 
+/* backward_limit: the lowest layer whose deltas are needed, that is the
+ * lowest trainable one, or the output layer if none is */
+static int backward_limit(struct network *net)
+{
+    int low = network_lowest_trainable(net);
+    return low < net->n_layers-1 ? low : net->n_layers-1;
+}
+
+/* get_workspace: the workspace of the network, grown to batch_size
+ * samples if needed, and laid out again if the trainable layers changed */
+static struct train_workspace *get_workspace(struct network *net,
+                                             int batch_size)
+{
+    struct train_workspace *ws = net->workspace;
+    int max = network_max_neurons(net), low = backward_limit(net);
+    size_t per_sample = 0;
+    float *v;
+    int i, l;
+
+    if (!ws) {
+        ws = net->workspace = TRAIN_MALLOC(net,
+                                           sizeof(struct train_workspace));
+        ws->batch_size = 0;
+        ws->activs = NULL;
+        ws->rows = NULL;
+        ws->values = NULL;
+        ws->before = NULL;
+        ws->lowest = low;
+        ws->cost_derivs = TRAIN_MALLOC(net, 3 * max * sizeof(float));
+        ws->derivs = ws->cost_derivs + max;
+        ws->sums = ws->derivs + max;
+    }
+    if (net->comm && !ws->before) {
+        ws->before = mem_alloc(net->n_params * sizeof(float));
+#ifndef NO_TRAIN_STATS
+        if (net->stats)
+            net->stats->allocs++;
+#endif
+    }
+    if (batch_size <= ws->batch_size) {
+        if (low == ws->lowest || !ws->batch_size)
+            return ws;
+        batch_size = ws->batch_size;
+    }
+    /* the contents need not be kept from one minibatch to the next */
+    for (l = low - 1; l < net->n_layers; l++)
+        per_sample += net->layers[l]->n_neurons * (l >= low ? 2 : 1);
+    free(ws->activs);
+    free(ws->rows);
+    mem_free(ws->values);
+    ws->activs = TRAIN_MALLOC(net, 2 * batch_size * sizeof(float **));
+    ws->deltas = ws->activs + batch_size;
+    ws->rows = TRAIN_MALLOC(net, 2 * batch_size * net->n_layers
+                                 * sizeof(float *));
+    ws->values = mem_alloc(batch_size * per_sample * sizeof(float));
+#ifndef NO_TRAIN_STATS
+    if (net->stats)
+        net->stats->allocs++;
+#endif
+    v = ws->values;
+    for (i = 0; i < 2 * batch_size; i++) {
+        ws->activs[i] = ws->rows + i * net->n_layers;
+        for (l = 0; l < net->n_layers; l++) {
+            if (l < low - (i < batch_size)) {
+                ws->activs[i][l] = NULL;
+                continue;
+            }
+            ws->activs[i][l] = v;
+            v += net->layers[l]->n_neurons;
+        }
+    }
+    ws->batch_size = batch_size;
+    ws->lowest = low;
+    return ws;
+}
+
+static void free_workspace(struct network *net)
+{
+    struct train_workspace *ws = net->workspace;
+
+    if (!ws)
+        return;
+    free(ws->activs);
+    free(ws->rows);
+    mem_free(ws->values);
+    mem_free(ws->before);
+    free(ws->cost_derivs);
+    free(ws);
+    net->workspace = NULL;
+}
+
+/* calc_activs_deltas: the activations and errors (deltas) of every layer
+ * for one sample, as needed by the gradient of the trainable layers. The
+ * deltas go down to the lowest trainable layer, and the activations to
+ * the layer below it; those of the lower layers, and the deltas of the
+ * input layer, are not computed */
 void calc_activs_deltas(struct network *net,
                     float input[net->layers[0]->n_neurons],
                     float output[net->layers[net->n_layers-1]->n_neurons],
                     float **activs, float **deltas)
 {
     int out_neurons = net->layers[net->n_layers-1]->n_neurons;
-    int n1, l;
+    int n1, l, low = backward_limit(net);
     float output_curr[out_neurons];
+    struct train_workspace *ws;
     float *sums;
     float *cost_derivs; /* Derivatives of the cost function with respect to the
                         * activations at the last layer */
     float *derivs;  /* Derivative of the activation function at "sums" */
 
-    cost_derivs = malloc(out_neurons * sizeof(float));
-    derivs = malloc(out_neurons * sizeof(float));
+    STATS_BEGIN(net, t);
+    ws = get_workspace(net, 0);
+    cost_derivs = ws->cost_derivs;
+    derivs = ws->derivs;
+    sums = ws->sums;
     /* Step 1: feedforward */
     feedforward(net, input, output_curr);
     /* Get sums and activations*/
-    sums = malloc(out_neurons * sizeof(float));
     for (n1 = 0; n1 < out_neurons; n1++) {
         sums[n1] = net->layers[net->n_layers-1]->neurons[n1]->in_sum;
     }
-    for (l = 0; l < net->n_layers; l++) {
+    for (l = low - 1; l < net->n_layers; l++) {
         for (n1 = 0; n1 < net->layers[l]->n_neurons; n1++)
             activs[l][n1] =net->layers[l]->neurons[n1]->out;
     }
+    /* the cost, and whether it is a hit, while the outputs are at hand */
+    ws->cost = train_loss_add(&net->batch_loss, out_neurons,
+                              activs[net->n_layers-1], output);
+#ifndef NO_TRAIN_STATS
+    if (net->stats) {
+        net->stats->window_loss += ws->cost;
+        net->stats->window_samples++;
+    }
+#endif
+    STATS_END(net, PHASE_FORWARD, t);
+    STATS_BEGIN(net, t2);
     /* Step 2: output error */
     /* Calculate errors in the output layer */
     vsubstract(out_neurons, cost_derivs, activs[net->n_layers-1], output);
     diff_activation_function_vector(out_neurons, derivs, sums);  
     vscalarprod(out_neurons, deltas[net->n_layers-1], cost_derivs, derivs);
-    /* Step 3: backpropagate */
-    for (l = net->n_layers-2; l >= 0; l--) {
+    /* Step 3: backpropagate, down to the lowest trainable layer */
+    for (l = net->n_layers-2; l >= low; l--) {
+        TRACE_BEGIN("backward", l);
         /* Compute the delta of each neuron */
-        free(sums);
-        sums = malloc(net->layers[l]->n_neurons * sizeof(float));
         for (n1 = 0; n1 < net->layers[l]->n_neurons; n1++) {
             /* Fill vector of sums from current layer */
             sums[n1] = net->layers[l]->neurons[n1]->in_sum;
@@ -213,25 +800,26 @@ void calc_activs_deltas(struct network *net,
         diff_activation_function_vector(net->layers[l]->n_neurons, sums, sums);
         /* Compute errors of current layer (deltas) */
         vscalarprod(net->layers[l]->n_neurons, deltas[l], deltas[l], sums);
+        TRACE_END();
     } 
-    free(sums);
-    free(cost_derivs);
-    free(derivs);
+    STATS_END(net, PHASE_BACKWARD, t2);
 }
 
-void network_backprop(struct network *net, int batch_size,
-                    int out_neurons, float input[][net->layers[0]->n_neurons],
-                    float output[][out_neurons], float eta, int offset,
-                    float ***activs, float ***deltas)
+/* apply_update: move the weights and biases of the trainable layers
+ * against the mean of the gradients of batch_size samples, given their
+ * activations and deltas */
+static void apply_update(struct network *net, int batch_size, float eta,
+                         float ***activs, float ***deltas)
 {
     int n1, n2, l;
-    int set, i;
+    int set;
     float gradient;
-    /* Compute gradient for each test */
-    for (set = 0; set < batch_size; set++)
-        calc_activs_deltas(net, input[set+offset], output[set+offset],
-                       activs[set], deltas[set]);
+
+    STATS_BEGIN(net, t);
+    TRACE_BEGIN("update", -1);
     for (l = 1; l < net->n_layers; l++) {
+        if (!net->layers[l]->trainable)
+            continue;
         for (n2 = 0; n2 < net->layers[l]->n_neurons; n2++) {
             /* Update weight */
             for (n1 = 0; n1 < net->layers[l-1]->n_neurons; n1++) {
@@ -247,6 +835,23 @@ void network_backprop(struct network *net, int batch_size,
             net->biases[l][n2] -= eta/(float)batch_size * gradient;
         }
     }
+    TRACE_END();
+    STATS_END(net, PHASE_UPDATE, t);
+}
+
+void network_backprop(struct network *net, int batch_size,
+                    int out_neurons, float input[][net->layers[0]->n_neurons],
+                    float output[][out_neurons], float eta, int offset,
+                    float ***activs, float ***deltas)
+{
+    int set;
+    /* Compute gradient for each test */
+    train_loss_reset(&net->batch_loss);
+    for (set = 0; set < batch_size; set++)
+        calc_activs_deltas(net, input[set+offset], output[set+offset],
+                       activs[set], deltas[set]);
+    train_loss_merge(&net->epoch_loss, &net->batch_loss);
+    apply_update(net, batch_size, eta, activs, deltas);
 }
 
 void network_update_minibatch(struct network *net, int batch_size,
@@ -254,41 +859,86 @@ void network_update_minibatch(struct network *net, int batch_size,
                     float output[][net->layers[net->n_layers-1]->n_neurons],
                     float eta, int offset)
 {
-    int i, train, out_neurons = net->layers[net->n_layers-1]->n_neurons;
-    float cost, cost_last, output_curr[batch_size][out_neurons];
-   
-    float ***deltas; /* Errors */
-    float ***activs;  /* Activations */
-    deltas = malloc(batch_size * sizeof(float *));
-    activs = malloc(batch_size * sizeof(float *));
-    for (train = 0; train < batch_size; train++) {
-        deltas[train] = malloc(net->n_layers * sizeof(float *));
-        activs[train] = malloc(net->n_layers * sizeof(float *));
-        for (i = 0; i < net->n_layers; i++) {
-            deltas[train][i] =
-                    malloc(net->layers[i]->n_neurons * sizeof(float));
-            activs[train][i] = 
-                    malloc(net->layers[i]->n_neurons * sizeof(float));
-        }
-    }
+    int out_neurons = net->layers[net->n_layers-1]->n_neurons;
+    struct train_workspace *ws;
+
+    /* the activations and errors of each sample go to the workspace */
+    STATS_BEGIN(net, t);
+    ws = get_workspace(net, batch_size);
+    STATS_END(net, PHASE_GATHER, t);
     network_backprop(net, batch_size, out_neurons, input, output, eta,
-                     offset, activs, deltas);
-    for (train = 0; train < batch_size; train++) {
-        for (i = 0; i < net->n_layers; i++) {
-            free(deltas[train][i]);
-            free(activs[train][i]);
-        }
-        free(deltas[train]);
-        free(activs[train]);
+                     offset, ws->activs, ws->deltas);
+}
+
+/* network_update_sampled: like network_update_minibatch, for the samples
+ * of the given indices, which need not be consecutive nor different. The
+ * gradient of each sample is multiplied by its weight, if weights is not
+ * NULL, and its cost is saved in losses, if not NULL */
+void network_update_sampled(struct network *net, int batch_size,
+                    float input[][net->layers[0]->n_neurons],
+                    float output[][net->layers[net->n_layers-1]->n_neurons],
+                    int *samples, float *weights, float eta, float *losses)
+{
+    int set, l, n, low;
+    struct train_workspace *ws;
+
+    STATS_BEGIN(net, t);
+    ws = get_workspace(net, batch_size);
+    STATS_END(net, PHASE_GATHER, t);
+    low = backward_limit(net);
+    train_loss_reset(&net->batch_loss);
+    for (set = 0; set < batch_size; set++) {
+        calc_activs_deltas(net, input[samples[set]], output[samples[set]],
+                           ws->activs[set], ws->deltas[set]);
+        if (losses)
+            losses[set] = ws->cost;
+        /* the gradient is linear in the deltas */
+        if (weights && weights[set] != 1)
+            for (l = low; l < net->n_layers; l++)
+                for (n = 0; n < net->layers[l]->n_neurons; n++)
+                    ws->deltas[set][l][n] *= weights[set];
     }
-    free(deltas);
-    free(activs);
+    train_loss_merge(&net->epoch_loss, &net->batch_loss);
+    apply_update(net, batch_size, eta, ws->activs, ws->deltas);
+}
+
+/* average_update: replace the update just made to the parameters, from
+ * before, by the mean of the updates made by all the processes of the
+ * communicator. Since all of them start from the same parameters and get
+ * the same sums, they end with the same parameters as well */
+static int average_update(struct network *net, float *before)
+{
+    float *params = net->params;
+    float scale = 1.0f / net->comm->size;
+    long i;
+
+    for (i = 0; i < net->n_params; i++)
+        params[i] -= before[i];
+    if (comm_allreduce(net->comm, params, net->n_params) < 0)
+        return -1;
+    for (i = 0; i < net->n_params; i++)
+        params[i] = before[i] + scale * params[i];
+    return 0;
 }
 
 /* network_SGD: train the network by stochastic gradient method.
  * For each epoch the training set is randomized and train_size/batch_size
  * mini-batches are used to perform gradient-descent
  *
+ * If the network has stats attached, they are updated as training goes,
+ * and their progress function is called every progress_every batches.
+ *
+ * If it has a communicator attached, every process trains on its own part
+ * of the training set, given as train_input and train_output. All start
+ * from the parameters of rank 0, train on as many minibatches as the
+ * process with the fewest, and average their updates after each one: the
+ * effective minibatch is batch_size times the number of processes. If a
+ * process fails, the others stop training and return.
+ *
+ * If it has an evaluator attached, a snapshot of the network is scored by
+ * it after each epoch, while training goes on, and training stops early if
+ * the evaluator says so (all the processes, if any of them does). When
+ * network_SGD returns, all the snapshots have been scored.
  */
 void network_SGD(struct network *net, int train_size, int batch_size,
      int n_epochs,
@@ -300,22 +950,274 @@ void network_SGD(struct network *net, int train_size, int batch_size,
     int n_in = net->layers[0]->n_neurons;
     int batch;
     int epoch;
-    int n_batches = train_size / batch_size;
+    long n_batches = train_size / batch_size;
+    struct comm *comm = net->comm;
+    struct evaluator *ev = net->evaluator;
+    long go;
+    float *before = NULL;
+#ifndef NO_TRAIN_STATS
+    struct train_stats *stats = net->stats;
+    struct network_memory mem;
+    double checkpoint;
+#endif
 
-    float input[batch_size][n_in], output[batch_size][n_out];
-    
+    if (comm) {
+        before = get_workspace(net, batch_size)->before;
+        if (comm_broadcast(comm, net->params, net->n_params, 0) < 0
+                || comm_min(comm, &n_batches) < 0) {
+            fprintf(stderr, "network_SGD: lost a training process\n");
+            return;
+        }
+    }
     for (epoch = 0; epoch < n_epochs; epoch++) {
+        TRACE_BEGIN("epoch", epoch);
+        train_loss_reset(&net->epoch_loss);
         /* Shuffle training set */
+        STATS_BEGIN(net, t);
+        TRACE_BEGIN("shuffle", -1);
         shuffle(train_size, n_in, train_input, n_out, train_output);
+        TRACE_END();
+        STATS_END(net, PHASE_SHUFFLE, t);
         for (batch = 0; batch < n_batches; batch++) {
             /* Create batch, and train network */
+            TRACE_BEGIN("minibatch", batch);
+            if (comm)
+                memcpy(before, net->params, net->n_params * sizeof(float));
             network_update_minibatch(net, batch_size,
-                                train_input, train_output, eta, batch);
+                                train_input, train_output, eta,
+                                batch * batch_size);
+            TRACE_END();
+            if (comm) {
+                STATS_BEGIN(net, t);
+                TRACE_BEGIN("allreduce", batch);
+                if (average_update(net, before) < 0) {
+                    TRACE_END();
+                    TRACE_END();
+                    fprintf(stderr, "network_SGD: lost a training process\n");
+                    return;
+                }
+                TRACE_END();
+                STATS_END(net, PHASE_COMM, t);
+            }
+#ifndef NO_TRAIN_STATS
+            if (!stats)
+                continue;
+            stats->samples += batch_size;
+            stats->batches++;
+            if (stats->progress && stats->progress_every > 0
+                    && stats->batches % stats->progress_every == 0) {
+                stats->loss_sum += stats->window_loss;
+                stats->loss_samples += stats->window_samples;
+                stats->running_loss = stats->window_samples ?
+                        stats->window_loss / stats->window_samples : 0;
+                stats->window_loss = 0;
+                stats->window_samples = 0;
+                stats->progress(net, stats);
+            }
+#endif
         }
+#ifndef NO_TRAIN_STATS
+        if (stats) {
+            network_memory_stats(net, &mem);
+            mem.total += network_dataset_bytes(net, train_size);
+            if (mem.total > stats->peak_bytes)
+                stats->peak_bytes = mem.total;
+        }
+#endif
         if (fun) {
+#ifndef NO_TRAIN_STATS
+            /* checkpoints taken by fun are accounted on their own */
+            checkpoint = stats ? stats->time[PHASE_CHECKPOINT] : 0;
+#endif
+            STATS_BEGIN(net, t);
+            TRACE_BEGIN("eval", epoch);
             fun(net, epoch);
+            TRACE_END();
+            STATS_END(net, PHASE_EVAL, t + (stats ?
+                      stats->time[PHASE_CHECKPOINT] - checkpoint : 0));
+        }
+        if (ev) {
+            /* only the snapshot is taken here, it is scored meanwhile */
+            STATS_BEGIN(net, t);
+            TRACE_BEGIN("snapshot", epoch);
+            evaluator_submit(ev, net, epoch);
+            TRACE_END();
+            STATS_END(net, PHASE_EVAL, t);
         }
+#ifndef NO_TRAIN_STATS
+        if (stats)
+            stats->epoch++;
+#endif
+        TRACE_END();
+        /* early stopping, for all the processes if any of them stops */
+        go = !(ev && evaluator_stopped(ev));
+        if (comm && comm_min(comm, &go) < 0) {
+            fprintf(stderr, "network_SGD: lost a training process\n");
+            return;
+        }
+        if (!go)
+            break;
+    }
+    if (ev)
+        evaluator_wait(ev);
+}
+
+/* network_set_evaluator: score snapshots of the network taken at the end
+ * of each epoch of network_SGD with the evaluator (see eval.h), which may
+ * stop training early, or stop doing so if ev is NULL */
+void network_set_evaluator(struct network *net, struct evaluator *ev)
+{
+    net->evaluator = ev;
+}
+
+/* network_set_comm: train the network together with other processes (see
+ * comm.h and network_SGD), or alone again if comm is NULL */
+void network_set_comm(struct network *net, struct comm *comm)
+{
+    net->comm = comm;
+}
+
+/* network_set_trainable: freeze layer l (l > 0) or make it trainable
+ * again. Training leaves the weights and biases of frozen layers as they
+ * are, and does not backpropagate below the lowest trainable layer, so
+ * that fine-tuning the top layers of a network costs little more than
+ * the forward pass */
+void network_set_trainable(struct network *net, int l, int trainable)
+{
+    if (l > 0 && l < net->n_layers)
+        net->layers[l]->trainable = trainable != 0;
+}
+
+/* network_lowest_trainable: the lowest trainable layer, or n_layers if
+ * all of them are frozen */
+int network_lowest_trainable(struct network *net)
+{
+    int l;
+
+    for (l = 1; l < net->n_layers; l++)
+        if (net->layers[l]->trainable)
+            return l;
+    return net->n_layers;
+}
+
+/* network_set_stats: attach stats to the network, to be updated by the
+ * training functions, or detach them if stats is NULL. If progress is not
+ * NULL, network_SGD calls it every "every" batches */
+void network_set_stats(struct network *net, struct train_stats *stats,
+                       int every, void progress(struct network *,
+                                                struct train_stats *))
+{
+    net->stats = stats;
+    if (stats) {
+        train_stats_reset(stats);
+        stats->progress_every = every;
+        stats->progress = progress;
+    }
+}
+
+/* train_stats_reset: set all the counters to zero */
+void train_stats_reset(struct train_stats *stats)
+{
+    int i;
+    for (i = 0; i < N_PHASES; i++)
+        stats->time[i] = 0;
+    stats->samples = stats->batches = stats->allocs = 0;
+    stats->peak_bytes = 0;
+    stats->epoch = 0;
+    stats->loss_sum = stats->window_loss = stats->running_loss = 0;
+    stats->window_samples = stats->loss_samples = 0;
+#ifndef NO_TRAIN_STATS
+    stats->start = io_now();
+#endif
+}
+
+/* train_stats_samples_per_sec: training throughput since the last reset */
+double train_stats_samples_per_sec(struct train_stats *stats)
+{
+#ifndef NO_TRAIN_STATS
+    double elapsed = io_now() - stats->start;
+    return elapsed > 0 ? stats->samples / elapsed : 0;
+#else
+    return 0;
+#endif
+}
+
+/* train_stats_loss: mean cost of all the samples trained on since the last
+ * reset */
+double train_stats_loss(struct train_stats *stats)
+{
+    long n = stats->loss_samples + stats->window_samples;
+    return n > 0 ? (stats->loss_sum + stats->window_loss) / n : 0;
+}
+
+/* train_loss_add: add the cost of a sample, which is returned, and
+ * whether it is a hit */
+float train_loss_add(struct train_loss *loss, int n, float *output,
+                     float *target)
+{
+    float cost = cost_function(n, output, target);
+    int i, best = 0, want = 0;
+
+    for (i = 1; i < n; i++) {
+        if (output[i] > output[best])
+            best = i;
+        if (target[i] > target[want])
+            want = i;
     }
+    if (n == 1)
+        loss->hits += (output[0] > 0.5) == (target[0] > 0.5);
+    else
+        loss->hits += best == want;
+    loss->cost += cost;
+    loss->samples++;
+    return cost;
+}
+
+void train_loss_reset(struct train_loss *loss)
+{
+    loss->cost = 0;
+    loss->hits = 0;
+    loss->samples = 0;
+}
+
+/* train_loss_merge: add the samples of loss to total */
+void train_loss_merge(struct train_loss *total, struct train_loss *loss)
+{
+    total->cost += loss->cost;
+    total->hits += loss->hits;
+    total->samples += loss->samples;
+}
+
+/* train_loss_mean: the mean cost of the samples */
+double train_loss_mean(struct train_loss *loss)
+{
+    return loss->samples ? loss->cost / loss->samples : 0;
+}
+
+/* train_loss_accuracy: the share of hits among the samples */
+double train_loss_accuracy(struct train_loss *loss)
+{
+    return loss->samples ? (double)loss->hits / loss->samples : 0;
+}
+
+void train_stats_print(FILE *fp, struct train_stats *stats)
+{
+    static const char *names[N_PHASES] = { "shuffle", "gather", "forward",
+                            "backward", "update", "eval", "checkpoint",
+                            "comm" };
+    double total = 0;
+    int i;
+
+    for (i = 0; i < N_PHASES; i++)
+        total += stats->time[i];
+    fprintf(fp, "epoch %d, %ld batches, %ld samples, %.1f samples/s, " \
+            "loss %.5f (last %.5f), %ld allocations, peak memory %zu " \
+            "bytes\n", stats->epoch, stats->batches, stats->samples,
+            train_stats_samples_per_sec(stats), train_stats_loss(stats),
+            stats->running_loss, stats->allocs, stats->peak_bytes);
+    for (i = 0; i < N_PHASES; i++)
+        fprintf(fp, "  %-10s %10.3f s %5.1f%%\n", names[i], stats->time[i],
+                total > 0 ? 100 * stats->time[i] / total : 0);
 }
 
 /* shuffle: Durstenfeld's version of Fisher–Yates shuffle, for two arrays
@@ -382,12 +1284,14 @@ float cost_function(int n, float output[n], float output_correct[n])
 int network_save_to_file(struct network *net, char *str)
 {
     int l, n1, n2;
-    int  fp = open(str, O_WRONLY | O_CREAT | O_TRUNC | S_IRUSR | S_IWUSR);
-    
+    int  fp = open(str, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    STATS_BEGIN(net, t);
+
     if (fp < 0) {
         fprintf(stderr, "Could not open file %s\n", str);
         return fp;
     }
+    TRACE_BEGIN("checkpoint", -1);
 
     /* 1. Number of layers */
     write(fp, &(net->n_layers), sizeof(int));
@@ -403,6 +1307,9 @@ int network_save_to_file(struct network *net, char *str)
             write(fp, &(net->biases[l][n2]), sizeof(float));
         }
     }
+    close(fp);
+    TRACE_END();
+    STATS_END(net, PHASE_CHECKPOINT, t);
     return 0;
 }
 
@@ -422,6 +1329,7 @@ int network_load_from_file(struct network *net, char *str)
     if (l != net->n_layers) {
         fprintf(stderr, "network_load_from_file:\n" \
                          "\tunexpected number of layers\n");
+        close(fp);
         return -1;
     }
     /* 2. Number of neurons in each layer */
@@ -430,7 +1338,8 @@ int network_load_from_file(struct network *net, char *str)
         if ((net->layers[l])->n_neurons != n1) {
             fprintf(stderr, "network_load_from_file:\n" \
                 "\tunexpected number of neurons in layer %d. Expected %d, but" \
-                " file contains %d", l, net->layers[l]->n_neurons, n1);
+                " file contains %d\n", l, net->layers[l]->n_neurons, n1);
+            close(fp);
             return -1;
         }
     }
@@ -442,5 +1351,6 @@ int network_load_from_file(struct network *net, char *str)
             read(fp, &(net->biases[l][n2]), sizeof(float));
         }
     }
+    close(fp);
     return 0;
 }
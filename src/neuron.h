@@ -1,3 +1,9 @@
+#ifndef __NEURON__
+#define __NEURON__
+
+#include <stdio.h>
+#include <stddef.h>
+
 struct neuron {
     float in_sum;
     float out;
@@ -6,6 +12,58 @@ struct neuron {
 struct layer {
     int n_neurons;
     struct neuron **neurons;
+    int trainable;      /* whether training updates the weights and biases
+                           of the layer; never for the input layer */
+};
+
+struct network;
+struct train_workspace;
+struct comm;
+struct evaluator;
+
+/* Phases of training whose time is accounted in struct train_stats */
+enum train_phase {
+    PHASE_SHUFFLE,      /* shuffling the training set */
+    PHASE_GATHER,       /* setting up each minibatch */
+    PHASE_FORWARD,      /* feedforward of each sample */
+    PHASE_BACKWARD,     /* computing the deltas of each sample */
+    PHASE_UPDATE,       /* updating weights and biases */
+    PHASE_EVAL,         /* the callback at the end of each epoch */
+    PHASE_CHECKPOINT,   /* network_save_to_file */
+    PHASE_COMM,         /* averaging the updates with other processes */
+    N_PHASES
+};
+
+/* Counters filled during training when a network has stats attached (see
+ * network_set_stats). Compiling the library with -DNO_TRAIN_STATS removes
+ * them altogether */
+struct train_stats {
+    double time[N_PHASES];  /* seconds spent in each phase */
+    double start;           /* when the stats were reset */
+    long samples;           /* samples trained on */
+    long batches;
+    int epoch;
+    long allocs;            /* memory allocations in the training path */
+    size_t peak_bytes;      /* memory of the network, its workspace and the
+                               training set, at most */
+    double loss_sum;        /* sum of the cost of the samples trained on */
+    long loss_samples;
+    double window_loss;     /* the same, since the last progress call */
+    long window_samples;
+    double running_loss;    /* mean cost between the last two progress
+                               calls */
+    int progress_every;     /* batches between calls to progress */
+    void (*progress)(struct network *, struct train_stats *);
+};
+
+/* Cost and hits of the samples trained on, added up by the backward pass
+ * from the outputs it computes anyway. A sample is a hit if its largest
+ * output is that of its largest target or, for a single output, if both
+ * are on the same side of 0.5 */
+struct train_loss {
+    double cost;        /* sum of the cost of the samples */
+    long hits;
+    long samples;
 };
 
 struct network {
@@ -13,16 +71,86 @@ struct network {
     int n_neurons;
     float **biases;
     float ***weights;
+    float *params;      /* all the weights and biases, in one block (see
+                           mem.h): for each layer its weights, row by row,
+                           and then its biases */
+    long n_params;
     struct layer **layers;
+    struct train_stats *stats;
+    struct train_workspace *workspace;  /* buffers for training, kept
+                                           between minibatches */
+    struct comm *comm;  /* processes training together, or NULL */
+    struct evaluator *evaluator;    /* scoring snapshots taken at the end
+                                       of each epoch, or NULL */
+    struct train_loss batch_loss;   /* of the last minibatch trained on */
+    struct train_loss epoch_loss;   /* of the minibatches of the epoch
+                                       being trained, or of the last one
+                                       once it is over */
+};
+
+/* Memory used by a network, in bytes */
+struct network_memory {
+    size_t params;      /* weights and biases */
+    size_t state;       /* the neurons: sums and activations */
+    size_t structure;   /* the network and layers, and arrays of pointers */
+    size_t workspace;   /* training buffers */
+    size_t overhead;    /* allocator headers and padding of all the above */
+    long blocks;        /* number of allocations */
+    size_t total;
 };
 
 struct network *create_network(int n_layers, int n_neurons[n_layers]);
 
 void destroy_network(struct network *net);
 
+struct network *network_create_from_file(char *filename);
+
+struct network *network_create_from_memory(char *buf, size_t len);
+
+int network_max_neurons(struct network *net);
+
+long network_n_weights(struct network *net);
+
+void network_memory_stats(struct network *net, struct network_memory *mem);
+
+void network_memory_print(FILE *fp, struct network_memory *mem);
+
+size_t network_dataset_bytes(struct network *net, long n_samples);
+
+struct network *network_clone(struct network *net, int mem_flags, int node);
+
+/* Copies of a network, one per NUMA node, for inference from threads
+ * spread among the nodes */
+struct network_replicas {
+    int n_nodes;
+    int *nodes;         /* the node of each replica */
+    struct network **nets;
+};
+
+struct network_replicas *network_replicate(struct network *net,
+                                           int mem_flags);
+
+void network_replicas_update(struct network_replicas *r, struct network *net);
+
+struct network *network_local_replica(struct network_replicas *r);
+
+void network_replicas_destroy(struct network_replicas *r);
+
 void feedforward(struct network *net, float input[net->layers[0]->n_neurons],
              float output[net->layers[net->n_layers-1]->n_neurons]);
 
+void feedforward_layer(struct network *net, int l, int batch_size,
+                       float *input, float *output, int activate);
+
+void feedforward_batch(struct network *net, int batch_size,
+             float input[][net->layers[0]->n_neurons],
+             float output[][net->layers[net->n_layers-1]->n_neurons],
+             float *scratch);
+
+void network_classify(struct network *net, int n,
+                 float input[][net->layers[0]->n_neurons],
+                 int labels[], int topk, float scores[], int softmax);
+
 void network_set_random_weights_biases(struct network *net, float min, float max);
 
 void network_set_weights(struct network *net, float *weights);
@@ -50,6 +178,11 @@ void network_update_minibatch(struct network *net, int batch_size,
                     float output[][net->layers[net->n_layers-1]->n_neurons],
                     float eta, int offset);
 
+void network_update_sampled(struct network *net, int batch_size,
+                    float input[][net->layers[0]->n_neurons],
+                    float output[][net->layers[net->n_layers-1]->n_neurons],
+                    int *samples, float *weights, float eta, float *losses);
+
 void network_SGD(struct network *net, int train_size, int batch_size,
                  int epochs, float input[train_size][net->layers[0]->n_neurons],
                  float output[train_size][net->layers[net->n_layers-1]->
@@ -61,6 +194,37 @@ void shuffle(int len, int n_in, float inputs[len][n_in],
 
 void exchange (int n_elems, float array1[n_elems], float array2[n_elems]);
 
+void network_set_stats(struct network *net, struct train_stats *stats,
+                       int every, void progress(struct network *,
+                                                struct train_stats *));
+
+void network_set_comm(struct network *net, struct comm *comm);
+
+void network_set_evaluator(struct network *net, struct evaluator *ev);
+
+void network_set_trainable(struct network *net, int l, int trainable);
+
+int network_lowest_trainable(struct network *net);
+
+void train_stats_reset(struct train_stats *stats);
+
+double train_stats_samples_per_sec(struct train_stats *stats);
+
+double train_stats_loss(struct train_stats *stats);
+
+float train_loss_add(struct train_loss *loss, int n, float *output,
+                     float *target);
+
+void train_loss_reset(struct train_loss *loss);
+
+void train_loss_merge(struct train_loss *total, struct train_loss *loss);
+
+double train_loss_mean(struct train_loss *loss);
+
+double train_loss_accuracy(struct train_loss *loss);
+
+void train_stats_print(FILE *fp, struct train_stats *stats);
+
 float activation_function(float x);
 
 float diff_activation_function(float x);
@@ -75,3 +239,5 @@ float cost_function(int n, float output[n], float output_correct[n]);
 int network_save_to_file(struct network *net, char *filename);
 
 int network_load_from_file(struct network *net, char *filename);
+
+#endif
@@ -0,0 +1,399 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "pipeline.h"
+#include "neuron.h"
+#include "trace.h"
+#include "io.h"
+
+#define SPINS 1000          /* polls of a queue before sleeping on it */
+#define COST_REPS 3         /* timings of each layer in pipeline_create */
+
+struct stage_args {
+    struct pipeline *p;
+    int index;
+};
+
+/* Queues. The producer reserves a slot, fills it and publishes it; the
+ * consumer takes the oldest one and pops it when done. Each side sleeps
+ * on the counter of the other after spinning for a while, and wakes the
+ * other side only if it is asleep */
+
+static void queue_wait(struct pipeline_queue *q, atomic_uint *word,
+                       unsigned old)
+{
+    int spins = 0;
+
+    while (atomic_load(word) == old) {
+        if (++spins < SPINS)
+            continue;
+        atomic_fetch_add(&q->waiting, 1);
+        if (atomic_load(word) == old)
+            syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, old, NULL, NULL, 0);
+        atomic_fetch_sub(&q->waiting, 1);
+    }
+}
+
+static void queue_wake(struct pipeline_queue *q, atomic_uint *word)
+{
+    if (atomic_load(&q->waiting))
+        syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+/* queue_reserve: the next free slot, or NULL if there is none and "wait"
+ * is 0 */
+static struct pipeline_slot *queue_reserve(struct pipeline_queue *q,
+                                           int wait)
+{
+    unsigned head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    unsigned tail;
+
+    while (head - (tail = atomic_load(&q->tail)) >= PIPELINE_SLOTS) {
+        if (!wait)
+            return NULL;
+        queue_wait(q, &q->tail, tail);
+    }
+    return &q->slots[head % PIPELINE_SLOTS];
+}
+
+static void queue_publish(struct pipeline_queue *q)
+{
+    atomic_fetch_add(&q->head, 1);
+    queue_wake(q, &q->head);
+}
+
+static struct pipeline_slot *queue_front(struct pipeline_queue *q)
+{
+    unsigned tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+
+    queue_wait(q, &q->head, tail);
+    return &q->slots[tail % PIPELINE_SLOTS];
+}
+
+static void queue_pop(struct pipeline_queue *q)
+{
+    atomic_fetch_add(&q->tail, 1);
+    queue_wake(q, &q->tail);
+}
+
+static void *stage_thread(void *arg)
+{
+    struct stage_args *args = arg;
+    struct pipeline *p = args->p;
+    struct pipeline_stage *st = &p->stages[args->index];
+    struct pipeline_slot *in, *out;
+    int size = p->micro_batch * network_max_neurons(p->net), l;
+    float *cur, *next;
+    double start, t;
+
+    free(args);
+    for (;;) {
+        in = queue_front(st->in);
+        out = queue_reserve(st->out, 1);
+        out->n = in->n;
+        out->tag = in->tag;
+        if (in->n < 0) {
+            queue_pop(st->in);
+            queue_publish(st->out);
+            return NULL;
+        }
+        start = io_now();
+        cur = in->data;
+        for (l = st->first; l <= st->last; l++) {
+            next = l == st->last ? out->data
+                                 : st->scratch + (l - st->first) % 2 * size;
+            t = io_now();
+            TRACE_BEGIN("forward", l);
+            feedforward_layer(p->net, l, in->n, cur, next, 1);
+            TRACE_END();
+            p->time[l] += io_now() - t;
+            p->samples[l] += in->n;
+            cur = next;
+        }
+        st->busy += io_now() - start;
+        st->batches++;
+        st->samples += in->n;
+        queue_pop(st->in);
+        queue_publish(st->out);
+    }
+}
+
+/* partition: group the layers in stages of consecutive layers, so that
+ * the most costly stage costs as little as possible */
+static void partition(struct pipeline *p)
+{
+    int m = p->net->n_layers - 1, n = p->n_stages, i, j, k;
+    double prefix[m + 1], best[n + 1][m + 1], c;
+    int cut[n + 1][m + 1];
+
+    prefix[0] = 0;
+    for (i = 1; i <= m; i++)
+        prefix[i] = prefix[i-1] + p->cost[i];
+    /* best[k][i]: cost of the first i layers in k stages */
+    for (i = 1; i <= m; i++)
+        best[1][i] = prefix[i];
+    for (k = 2; k <= n; k++)
+        for (i = k; i <= m; i++) {
+            best[k][i] = -1;
+            for (j = k - 1; j < i; j++) {
+                c = prefix[i] - prefix[j];
+                if (best[k-1][j] > c)
+                    c = best[k-1][j];
+                if (best[k][i] < 0 || c < best[k][i]) {
+                    best[k][i] = c;
+                    cut[k][i] = j;
+                }
+            }
+        }
+    for (i = m, k = n; k > 0; k--) {
+        j = k == 1 ? 0 : cut[k][i];
+        p->stages[k-1].first = j + 1;
+        p->stages[k-1].last = i;
+        i = j;
+    }
+}
+
+/* start_stages: start a thread for each stage, pinned to a CPU of its own
+ * if there are enough of them */
+static void start_stages(struct pipeline *p)
+{
+    struct stage_args *args;
+    cpu_set_t allowed, one;
+    int i, cpu = -1;
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0
+            || CPU_COUNT(&allowed) < p->n_stages)
+        CPU_ZERO(&allowed);
+    for (i = 0; i < p->n_stages; i++) {
+        args = malloc(sizeof(struct stage_args));
+        args->p = p;
+        args->index = i;
+        p->stages[i].cpu = -1;
+        pthread_create(&p->stages[i].thread, NULL, stage_thread, args);
+        if (CPU_COUNT(&allowed) == 0)
+            continue;
+        while (!CPU_ISSET(++cpu, &allowed))
+            ;
+        CPU_ZERO(&one);
+        CPU_SET(cpu, &one);
+        if (pthread_setaffinity_np(p->stages[i].thread, sizeof(one),
+                                   &one) == 0)
+            p->stages[i].cpu = cpu;
+    }
+    p->start = io_now();
+}
+
+/* stop_stages: send the stages a stop marker behind the micro-batches in
+ * the pipeline, throwing away the outputs nobody received, so that no stage
+ * is left waiting for room in a full queue */
+static void stop_stages(struct pipeline *p)
+{
+    struct pipeline_queue *last = &p->queues[p->n_stages];
+    struct pipeline_slot *slot;
+    int i, n;
+
+    while (!(slot = queue_reserve(&p->queues[0], 0))) {
+        queue_front(last);
+        queue_pop(last);
+    }
+    slot->n = -1;
+    queue_publish(&p->queues[0]);
+    do {
+        n = queue_front(last)->n;
+        queue_pop(last);
+    } while (n >= 0);
+    for (i = 0; i < p->n_stages; i++)
+        pthread_join(p->stages[i].thread, NULL);
+}
+
+/* measure: time every layer on a micro-batch of random samples */
+static void measure(struct pipeline *p)
+{
+    int max = network_max_neurons(p->net), l, r, i;
+    float *in = malloc(2 * (size_t)p->micro_batch * max * sizeof(float));
+    float *out = in + (size_t)p->micro_batch * max;
+    double t, min;
+
+    for (i = 0; i < p->micro_batch * max; i++)
+        in[i] = (float)rand() / RAND_MAX;
+    for (l = 1; l < p->net->n_layers; l++) {
+        for (min = -1, r = 0; r < COST_REPS; r++) {
+            t = io_now();
+            feedforward_layer(p->net, l, p->micro_batch, in, out, 1);
+            t = io_now() - t;
+            if (min < 0 || t < min)
+                min = t;
+        }
+        p->cost[l] = min / p->micro_batch;
+    }
+    free(in);
+}
+
+/* pipeline_create: run net in n_stages stages (at most one per layer), on
+ * micro-batches of up to micro_batch samples. Returns NULL on error */
+struct pipeline *pipeline_create(struct network *net, int n_stages,
+                                 int micro_batch)
+{
+    struct pipeline *p;
+    size_t size = (size_t)micro_batch * network_max_neurons(net);
+    int i, j;
+
+    if (n_stages < 1 || micro_batch < 1) {
+        fprintf(stderr, "pipeline_create: %d stages of micro-batches of " \
+                "%d\n", n_stages, micro_batch);
+        return NULL;
+    }
+    if (n_stages > net->n_layers - 1)
+        n_stages = net->n_layers - 1;
+    p = calloc(1, sizeof(struct pipeline));
+    p->net = net;
+    p->n_stages = n_stages;
+    p->micro_batch = micro_batch;
+    p->stages = calloc(n_stages, sizeof(struct pipeline_stage));
+    p->queues = aligned_alloc(64, (n_stages + 1)
+                                  * sizeof(struct pipeline_queue));
+    memset(p->queues, 0, (n_stages + 1) * sizeof(struct pipeline_queue));
+    for (i = 0; i <= n_stages; i++)
+        for (j = 0; j < PIPELINE_SLOTS; j++)
+            p->queues[i].slots[j].data = malloc(size * sizeof(float));
+    for (i = 0; i < n_stages; i++) {
+        p->stages[i].scratch = malloc(2 * size * sizeof(float));
+        p->stages[i].in = &p->queues[i];
+        p->stages[i].out = &p->queues[i + 1];
+    }
+    p->cost = calloc(net->n_layers, sizeof(double));
+    p->time = calloc(net->n_layers, sizeof(double));
+    p->samples = calloc(net->n_layers, sizeof(long));
+    measure(p);
+    partition(p);
+    start_stages(p);
+    return p;
+}
+
+/* pipeline_destroy: stop the stages and free the pipeline. Micro-batches
+ * still in it are dropped; no other thread may be submitting or receiving */
+void pipeline_destroy(struct pipeline *p)
+{
+    int i, j;
+
+    if (!p)
+        return;
+    stop_stages(p);
+    for (i = 0; i <= p->n_stages; i++)
+        for (j = 0; j < PIPELINE_SLOTS; j++)
+            free(p->queues[i].slots[j].data);
+    for (i = 0; i < p->n_stages; i++)
+        free(p->stages[i].scratch);
+    free(p->queues);
+    free(p->stages);
+    free(p->cost);
+    free(p->time);
+    free(p->samples);
+    free(p);
+}
+
+/* fill: copy n samples of input into slot */
+static void fill(struct pipeline *p, struct pipeline_slot *slot, int n,
+                 float *input, void *tag)
+{
+    slot->n = n;
+    slot->tag = tag;
+    memcpy(slot->data, input,
+           (size_t)n * p->net->layers[0]->n_neurons * sizeof(float));
+    queue_publish(&p->queues[0]);
+}
+
+/* pipeline_submit: put n samples (at most the micro-batch) of input in the
+ * pipeline, waiting for room if needed. tag comes out with them */
+int pipeline_submit(struct pipeline *p, int n, float *input, void *tag)
+{
+    if (n < 1 || n > p->micro_batch) {
+        fprintf(stderr, "pipeline_submit: %d samples, for micro-batches " \
+                "of %d\n", n, p->micro_batch);
+        return -1;
+    }
+    fill(p, queue_reserve(&p->queues[0], 1), n, input, tag);
+    return 0;
+}
+
+/* pipeline_receive: wait for the oldest micro-batch submitted to come out,
+ * and copy its outputs. Returns the number of samples */
+int pipeline_receive(struct pipeline *p, float *output, void **tag)
+{
+    struct pipeline_queue *q = &p->queues[p->n_stages];
+    struct pipeline_slot *slot = queue_front(q);
+    int n = slot->n;
+
+    memcpy(output, slot->data, (size_t)n
+           * p->net->layers[p->net->n_layers-1]->n_neurons * sizeof(float));
+    if (tag)
+        *tag = slot->tag;
+    queue_pop(q);
+    return n;
+}
+
+/* pipeline_run: put n samples through the pipeline. Micro-batches are
+ * submitted while there is room, so the calling thread only waits for
+ * outputs */
+void pipeline_run(struct pipeline *p, int n, float *input, float *output)
+{
+    int n_in = p->net->layers[0]->n_neurons;
+    int n_out = p->net->layers[p->net->n_layers-1]->n_neurons;
+    struct pipeline_slot *slot;
+    int submitted = 0, received = 0, k;
+
+    while (received < n) {
+        if (submitted < n && (slot = queue_reserve(&p->queues[0], 0))) {
+            k = n - submitted < p->micro_batch ? n - submitted
+                                               : p->micro_batch;
+            fill(p, slot, k, input + (size_t)submitted * n_in, NULL);
+            submitted += k;
+            continue;
+        }
+        received += pipeline_receive(p, output + (size_t)received * n_out,
+                                     NULL);
+    }
+}
+
+/* pipeline_rebalance: group the layers again by the cost measured while
+ * running. Nothing may be in the pipeline */
+void pipeline_rebalance(struct pipeline *p)
+{
+    int l, i;
+
+    stop_stages(p);
+    for (l = 1; l < p->net->n_layers; l++)
+        if (p->samples[l] > 0)
+            p->cost[l] = p->time[l] / p->samples[l];
+    partition(p);
+    for (i = 0; i < p->n_stages; i++) {
+        p->stages[i].batches = p->stages[i].samples = 0;
+        p->stages[i].busy = 0;
+    }
+    start_stages(p);
+}
+
+/* pipeline_stats_print: the layers, estimated cost and utilization (time
+ * computing over time running) of each stage */
+void pipeline_stats_print(FILE *fp, struct pipeline *p)
+{
+    struct pipeline_stage *st;
+    double elapsed = io_now() - p->start, cost;
+    int i, l;
+
+    for (i = 0; i < p->n_stages; i++) {
+        st = &p->stages[i];
+        for (cost = 0, l = st->first; l <= st->last; l++)
+            cost += p->cost[l];
+        fprintf(fp, "stage %d: layers %d-%d, cpu %d, %.2f us/sample, " \
+                "%ld batches, %ld samples, %.1f%% busy\n", i, st->first,
+                st->last, st->cpu, cost * 1e6, st->batches, st->samples,
+                elapsed > 0 ? 100 * st->busy / elapsed : 0);
+    }
+}
@@ -0,0 +1,83 @@
+#ifndef __PIPELINE__
+#define __PIPELINE__
+
+#include <stdio.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "neuron.h"
+
+/* Pipelined inference, for deep networks serving a stream of samples.
+ *
+ * The layers of the network are split in n_stages groups of consecutive
+ * layers, each run by a thread of its own (pinned to a CPU of its own when
+ * there are enough), so that the weights of every group stay in the cache
+ * of its core. Samples go through the stages in micro-batches, which are
+ * passed from one stage to the next through lock-free single-producer,
+ * single-consumer queues; each stage computes its layers with
+ * feedforward_layer, writing the last one straight into the queue of the
+ * next stage.
+ *
+ * The groups are balanced by the cost of each layer: pipeline_create
+ * times every layer on a micro-batch, and the stages keep timing them
+ * while they run, so that pipeline_rebalance can move the boundaries
+ * according to what was measured.
+ *
+ * One thread may submit micro-batches while another one receives them, in
+ * the same order; pipeline_run does both for a whole array of samples.
+ */
+
+#define PIPELINE_SLOTS 4    /* micro-batches in each queue */
+
+struct pipeline_slot {
+    int n;              /* samples, or -1 to stop the stages */
+    void *tag;          /* given to pipeline_submit */
+    float *data;        /* n samples of the layer at the boundary */
+};
+
+/* A queue of micro-batches between two stages. head and tail only grow */
+struct pipeline_queue {
+    atomic_uint head __attribute__((aligned(64)));     /* published */
+    atomic_uint tail __attribute__((aligned(64)));     /* consumed */
+    atomic_int waiting __attribute__((aligned(64)));   /* sleepers */
+    struct pipeline_slot slots[PIPELINE_SLOTS];
+};
+
+struct pipeline_stage {
+    int first, last;    /* layers computed, both included */
+    pthread_t thread;
+    int cpu;            /* pinned to, or -1 */
+    float *scratch;     /* two layers of a micro-batch */
+    struct pipeline_queue *in, *out;
+    long batches;
+    long samples;
+    double busy;        /* seconds computing */
+};
+
+struct pipeline {
+    struct network *net;
+    int n_stages;
+    int micro_batch;
+    struct pipeline_stage *stages;
+    struct pipeline_queue *queues;  /* n_stages + 1 */
+    double *cost;       /* of each layer, in seconds per sample */
+    double *time;       /* measured while running, per layer */
+    long *samples;
+    double start;       /* when the stages started */
+};
+
+struct pipeline *pipeline_create(struct network *net, int n_stages,
+                                 int micro_batch);
+
+void pipeline_destroy(struct pipeline *p);
+
+int pipeline_submit(struct pipeline *p, int n, float *input, void *tag);
+
+int pipeline_receive(struct pipeline *p, float *output, void **tag);
+
+void pipeline_run(struct pipeline *p, int n, float *input, float *output);
+
+void pipeline_rebalance(struct pipeline *p);
+
+void pipeline_stats_print(FILE *fp, struct pipeline *p);
+
+#endif
@@ -0,0 +1,151 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include "pool.h"
+#include "trace.h"
+
+struct pool_job {
+    void (*task)(void *, int, int);
+    void *arg;
+    int n_tasks;
+    int next;       /* next task to start */
+    int finished;   /* number of tasks finished */
+    pthread_cond_t done;
+    struct pool_job *next_job;
+};
+
+static void *pool_worker(void *arg);
+
+struct worker_args {
+    struct pool *pool;
+    int index;
+};
+
+/* pool_default_threads: number of online processors */
+int pool_default_threads(void)
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+}
+
+/* pool_create: start a pool of n_threads workers (one per processor if
+ * n_threads is 0 or less) */
+struct pool *pool_create(int n_threads)
+{
+    struct pool *pool = malloc(sizeof(struct pool));
+    struct worker_args *args;
+    int i;
+
+    if (n_threads <= 0)
+        n_threads = pool_default_threads();
+    pool->n_threads = n_threads;
+    pool->threads = calloc(n_threads, sizeof(struct pool_thread));
+    pool->jobs = NULL;
+    pool->stop = 0;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    for (i = 0; i < n_threads; i++) {
+        args = malloc(sizeof(struct worker_args));
+        args->pool = pool;
+        args->index = i;
+        pthread_create(&pool->threads[i].thread, NULL, pool_worker, args);
+    }
+    return pool;
+}
+
+/* pool_destroy: stop the workers and free the pool. No job may be running */
+void pool_destroy(struct pool *pool)
+{
+    int i;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+    for (i = 0; i < pool->n_threads; i++) {
+        pthread_join(pool->threads[i].thread, NULL);
+        free(pool->threads[i].scratch);
+    }
+    pthread_cond_destroy(&pool->work);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->threads);
+    free(pool);
+}
+
+static void *pool_worker(void *arg)
+{
+    struct worker_args *args = arg;
+    struct pool *pool = args->pool;
+    int index = args->index;
+    struct pool_job *job;
+    char name[32];
+    int i;
+
+    free(args);
+    snprintf(name, sizeof(name), "pool %d", index);
+    trace_thread_name(name);
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (!pool->jobs && !pool->stop)
+            pthread_cond_wait(&pool->work, &pool->lock);
+        if (!pool->jobs)
+            break;
+        job = pool->jobs;
+        i = job->next++;
+        /* Once its last task is started, the job leaves the queue */
+        if (job->next == job->n_tasks)
+            pool->jobs = job->next_job;
+        pthread_mutex_unlock(&pool->lock);
+        TRACE_BEGIN("task", i);
+        job->task(job->arg, i, index);
+        TRACE_END();
+        pthread_mutex_lock(&pool->lock);
+        if (++job->finished == job->n_tasks)
+            pthread_cond_signal(&job->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+void pool_run(struct pool *pool, int n_tasks,
+              void task(void *, int, int), void *arg)
+{
+    struct pool_job job, **last;
+
+    if (n_tasks <= 0)
+        return;
+    job.task = task;
+    job.arg = arg;
+    job.n_tasks = n_tasks;
+    job.next = job.finished = 0;
+    job.next_job = NULL;
+    pthread_cond_init(&job.done, NULL);
+
+    pthread_mutex_lock(&pool->lock);
+    for (last = &pool->jobs; *last; last = &(*last)->next_job)
+        ;
+    *last = &job;
+    pthread_cond_broadcast(&pool->work);
+    /* the time the caller waits for the slowest worker */
+    TRACE_BEGIN("join", n_tasks);
+    while (job.finished < n_tasks)
+        pthread_cond_wait(&job.done, &pool->lock);
+    TRACE_END();
+    pthread_mutex_unlock(&pool->lock);
+    pthread_cond_destroy(&job.done);
+}
+
+/* pool_scratch: scratch space of at least n_floats for the worker "thread".
+ * It is kept between jobs, and only grows, so that the workers do not have
+ * to allocate memory for each task. Must only be called from the worker
+ * itself */
+float *pool_scratch(struct pool *pool, int thread, size_t n_floats)
+{
+    struct pool_thread *t = &pool->threads[thread];
+    if (t->scratch_size < n_floats) {
+        free(t->scratch);
+        t->scratch = malloc(n_floats * sizeof(float));
+        t->scratch_size = n_floats;
+    }
+    return t->scratch;
+}
@@ -0,0 +1,45 @@
+#ifndef __POOL__
+#define __POOL__
+
+#include <stddef.h>
+#include <pthread.h>
+
+/* A pool of worker threads that runs jobs made of independent tasks.
+ *
+ * pool_run(pool, n_tasks, task, arg) calls task(arg, i, thread) for every
+ * i in [0, n_tasks), spread among the workers, and returns when all of
+ * them have finished. "thread" is the index of the worker running the
+ * task, which can be used to pick per-thread data such as the scratch
+ * space returned by pool_scratch. Several threads may call pool_run at the
+ * same time; their jobs are served in order of arrival.
+ */
+
+struct pool_job;
+
+struct pool_thread {
+    pthread_t thread;
+    float *scratch;
+    size_t scratch_size;
+};
+
+struct pool {
+    int n_threads;
+    struct pool_thread *threads;
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    struct pool_job *jobs;  /* jobs with tasks not yet started */
+    int stop;
+};
+
+struct pool *pool_create(int n_threads);
+
+void pool_destroy(struct pool *pool);
+
+void pool_run(struct pool *pool, int n_tasks,
+              void task(void *, int, int), void *arg);
+
+float *pool_scratch(struct pool *pool, int thread, size_t n_floats);
+
+int pool_default_threads(void);
+
+#endif
@@ -0,0 +1,485 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "population.h"
+#include "neuron.h"
+#include "matrix.h"
+#include "mem.h"
+#include "trace.h"
+
+#define POPULATION_BLOCK 64 /* inputs whose rows of the fused first layer,
+                               which span every network of the group, are
+                               applied to the whole minibatch before the
+                               next ones, so that they stay in the cache */
+
+static int n_neurons(struct network *net, int l)
+{
+    return net->layers[l]->n_neurons;
+}
+
+/* make_groups: spread the networks among n_groups groups, the largest
+ * first, each to the group with the fewest weights so far */
+static void make_groups(struct population *p)
+{
+    struct population_group *g;
+    long *load = calloc(p->n_groups, sizeof(long)), w;
+    int *done = calloc(p->n_nets, sizeof(int));
+    int i, k, best, least, n_in = n_neurons(p->nets[0], 0);
+
+    for (i = 0; i < p->n_groups; i++) {
+        p->groups[i].nets = malloc(p->n_nets * sizeof(int));
+        p->groups[i].column = malloc(p->n_nets * sizeof(int));
+        p->groups[i].runs = malloc(2 * p->n_nets * sizeof(int));
+    }
+    for (i = 0; i < p->n_nets; i++) {
+        best = -1;
+        for (k = 0; k < p->n_nets; k++)
+            if (!done[k] && (best < 0 || network_n_weights(p->nets[k])
+                                         > network_n_weights(p->nets[best])))
+                best = k;
+        done[best] = 1;
+        least = 0;
+        for (k = 1; k < p->n_groups; k++)
+            if (load[k] < load[least])
+                least = k;
+        w = network_n_weights(p->nets[best]);
+        load[least] += w;
+        g = &p->groups[least];
+        g->nets[g->n_nets] = best;
+        g->column[g->n_nets++] = g->n_cols;
+        g->n_cols += n_neurons(p->nets[best], 1);
+    }
+    for (i = 0; i < p->n_groups; i++) {
+        g = &p->groups[i];
+        g->weights = mem_alloc((size_t)n_in * g->n_cols * sizeof(float));
+        g->biases = malloc(g->n_cols * sizeof(float));
+        g->rate = malloc(g->n_cols * sizeof(float));
+    }
+    free(load);
+    free(done);
+}
+
+/* population_create: train the n_nets networks together, network k with
+ * learning rate eta[k], with a pool of n_threads threads (one per
+ * processor if 0). All of them must have the same input and output
+ * layers. Returns NULL on error */
+struct population *population_create(int n_nets, struct network **nets,
+                                     float *eta, int n_threads)
+{
+    struct population *p;
+    int k, n_in, n_out;
+
+    if (n_nets < 1) {
+        fprintf(stderr, "population_create: %d networks\n", n_nets);
+        return NULL;
+    }
+    n_in = n_neurons(nets[0], 0);
+    n_out = n_neurons(nets[0], nets[0]->n_layers-1);
+    for (k = 0; k < n_nets; k++)
+        if (nets[k]->n_layers < 2 || n_neurons(nets[k], 0) != n_in
+                || n_neurons(nets[k], nets[k]->n_layers-1) != n_out) {
+            fprintf(stderr, "population_create: network %d does not take " \
+                    "%d inputs to %d outputs\n", k, n_in, n_out);
+            return NULL;
+        }
+    p = calloc(1, sizeof(struct population));
+    p->n_nets = n_nets;
+    p->nets = malloc(n_nets * sizeof(struct network *));
+    memcpy(p->nets, nets, n_nets * sizeof(struct network *));
+    p->eta = malloc(n_nets * sizeof(float));
+    memcpy(p->eta, eta, n_nets * sizeof(float));
+    p->loss = calloc(n_nets, sizeof(double));
+    p->pool = pool_create(n_threads);
+    p->n_groups = n_nets < p->pool->n_threads ? n_nets : p->pool->n_threads;
+    p->groups = calloc(p->n_groups, sizeof(struct population_group));
+    make_groups(p);
+    p->buffers = calloc(n_nets, sizeof(struct population_buffers));
+    for (k = 0; k < n_nets; k++) {
+        p->buffers[k].sums = calloc(nets[k]->n_layers, sizeof(float *));
+        p->buffers[k].activs = calloc(nets[k]->n_layers, sizeof(float *));
+        p->buffers[k].deltas = calloc(nets[k]->n_layers, sizeof(float *));
+    }
+    return p;
+}
+
+void population_destroy(struct population *p)
+{
+    struct population_buffers *buf;
+    int i, l;
+
+    if (!p)
+        return;
+    pool_destroy(p->pool);
+    for (i = 0; i < p->n_groups; i++) {
+        free(p->groups[i].nets);
+        free(p->groups[i].column);
+        free(p->groups[i].runs);
+        mem_free(p->groups[i].weights);
+        free(p->groups[i].biases);
+        free(p->groups[i].rate);
+        mem_free(p->groups[i].sums);
+        free(p->groups[i].row);
+    }
+    for (i = 0; i < p->n_nets; i++) {
+        buf = &p->buffers[i];
+        for (l = 1; l < p->nets[i]->n_layers; l++) {
+            mem_free(buf->sums[l]);
+            mem_free(buf->activs[l]);
+            mem_free(buf->deltas[l]);
+        }
+        free(buf->sums);
+        free(buf->activs);
+        free(buf->deltas);
+    }
+    free(p->buffers);
+    free(p->groups);
+    free(p->loss);
+    free(p->eta);
+    free(p->nets);
+    free(p);
+}
+
+/* grow: make room in the buffers for batch_size samples */
+static void grow(struct population *p, int batch_size)
+{
+    struct population_group *g;
+    struct population_buffers *buf;
+    struct network *net;
+    size_t size;
+    int i, k, l, max;
+
+    if (batch_size <= p->batch_size)
+        return;
+    for (i = 0; i < p->n_groups; i++) {
+        g = &p->groups[i];
+        mem_free(g->sums);
+        g->sums = mem_alloc((size_t)batch_size * g->n_cols * sizeof(float));
+        max = g->n_cols;
+        for (k = 0; k < g->n_nets; k++)
+            if (network_max_neurons(p->nets[g->nets[k]]) > max)
+                max = network_max_neurons(p->nets[g->nets[k]]);
+        free(g->row);
+        g->row = malloc(max * sizeof(float));
+    }
+    for (k = 0; k < p->n_nets; k++) {
+        net = p->nets[k];
+        buf = &p->buffers[k];
+        for (l = 1; l < net->n_layers; l++) {
+            size = (size_t)batch_size * n_neurons(net, l) * sizeof(float);
+            mem_free(buf->sums[l]);
+            mem_free(buf->activs[l]);
+            mem_free(buf->deltas[l]);
+            buf->sums[l] = mem_alloc(size);
+            buf->activs[l] = mem_alloc(size);
+            buf->deltas[l] = mem_alloc(size);
+        }
+    }
+    p->batch_size = batch_size;
+}
+
+/* load: copy the first layers of the networks of the group into its
+ * matrix, their learning rates, and the runs of columns to train */
+static void load(struct population *p, struct population_group *g)
+{
+    struct network *net;
+    int i, j, k, n, n_in = n_neurons(p->nets[0], 0);
+
+    g->n_runs = 0;
+    for (k = 0; k < g->n_nets; k++) {
+        net = p->nets[g->nets[k]];
+        n = n_neurons(net, 1);
+        for (i = 0; i < n_in; i++)
+            memcpy(g->weights + (size_t)i * g->n_cols + g->column[k],
+                   net->weights[1][i], n * sizeof(float));
+        memcpy(g->biases + g->column[k], net->biases[1], n * sizeof(float));
+        for (j = 0; j < n; j++)
+            g->rate[g->column[k] + j] = p->eta[g->nets[k]] / (float)p->batch;
+        if (!net->layers[1]->trainable)
+            continue;
+        if (g->n_runs && g->runs[2*g->n_runs - 1] == g->column[k]) {
+            g->runs[2*g->n_runs - 1] += n;
+        } else {
+            g->runs[2*g->n_runs] = g->column[k];
+            g->runs[2*g->n_runs + 1] = g->column[k] + n;
+            g->n_runs++;
+        }
+    }
+}
+
+/* store: copy the first layers back to the networks */
+static void store(struct population *p, struct population_group *g)
+{
+    struct network *net;
+    int i, k, n, n_in = n_neurons(p->nets[0], 0);
+
+    for (k = 0; k < g->n_nets; k++) {
+        net = p->nets[g->nets[k]];
+        n = n_neurons(net, 1);
+        for (i = 0; i < n_in; i++)
+            memcpy(net->weights[1][i],
+                   g->weights + (size_t)i * g->n_cols + g->column[k],
+                   n * sizeof(float));
+        memcpy(net->biases[1], g->biases + g->column[k], n * sizeof(float));
+    }
+}
+
+/* first_layer: the weighted sums of the first layers of the group, for
+ * the batch, into g->sums */
+static void first_layer(struct population_group *g, int n_in, int batch,
+                        float *input)
+{
+    int cols = g->n_cols, n1, c, b, block, end;
+    float *in, *out, *w, a;
+
+    memset(g->sums, 0, (size_t)batch * cols * sizeof(float));
+    for (block = 0; block < n_in; block += POPULATION_BLOCK) {
+        end = (block + POPULATION_BLOCK < n_in) ? block + POPULATION_BLOCK
+                                                : n_in;
+        for (b = 0; b < batch; b++) {
+            in = input + (size_t)b * n_in;
+            out = g->sums + (size_t)b * cols;
+            for (n1 = block; n1 < end; n1++) {
+                a = in[n1];
+                w = g->weights + (size_t)n1 * cols;
+                for (c = 0; c < cols; c++)
+                    out[c] += a * w[c];
+            }
+        }
+    }
+    for (b = 0; b < batch; b++) {
+        out = g->sums + (size_t)b * cols;
+        for (c = 0; c < cols; c++)
+            out[c] += g->biases[c];
+    }
+}
+
+/* backprop: the rest of the forward pass and the backward pass of a
+ * network, from the sums of its first layer in the group, down to its
+ * lowest trainable layer. The deltas of the first layer are left in place
+ * of its sums if it is trainable. The cost and hits of the samples go to
+ * the loss of the minibatch of the network */
+static void backprop(struct population_group *g, int column,
+                     struct network *net, struct population_buffers *buf,
+                     int batch, float *output)
+{
+    int n_out = n_neurons(net, net->n_layers-1), last = net->n_layers-1;
+    int low = network_lowest_trainable(net), n, n1, n2, b, l;
+    float *sums, *activs, *deltas, *next;
+
+    n = n_neurons(net, 1);
+    for (b = 0; b < batch; b++)
+        memcpy(buf->sums[1] + (size_t)b * n,
+               g->sums + (size_t)b * g->n_cols + column, n * sizeof(float));
+    for (l = 1; l <= last; l++) {
+        n = n_neurons(net, l);
+        if (l > 1)
+            feedforward_layer(net, l, batch, buf->activs[l-1], buf->sums[l],
+                              0);
+        for (b = 0; b < batch * n; b++)
+            buf->activs[l][b] = activation_function(buf->sums[l][b]);
+    }
+    /* errors of the output layer */
+    for (b = 0; b < batch; b++) {
+        activs = buf->activs[last] + (size_t)b * n_out;
+        sums = buf->sums[last] + (size_t)b * n_out;
+        deltas = buf->deltas[last] + (size_t)b * n_out;
+        train_loss_add(&net->batch_loss, n_out, activs,
+                       output + (size_t)b * n_out);
+        if (low > last)
+            continue;
+        vsubstract(n_out, deltas, activs, output + (size_t)b * n_out);
+        diff_activation_function_vector(n_out, sums, sums);
+        vscalarprod(n_out, deltas, deltas, sums);
+    }
+    /* and of the hidden layers, down to the lowest trainable one */
+    for (l = last-1; l >= low; l--) {
+        n = n_neurons(net, l);
+        n2 = n_neurons(net, l+1);
+        for (b = 0; b < batch; b++) {
+            sums = buf->sums[l] + (size_t)b * n;
+            deltas = buf->deltas[l] + (size_t)b * n;
+            next = buf->deltas[l+1] + (size_t)b * n2;
+            for (n1 = 0; n1 < n; n1++)
+                deltas[n1] = vprod(n2, net->weights[l+1][n1], next);
+            diff_activation_function_vector(n, sums, sums);
+            vscalarprod(n, deltas, deltas, sums);
+        }
+    }
+    if (low > 1)
+        return;
+    n = n_neurons(net, 1);
+    for (b = 0; b < batch; b++)
+        memcpy(g->sums + (size_t)b * g->n_cols + column,
+               buf->deltas[1] + (size_t)b * n, n * sizeof(float));
+}
+
+/* update: apply the gradient of the trainable layers after the first one */
+static void update(struct population_group *g, struct network *net,
+                   struct population_buffers *buf, int batch, float eta)
+{
+    int n_prev, n_cur, n1, n2, b, l;
+    float rate = eta / (float)batch, *a, *d, gradient;
+
+    for (l = 2; l < net->n_layers; l++) {
+        if (!net->layers[l]->trainable)
+            continue;
+        n_prev = n_neurons(net, l-1);
+        n_cur = n_neurons(net, l);
+        for (n1 = 0; n1 < n_prev; n1++) {
+            memset(g->row, 0, n_cur * sizeof(float));
+            for (b = 0; b < batch; b++) {
+                a = buf->activs[l-1] + (size_t)b * n_prev;
+                d = buf->deltas[l] + (size_t)b * n_cur;
+                for (n2 = 0; n2 < n_cur; n2++)
+                    g->row[n2] += a[n1] * d[n2];
+            }
+            for (n2 = 0; n2 < n_cur; n2++)
+                net->weights[l][n1][n2] -= rate * g->row[n2];
+        }
+        for (n2 = 0; n2 < n_cur; n2++) {
+            gradient = 0;
+            for (b = 0; b < batch; b++)
+                gradient += buf->deltas[l][(size_t)b * n_cur + n2];
+            net->biases[l][n2] -= rate * gradient;
+        }
+    }
+}
+
+/* update_columns: apply the gradient of columns start to end - 1 of the
+ * first layers of the group, from the deltas left in g->sums */
+static void update_columns(struct population_group *g, int start, int end,
+                           int n_in, int batch, float *input)
+{
+    int cols = g->n_cols, n1, c, b;
+    float *w, *d, a;
+
+    for (n1 = 0; n1 < n_in; n1++) {
+        memset(g->row + start, 0, (end - start) * sizeof(float));
+        for (b = 0; b < batch; b++) {
+            a = input[(size_t)b * n_in + n1];
+            d = g->sums + (size_t)b * cols;
+            for (c = start; c < end; c++)
+                g->row[c] += a * d[c];
+        }
+        w = g->weights + (size_t)n1 * cols;
+        for (c = start; c < end; c++)
+            w[c] -= g->rate[c] * g->row[c];
+    }
+    for (c = start; c < end; c++) {
+        a = 0;
+        for (b = 0; b < batch; b++)
+            a += g->sums[(size_t)b * cols + c];
+        g->biases[c] -= g->rate[c] * a;
+    }
+}
+
+/* update_first_layer: apply the gradient of the trainable first layers of
+ * the group */
+static void update_first_layer(struct population_group *g, int n_in,
+                               int batch, float *input)
+{
+    int r;
+
+    for (r = 0; r < g->n_runs; r++)
+        update_columns(g, g->runs[2*r], g->runs[2*r + 1], n_in, batch,
+                       input);
+}
+
+/* run_group: a task of the pool, an epoch of the networks of group i */
+static void run_group(void *arg, int i, int thread)
+{
+    struct population *p = arg;
+    struct population_group *g = &p->groups[i];
+    struct network *net;
+    int n_in = n_neurons(p->nets[0], 0);
+    int n_out = n_neurons(p->nets[0], p->nets[0]->n_layers-1);
+    int batch = p->batch, k, m;
+    float *input, *output;
+
+    TRACE_BEGIN("population", i);
+    load(p, g);
+    for (k = 0; k < g->n_nets; k++)
+        train_loss_reset(&p->nets[g->nets[k]]->epoch_loss);
+    for (m = 0; m < p->n_batches; m++) {
+        input = p->input + (size_t)m * batch * n_in;
+        output = p->output + (size_t)m * batch * n_out;
+        first_layer(g, n_in, batch, input);
+        for (k = 0; k < g->n_nets; k++) {
+            net = p->nets[g->nets[k]];
+            p->buffers[g->nets[k]].activs[0] = input;
+            train_loss_reset(&net->batch_loss);
+            backprop(g, g->column[k], net, &p->buffers[g->nets[k]], batch,
+                     output);
+            train_loss_merge(&net->epoch_loss, &net->batch_loss);
+            update(g, net, &p->buffers[g->nets[k]], batch,
+                   p->eta[g->nets[k]]);
+        }
+        update_first_layer(g, n_in, batch, input);
+    }
+    store(p, g);
+    for (k = 0; k < g->n_nets; k++) {
+        net = p->nets[g->nets[k]];
+        p->loss[g->nets[k]] = train_loss_mean(&net->epoch_loss);
+    }
+    TRACE_END();
+}
+
+/* population_SGD: train all the networks of the population for the given
+ * number of epochs, with minibatches of batch_size samples of the
+ * training set, shuffled once per epoch for all of them. If fun is given,
+ * it is called at the end of every epoch for each network */
+void population_SGD(struct population *p, int train_size, int batch_size,
+                    int epochs, float *input, float *output,
+                    void fun(struct network *, int))
+{
+    int n_in = n_neurons(p->nets[0], 0);
+    int n_out = n_neurons(p->nets[0], p->nets[0]->n_layers-1);
+    int epoch, k;
+
+    if (batch_size < 1 || batch_size > train_size)
+        return;
+    grow(p, batch_size);
+    p->batch = batch_size;
+    p->n_batches = train_size / batch_size;
+    p->input = input;
+    p->output = output;
+    for (epoch = 0; epoch < epochs; epoch++) {
+        TRACE_BEGIN("epoch", epoch);
+        TRACE_BEGIN("shuffle", -1);
+        shuffle(train_size, n_in, (float (*)[n_in])input, n_out,
+                (float (*)[n_out])output);
+        TRACE_END();
+        pool_run(p->pool, p->n_groups, run_group, p);
+        if (fun)
+            for (k = 0; k < p->n_nets; k++) {
+                TRACE_BEGIN("eval", epoch);
+                fun(p->nets[k], epoch);
+                TRACE_END();
+            }
+        TRACE_END();
+    }
+}
+
+/* population_loss_print: the topology, learning rate and mean cost in the
+ * last epoch of every network, from the lowest cost up */
+void population_loss_print(FILE *fp, struct population *p)
+{
+    int *order = malloc(p->n_nets * sizeof(int));
+    int i, j, k, l;
+    struct network *net;
+
+    for (i = 0; i < p->n_nets; i++) {
+        for (j = i; j > 0 && p->loss[order[j-1]] > p->loss[i]; j--)
+            order[j] = order[j-1];
+        order[j] = i;
+    }
+    for (i = 0; i < p->n_nets; i++) {
+        k = order[i];
+        net = p->nets[k];
+        fprintf(fp, "net %3d  ", k);
+        for (l = 0; l < net->n_layers; l++)
+            fprintf(fp, "%s%d", l ? "-" : "", n_neurons(net, l));
+        fprintf(fp, "  eta %g  loss %.6f\n", p->eta[k], p->loss[k]);
+    }
+    free(order);
+}
@@ -0,0 +1,80 @@
+#ifndef __POPULATION__
+#define __POPULATION__
+
+#include <stdio.h>
+#include "neuron.h"
+#include "pool.h"
+
+/* Training of many networks at once on the same data, as in a sweep of
+ * hidden sizes, learning rates or seeds.
+ *
+ * population_SGD shuffles the training set once per epoch and feeds every
+ * minibatch to all the networks, each with its own learning rate. The
+ * networks are spread in groups among the threads of a pool, balanced by
+ * their number of weights, and every group runs a whole epoch as one task.
+ *
+ * All the networks take the same input, so the first layers of a group
+ * make a single wider matrix, [n_in][sum of their first layers]: one pass
+ * over the minibatch computes them all, and one more their gradients. The
+ * population keeps that matrix while training, loading it from the
+ * networks at the start of each epoch and storing it back at the end, so
+ * the networks are up to date whenever the callback of the epoch is run.
+ * The deeper layers are computed for the whole minibatch at once with
+ * feedforward_layer.
+ *
+ * The updates are those of network_update_minibatch on the same samples:
+ * frozen layers are left as they are, and each network is backpropagated
+ * down to its lowest trainable layer only (see network_set_trainable).
+ * The stats and the communicator of the networks are not used.
+ */
+
+struct population_group {
+    int n_nets;
+    int *nets;          /* indices in the population */
+    int *column;        /* where the first layer of each starts */
+    int n_cols;         /* the first layers of all of them */
+    int *runs;          /* [start, end) of the trainable columns, in pairs */
+    int n_runs;
+    float *weights;     /* [n_in][n_cols] */
+    float *biases;      /* [n_cols] */
+    float *rate;        /* [n_cols], eta / batch_size of the network */
+    float *sums;        /* [batch][n_cols], and then their deltas */
+    float *row;         /* gradient of a row of weights */
+};
+
+/* Training buffers of a network, [batch][neurons] for each layer */
+struct population_buffers {
+    float **sums;
+    float **activs;
+    float **deltas;
+};
+
+struct population {
+    int n_nets;
+    struct network **nets;
+    float *eta;
+    double *loss;       /* mean cost of each network in the last epoch */
+    struct pool *pool;
+    int n_groups;
+    struct population_group *groups;
+    struct population_buffers *buffers;
+    int batch_size;     /* room in the buffers */
+    /* the epoch run by the groups */
+    int batch;
+    int n_batches;
+    float *input;
+    float *output;
+};
+
+struct population *population_create(int n_nets, struct network **nets,
+                                     float *eta, int n_threads);
+
+void population_destroy(struct population *p);
+
+void population_SGD(struct population *p, int train_size, int batch_size,
+                    int epochs, float *input, float *output,
+                    void fun(struct network *, int));
+
+void population_loss_print(FILE *fp, struct population *p);
+
+#endif
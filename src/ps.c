@@ -0,0 +1,474 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "ps.h"
+#include "neuron.h"
+#include "trace.h"
+#include "io.h"
+
+#define CONNECT_MS 10000    /* how long workers wait for the server */
+
+struct server {
+    struct network *net;
+    pthread_mutex_t lock;
+    uint32_t version;
+    int bound;
+    struct ps_stats *stats;
+};
+
+struct connection {
+    struct server *server;
+    int fd;
+};
+
+static long n_blocks(long n)
+{
+    return (n + PS_BLOCK - 1) / PS_BLOCK;
+}
+
+/* payload_size: bytes following the header of a push, or -1 if it is not
+ * valid */
+static long payload_size(struct ps_header *h, long n_params)
+{
+    switch (h->encoding) {
+    case PS_DENSE:
+        return n_params * sizeof(float);
+    case PS_SPARSE:
+        if (h->n > n_params)
+            return -1;
+        return h->n * sizeof(struct ps_entry);
+    case PS_Q8:
+        return n_blocks(n_params) * sizeof(float) + n_params;
+    }
+    return -1;
+}
+
+/* apply: add the payload of a push to params */
+static void apply(float *params, long n, struct ps_header *h, void *payload)
+{
+    float *dense = payload, *scales = payload;
+    struct ps_entry *entries = payload;
+    int8_t *q = (int8_t *)(scales + n_blocks(n));
+    long i;
+
+    switch (h->encoding) {
+    case PS_DENSE:
+        for (i = 0; i < n; i++)
+            params[i] += dense[i];
+        break;
+    case PS_SPARSE:
+        for (i = 0; i < h->n; i++)
+            if (entries[i].index < n)
+                params[entries[i].index] += entries[i].value;
+        break;
+    case PS_Q8:
+        for (i = 0; i < n; i++)
+            params[i] += scales[i / PS_BLOCK] * q[i];
+        break;
+    }
+}
+
+static void *serve_connection(void *arg)
+{
+    struct connection *c = arg;
+    struct server *s = c->server;
+    struct ps_stats *stats = s->stats;
+    long n = s->net->n_params, size;
+    struct ps_hello hello = { PS_MAGIC, n, 0, s->bound };
+    struct ps_header h;
+    void *buf = malloc(n * sizeof(struct ps_entry)
+                       + n_blocks(n) * sizeof(float));
+    uint32_t stale;
+
+    pthread_mutex_lock(&s->lock);
+    hello.version = s->version;
+    pthread_mutex_unlock(&s->lock);
+    if (io_write_all(c->fd, &hello, sizeof(hello)) < 0)
+        goto out;
+    while (io_read_all(c->fd, &h, sizeof(h)) == 0) {
+        if (h.type == PS_PULL) {
+            /* copied under the lock, but sent without it */
+            pthread_mutex_lock(&s->lock);
+            memcpy(buf, s->net->params, n * sizeof(float));
+            h.version = s->version;
+            stats->pulls++;
+            stats->pull_bytes += sizeof(h) + n * sizeof(float);
+            pthread_mutex_unlock(&s->lock);
+            h.type = PS_OK;
+            if (io_write_all(c->fd, &h, sizeof(h)) < 0
+                    || io_write_all(c->fd, buf, n * sizeof(float)) < 0)
+                break;
+            continue;
+        }
+        if (h.type != PS_PUSH || (size = payload_size(&h, n)) < 0) {
+            /* we cannot resynchronize with the worker, so drop it */
+            h.type = PS_ERROR;
+            io_write_all(c->fd, &h, sizeof(h));
+            break;
+        }
+        if (io_read_all(c->fd, buf, size) < 0)
+            break;
+        pthread_mutex_lock(&s->lock);
+        stale = s->version - h.version;
+        stats->pushes++;
+        stats->push_bytes += sizeof(h) + size;
+        if (stale > (uint32_t)s->bound) {
+            stats->stale++;
+            h.type = PS_STALE;
+        } else {
+            TRACE_BEGIN("apply", h.encoding);
+            apply(s->net->params, n, &h, buf);
+            TRACE_END();
+            s->version++;
+            stats->staleness[stale < PS_HIST ? stale : PS_HIST - 1]++;
+            h.type = PS_OK;
+        }
+        h.version = s->version;
+        pthread_mutex_unlock(&s->lock);
+        if (io_write_all(c->fd, &h, sizeof(h)) < 0)
+            break;
+    }
+out:
+    free(buf);
+    close(c->fd);
+    return NULL;
+}
+
+/* ps_serve: serve the parameters of net on the unix socket at path to
+ * n_workers workers, dropping pushes staler than "staleness", and return
+ * once all of them have disconnected. net ends up with the parameters
+ * trained, and stats, if not NULL, with the traffic. Returns 0, or -1 on
+ * error */
+int ps_serve(struct network *net, const char *path, int staleness,
+             int n_workers, struct ps_stats *stats)
+{
+    struct server s;
+    struct ps_stats own;
+    struct sockaddr_un addr;
+    struct connection conns[n_workers];
+    pthread_t threads[n_workers];
+    double start;
+    int sock, i;
+
+    s.net = net;
+    s.version = 0;
+    s.bound = staleness;
+    s.stats = stats ? stats : &own;
+    memset(s.stats, 0, sizeof(struct ps_stats));
+    pthread_mutex_init(&s.lock, NULL);
+
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    unlink(path);
+    if (sock < 0 || bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0
+            || listen(sock, n_workers) < 0) {
+        perror(path);
+        if (sock >= 0)
+            close(sock);
+        return -1;
+    }
+    start = io_now();
+    for (i = 0; i < n_workers; i++) {
+        conns[i].server = &s;
+        while ((conns[i].fd = accept(sock, NULL, NULL)) < 0 && errno == EINTR)
+            ;
+        if (conns[i].fd < 0) {
+            perror("ps_serve: accept");
+            break;
+        }
+        pthread_create(&threads[i], NULL, serve_connection, &conns[i]);
+    }
+    close(sock);
+    unlink(path);
+    n_workers = i;
+    for (i = 0; i < n_workers; i++)
+        pthread_join(threads[i], NULL);
+    s.stats->pull_time = s.stats->push_time = io_now() - start;
+    pthread_mutex_destroy(&s.lock);
+    return 0;
+}
+
+/* ps_connect: connect a worker training net to the server at path, which
+ * must serve a network of the same size. density is the part of each
+ * update sent with PS_SPARSE. Returns NULL on error */
+struct ps_worker *ps_connect(const char *path, struct network *net,
+                             int encoding, float density)
+{
+    struct ps_worker *w;
+    struct sockaddr_un addr;
+    struct ps_hello hello;
+    struct timespec ms = { 0, 1000000 };
+    long n = net->n_params;
+    int fd, i;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    /* the server may not be listening yet */
+    for (i = 0; ; i++) {
+        if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+            perror("ps_connect: socket");
+            return NULL;
+        }
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+            break;
+        close(fd);
+        if ((errno != ENOENT && errno != ECONNREFUSED) || i == CONNECT_MS) {
+            perror(path);
+            return NULL;
+        }
+        nanosleep(&ms, NULL);
+    }
+    if (io_read_all(fd, &hello, sizeof(hello)) < 0 || hello.magic != PS_MAGIC
+            || hello.n_params != n) {
+        fprintf(stderr, "ps_connect: %s does not serve a network of %ld " \
+                "parameters\n", path, n);
+        close(fd);
+        return NULL;
+    }
+    w = malloc(sizeof(struct ps_worker));
+    memset(w, 0, sizeof(struct ps_worker));
+    w->fd = fd;
+    w->net = net;
+    w->encoding = encoding;
+    w->density = density;
+    w->bound = hello.staleness;
+    w->base = w->seen = hello.version;
+    w->residual = calloc(n, sizeof(float));
+    w->before = malloc(n * sizeof(float));
+    w->buf = malloc(n * sizeof(struct ps_entry) + n_blocks(n) * sizeof(float));
+    if (encoding == PS_SPARSE)
+        w->select = malloc(n * sizeof(float));
+    return w;
+}
+
+void ps_disconnect(struct ps_worker *w)
+{
+    if (!w)
+        return;
+    close(w->fd);
+    free(w->residual);
+    free(w->before);
+    free(w->buf);
+    free(w->select);
+    free(w);
+}
+
+/* ps_pull: replace the parameters of the network of the worker by those of
+ * the server */
+int ps_pull(struct ps_worker *w)
+{
+    struct ps_header h = { PS_PULL, 0, 0, 0 };
+    long n = w->net->n_params;
+    double start = io_now();
+
+    TRACE_BEGIN("pull", -1);
+    if (io_write_all(w->fd, &h, sizeof(h)) < 0
+            || io_read_all(w->fd, &h, sizeof(h)) < 0 || h.type != PS_OK
+            || io_read_all(w->fd, w->net->params, n * sizeof(float)) < 0) {
+        TRACE_END();
+        fprintf(stderr, "ps_pull: lost the server\n");
+        return -1;
+    }
+    TRACE_END();
+    w->base = w->seen = h.version;
+    w->stats.pulls++;
+    w->stats.pull_bytes += 2 * sizeof(h) + n * sizeof(float);
+    w->stats.pull_time += io_now() - start;
+    return 0;
+}
+
+/* kth_largest: the k-th largest of the n values of v, which are shuffled
+ * (Hoare's selection) */
+static float kth_largest(float *v, long n, long k)
+{
+    long lo = 0, hi = n - 1, i, j;
+    float pivot, t;
+
+    while (lo < hi) {
+        pivot = v[lo + (hi - lo) / 2];
+        for (i = lo, j = hi; i <= j; ) {
+            while (v[i] > pivot)
+                i++;
+            while (v[j] < pivot)
+                j--;
+            if (i <= j) {
+                t = v[i]; v[i] = v[j]; v[j] = t;
+                i++;
+                j--;
+            }
+        }
+        if (k - 1 <= j)
+            hi = j;
+        else if (k - 1 >= i)
+            lo = i;
+        else
+            break;
+    }
+    return v[k - 1];
+}
+
+/* encode: fill the payload of a push from the residual, moving what is
+ * sent from the residual to the parameters, just as the server will.
+ * Returns the size of the payload */
+static long encode(struct ps_worker *w, struct ps_header *h)
+{
+    long n = w->net->n_params, i, b, k, end;
+    float *r = w->residual, *params = w->net->params;
+    float *scales = w->buf, threshold, max, scale;
+    struct ps_entry *entries = w->buf;
+    int8_t *q = (int8_t *)(scales + n_blocks(n));
+
+    h->n = 0;
+    switch (w->encoding) {
+    case PS_SPARSE:
+        k = w->density * n;
+        k = k < 1 ? 1 : k > n ? n : k;
+        for (i = 0; i < n; i++)
+            w->select[i] = fabsf(r[i]);
+        threshold = kth_largest(w->select, n, k);
+        /* the ones above the threshold first, and then ties with it */
+        for (b = 0; b < 2; b++)
+            for (i = 0; i < n && h->n < k; i++)
+                if (b ? fabsf(r[i]) == threshold && r[i] != 0
+                      : fabsf(r[i]) > threshold) {
+                    entries[h->n].index = i;
+                    entries[h->n++].value = r[i];
+                    params[i] += r[i];
+                    r[i] = 0;
+                }
+        return h->n * sizeof(struct ps_entry);
+    case PS_Q8:
+        for (b = 0; b < n_blocks(n); b++) {
+            end = (b + 1) * PS_BLOCK < n ? (b + 1) * PS_BLOCK : n;
+            for (max = 0, i = b * PS_BLOCK; i < end; i++)
+                if (fabsf(r[i]) > max)
+                    max = fabsf(r[i]);
+            scales[b] = scale = max / 127;
+            for (i = b * PS_BLOCK; i < end; i++) {
+                q[i] = scale > 0 ? lrintf(r[i] / scale) : 0;
+                params[i] += scale * q[i];
+                r[i] -= scale * q[i];
+            }
+        }
+        return n_blocks(n) * sizeof(float) + n;
+    default:
+        memcpy(w->buf, r, n * sizeof(float));
+        for (i = 0; i < n; i++)
+            params[i] += r[i];
+        memset(r, 0, n * sizeof(float));
+        return n * sizeof(float);
+    }
+}
+
+/* ps_push: send update, which the worker has not applied to its network.
+ * The part of it that is sent is applied, and the rest kept for the next
+ * push. Returns 0 if the server accepted it, 1 if it was too stale, in
+ * which case it is dropped and the worker pulls again, and -1 on error */
+int ps_push(struct ps_worker *w, float *update)
+{
+    struct ps_header h = { PS_PUSH, w->encoding, w->base, 0 };
+    long n = w->net->n_params, size, i;
+    double start = io_now();
+
+    for (i = 0; i < n; i++)
+        w->residual[i] += update[i];
+    size = encode(w, &h);
+    TRACE_BEGIN("push", w->encoding);
+    if (io_write_all(w->fd, &h, sizeof(h)) < 0
+            || io_write_all(w->fd, w->buf, size) < 0
+            || io_read_all(w->fd, &h, sizeof(h)) < 0 || h.type == PS_ERROR) {
+        TRACE_END();
+        fprintf(stderr, "ps_push: lost the server\n");
+        return -1;
+    }
+    TRACE_END();
+    w->stats.pushes++;
+    w->stats.push_bytes += 2 * sizeof(h) + size;
+    w->stats.push_time += io_now() - start;
+    w->seen = h.version;
+    if (h.type == PS_STALE) {
+        w->stats.stale++;
+        memset(w->residual, 0, n * sizeof(float));
+        return ps_pull(w) < 0 ? -1 : 1;
+    }
+    /* the push was applied on version h.version - 1 */
+    i = h.version - 1 - w->base;
+    w->stats.staleness[i < PS_HIST ? i : PS_HIST - 1]++;
+    /* counted in the base, so that staleness only counts the updates of
+     * the other workers */
+    w->base++;
+    return 0;
+}
+
+/* ps_SGD: train the network of the worker like network_SGD, but pushing
+ * the update of every minibatch to the server. The worker pulls when it
+ * falls behind the server by more than half the staleness bound, which
+ * leaves the other half for the updates pushed while it trains. Returns 0,
+ * or -1 if the server is lost */
+int ps_SGD(struct ps_worker *w, int train_size, int batch_size, int epochs,
+           float train_input[train_size][w->net->layers[0]->n_neurons],
+           float train_output[train_size][w->net->layers[
+                                       w->net->n_layers-1]->n_neurons],
+           float eta)
+{
+    struct network *net = w->net;
+    int n_in = net->layers[0]->n_neurons;
+    int n_out = net->layers[net->n_layers-1]->n_neurons;
+    float *params = net->params, *before = w->before, d;
+    long i;
+    int epoch, batch;
+
+    if (ps_pull(w) < 0)
+        return -1;
+    for (epoch = 0; epoch < epochs; epoch++) {
+        train_loss_reset(&net->epoch_loss);
+        shuffle(train_size, n_in, train_input, n_out, train_output);
+        for (batch = 0; batch < train_size / batch_size; batch++) {
+            if ((int)(w->seen - w->base) > w->bound / 2 && ps_pull(w) < 0)
+                return -1;
+            memcpy(before, params, net->n_params * sizeof(float));
+            network_update_minibatch(net, batch_size, train_input,
+                                     train_output, eta, batch * batch_size);
+            /* the update goes back to before, and the network to where
+             * it was, to get what is sent of it */
+            for (i = 0; i < net->n_params; i++) {
+                d = params[i] - before[i];
+                params[i] = before[i];
+                before[i] = d;
+            }
+            if (ps_push(w, before) < 0)
+                return -1;
+        }
+    }
+    return 0;
+}
+
+void ps_stats_print(FILE *fp, struct ps_stats *stats)
+{
+    int i;
+
+    fprintf(fp, "%ld pulls, %.2f MB, %.1f MB/s; %ld pushes, %.2f MB, " \
+            "%.1f MB/s, %ld stale\n", stats->pulls, stats->pull_bytes / 1e6,
+            stats->pull_time > 0 ? stats->pull_bytes / 1e6
+                                   / stats->pull_time : 0,
+            stats->pushes, stats->push_bytes / 1e6,
+            stats->push_time > 0 ? stats->push_bytes / 1e6
+                                   / stats->push_time : 0,
+            stats->stale);
+    fprintf(fp, "staleness:");
+    for (i = 0; i < PS_HIST; i++)
+        if (stats->staleness[i])
+            fprintf(fp, " %d%s: %ld", i, i == PS_HIST - 1 ? "+" : "",
+                    stats->staleness[i]);
+    fprintf(fp, "\n");
+}
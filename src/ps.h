@@ -0,0 +1,124 @@
+#ifndef __PS__
+#define __PS__
+
+#include <stdio.h>
+#include <stdint.h>
+#include "neuron.h"
+
+/* Asynchronous training with a parameter server.
+ *
+ * The server (ps_serve) holds the weights and biases of a network, and
+ * serves workers over a unix domain socket. Each worker (ps_connect,
+ * ps_SGD) trains a copy of the network on its own samples at its own pace:
+ * it pulls the parameters from the server, trains on a minibatch, and
+ * pushes the update it made, which the server adds to its parameters.
+ * Every update accepted bumps the version of the server.
+ *
+ * Updates can be pushed whole (PS_DENSE), as the largest "density" part of
+ * them (PS_SPARSE, index and value pairs), or quantized to 8 bits with a
+ * scale for every PS_BLOCK values (PS_Q8). Whatever is not sent is kept by
+ * the worker and added to its next update, so it is delayed but not lost.
+ *
+ * An update is stale by the number of updates of other workers accepted
+ * since the version it was made from. The server drops updates staler than
+ * its bound, and workers pull again as soon as they fall that far behind.
+ *
+ * Protocol, in host byte order since both ends are on the same machine:
+ *
+ *   server -> worker, on connect:   struct ps_hello
+ *   worker -> server:               struct ps_header, and for a push its
+ *                                   payload
+ *   server -> worker:               struct ps_header, and for a pull the
+ *                                   n_params floats
+ */
+
+#define PS_MAGIC 0x4e455053 /* "NEPS" */
+
+/* requests */
+#define PS_PULL 1
+#define PS_PUSH 2
+
+/* statuses of the replies */
+#define PS_OK 0
+#define PS_STALE 1
+#define PS_ERROR 2
+
+/* encodings of a push: the payload is n_params floats, n struct
+ * ps_entry, or the scales of the blocks followed by n_params int8_t */
+#define PS_DENSE 0
+#define PS_SPARSE 1
+#define PS_Q8 2
+
+#define PS_BLOCK 256
+#define PS_HIST 16          /* buckets of staleness, the last one open */
+
+struct ps_hello {
+    uint32_t magic;
+    uint32_t n_params;
+    uint32_t version;
+    uint32_t staleness;     /* bound */
+};
+
+struct ps_header {
+    uint32_t type;          /* a request, or the status of a reply */
+    uint32_t encoding;
+    uint32_t version;       /* the push was made from; of the server in
+                               replies */
+    uint32_t n;             /* entries of a sparse push */
+};
+
+struct ps_entry {
+    uint32_t index;
+    float value;
+};
+
+/* Traffic of a server or a worker. The time of a worker is that spent in
+ * its pulls and pushes, and that of the server the time it has served */
+struct ps_stats {
+    long pulls;
+    long pushes;
+    long stale;             /* pushes dropped */
+    double pull_bytes;
+    double push_bytes;
+    double pull_time;       /* seconds */
+    double push_time;
+    long staleness[PS_HIST];    /* of the pushes accepted */
+};
+
+struct ps_worker {
+    int fd;
+    struct network *net;
+    int encoding;
+    float density;
+    int bound;
+    uint32_t base;          /* version net->params come from, not counting
+                               the pushes of this worker */
+    uint32_t seen;          /* latest version of the server seen */
+    float *residual;        /* what is yet to be sent */
+    float *before;
+    void *buf;              /* for the payload of a push */
+    float *select;          /* scratch for choosing the sparse entries */
+    struct ps_stats stats;
+};
+
+int ps_serve(struct network *net, const char *path, int staleness,
+             int n_workers, struct ps_stats *stats);
+
+struct ps_worker *ps_connect(const char *path, struct network *net,
+                             int encoding, float density);
+
+void ps_disconnect(struct ps_worker *w);
+
+int ps_pull(struct ps_worker *w);
+
+int ps_push(struct ps_worker *w, float *update);
+
+int ps_SGD(struct ps_worker *w, int train_size, int batch_size, int epochs,
+           float train_input[train_size][w->net->layers[0]->n_neurons],
+           float train_output[train_size][w->net->layers[
+                                       w->net->n_layers-1]->n_neurons],
+           float eta);
+
+void ps_stats_print(FILE *fp, struct ps_stats *stats);
+
+#endif
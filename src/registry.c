@@ -0,0 +1,292 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "registry.h"
+#include "model.h"
+#include "io.h"
+
+/* Smallest number of samples worth handing to a thread */
+#define MIN_CHUNK 8
+
+/* hash: FNV-1a hash of a string */
+static unsigned int hash(char *s)
+{
+    unsigned int h = 2166136261u;
+    while (*s)
+        h = (h ^ (unsigned char)*s++) * 16777619u;
+    return h;
+}
+
+/* registry_create: create a registry for up to capacity networks, which
+ * will run on the given pool */
+struct registry *registry_create(int capacity, struct pool *pool)
+{
+    struct registry *reg = malloc(sizeof(struct registry));
+    int i;
+
+    /* keep the table at most half full, so that probes stay short */
+    for (reg->capacity = 1; reg->capacity < 2 * capacity; reg->capacity *= 2)
+        ;
+    reg->entries = malloc(reg->capacity * sizeof(*reg->entries));
+    for (i = 0; i < reg->capacity; i++)
+        atomic_init(&reg->entries[i], NULL);
+    reg->n_entries = 0;
+    reg->weights = NULL;
+    reg->pool = pool;
+    reg->last_report = io_now();
+    pthread_mutex_init(&reg->lock, NULL);
+    return reg;
+}
+
+/* registry_destroy: free the registry and all its networks. The pool is
+ * not destroyed */
+void registry_destroy(struct registry *reg)
+{
+    struct registry_entry *entry;
+    struct registry_weights *w, *next;
+    int i;
+
+    for (i = 0; i < reg->capacity; i++) {
+        if ((entry = atomic_load(&reg->entries[i]))) {
+            free(entry->name);
+            free(entry);
+        }
+    }
+    for (w = reg->weights; w; w = next) {
+        next = w->next;
+        destroy_network(w->net);
+        free(w);
+    }
+    pthread_mutex_destroy(&reg->lock);
+    free(reg->entries);
+    free(reg);
+}
+
+/* same_contents: whether the contents of a file, of len bytes, are those
+ * network_save_to_file would write for net */
+static int same_contents(struct network *net, char *map, size_t len)
+{
+    int *n_neurons = (int *)map;
+    float *values;
+    int l, n1, n2;
+
+    if (len < (net->n_layers + 1) * sizeof(int)
+            || n_neurons[0] != net->n_layers)
+        return 0;
+    for (l = 0; l < net->n_layers; l++)
+        if (n_neurons[l+1] != net->layers[l]->n_neurons)
+            return 0;
+    /* the length is that of the network, since the CRC-32s matched one */
+    values = (float *)(n_neurons + net->n_layers + 1);
+    for (l = 1; l < net->n_layers; l++) {
+        for (n2 = 0; n2 < net->layers[l]->n_neurons; n2++) {
+            for (n1 = 0; n1 < net->layers[l-1]->n_neurons; n1++)
+                if (memcmp(&net->weights[l][n1][n2], values++,
+                           sizeof(float)))
+                    return 0;
+            if (memcmp(&net->biases[l][n2], values++, sizeof(float)))
+                return 0;
+        }
+    }
+    return 1;
+}
+
+/* load_weights: map a file and find a network already loaded from a file
+ * with the same contents, or create a new one. The file is unmapped before
+ * returning. Called with the lock held */
+static struct registry_weights *load_weights(struct registry *reg,
+                                             char *filename)
+{
+    struct registry_weights *w;
+    struct stat st;
+    unsigned int crc;
+    char *map;
+    int fd = open(filename, O_RDONLY);
+
+    if (fd < 0 || fstat(fd, &st) < 0 || st.st_size == 0) {
+        fprintf(stderr, "Could not open file %s\n", filename);
+        if (fd >= 0)
+            close(fd);
+        return NULL;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Could not map file %s\n", filename);
+        return NULL;
+    }
+    crc = model_crc32(0, map, st.st_size);
+    for (w = reg->weights; w; w = w->next) {
+        if (w->crc == crc && w->len == st.st_size
+                && same_contents(w->net, map, st.st_size)) {
+            munmap(map, st.st_size);
+            w->refs++;
+            return w;
+        }
+    }
+    w = malloc(sizeof(struct registry_weights));
+    w->net = network_create_from_memory(map, st.st_size);
+    munmap(map, st.st_size);
+    if (!w->net) {
+        free(w);
+        return NULL;
+    }
+    w->len = st.st_size;
+    w->crc = crc;
+    w->refs = 1;
+    w->next = reg->weights;
+    reg->weights = w;
+    return w;
+}
+
+/* registry_add: load the network in filename under the given name. Returns
+ * -1 if the name is already taken, the registry is full or the file cannot
+ * be loaded */
+int registry_add(struct registry *reg, char *name, char *filename)
+{
+    struct registry_entry *entry;
+    unsigned int i;
+    int status = -1;
+
+    pthread_mutex_lock(&reg->lock);
+    if (registry_lookup(reg, name)) {
+        fprintf(stderr, "registry_add: %s already exists\n", name);
+        goto out;
+    }
+    if (2 * (reg->n_entries + 1) > reg->capacity) {
+        fprintf(stderr, "registry_add: registry is full\n");
+        goto out;
+    }
+    entry = malloc(sizeof(struct registry_entry));
+    if (!(entry->weights = load_weights(reg, filename))) {
+        free(entry);
+        goto out;
+    }
+    entry->name = strdup(name);
+    atomic_init(&entry->requests, 0);
+    atomic_init(&entry->samples, 0);
+    entry->last_requests = entry->last_samples = 0;
+    for (i = hash(name); atomic_load(&reg->entries[i & (reg->capacity-1)]);
+            i++)
+        ;
+    /* the entry is complete before readers can find it */
+    atomic_store(&reg->entries[i & (reg->capacity-1)], entry);
+    reg->n_entries++;
+    status = 0;
+out:
+    pthread_mutex_unlock(&reg->lock);
+    return status;
+}
+
+/* registry_lookup: find an entry by name, or return NULL. Lock-free */
+struct registry_entry *registry_lookup(struct registry *reg, char *name)
+{
+    struct registry_entry *entry;
+    unsigned int i;
+
+    for (i = hash(name); (entry = atomic_load(
+                &reg->entries[i & (reg->capacity-1)])); i++)
+        if (strcmp(entry->name, name) == 0)
+            return entry;
+    return NULL;
+}
+
+struct infer_job {
+    struct network *net;
+    struct pool *pool;
+    int n, chunk;
+    float *input, *output;
+};
+
+static void infer_task(void *arg, int task, int thread)
+{
+    struct infer_job *job = arg;
+    struct network *net = job->net;
+    int n_in = net->layers[0]->n_neurons;
+    int n_out = net->layers[net->n_layers-1]->n_neurons;
+    int start = task * job->chunk;
+    int n = (start + job->chunk < job->n) ? job->chunk : job->n - start;
+    float *scratch = pool_scratch(job->pool, thread,
+                                  2 * n * network_max_neurons(net));
+
+    feedforward_batch(net, n, (float (*)[n_in])(job->input + start * n_in),
+                      (float (*)[n_out])(job->output + start * n_out),
+                      scratch);
+}
+
+/* registry_infer: run n inputs (stored one after the other in "input")
+ * through the network called name, spreading them among the threads of the
+ * pool, and save the outputs in "output". Returns -1 if there is no such
+ * network */
+int registry_infer(struct registry *reg, char *name, int n,
+                   float *input, float *output)
+{
+    struct registry_entry *entry = registry_lookup(reg, name);
+    struct infer_job job;
+    int n_tasks;
+
+    if (!entry)
+        return -1;
+    atomic_fetch_add_explicit(&entry->requests, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&entry->samples, n, memory_order_relaxed);
+    if (n <= 0)
+        return 0;
+    n_tasks = (n + MIN_CHUNK - 1) / MIN_CHUNK;
+    if (n_tasks > reg->pool->n_threads)
+        n_tasks = reg->pool->n_threads;
+    job.net = entry->weights->net;
+    job.pool = reg->pool;
+    job.n = n;
+    job.chunk = (n + n_tasks - 1) / n_tasks;
+    job.input = input;
+    job.output = output;
+    pool_run(reg->pool, (n + job.chunk - 1) / job.chunk, infer_task, &job);
+    return 0;
+}
+
+/* registry_entry_bytes: memory used by the network of an entry. When the
+ * network is shared by several entries, each one is charged its part */
+size_t registry_entry_bytes(struct registry_entry *entry)
+{
+    struct network_memory mem;
+    network_memory_stats(entry->weights->net, &mem);
+    return mem.total / entry->weights->refs;
+}
+
+/* registry_report: print, for each network, its memory use and the number
+ * of requests and samples per second since the previous report */
+void registry_report(struct registry *reg, FILE *fp)
+{
+    struct registry_entry *entry;
+    unsigned long requests, samples;
+    double t, elapsed;
+    size_t total = 0;
+    int i;
+
+    pthread_mutex_lock(&reg->lock);
+    t = io_now();
+    elapsed = t - reg->last_report;
+    reg->last_report = t;
+    fprintf(fp, "%-24s %12s %6s %12s %12s\n", "model", "bytes", "shared",
+            "requests/s", "samples/s");
+    for (i = 0; i < reg->capacity; i++) {
+        if (!(entry = atomic_load(&reg->entries[i])))
+            continue;
+        requests = atomic_load(&entry->requests);
+        samples = atomic_load(&entry->samples);
+        fprintf(fp, "%-24s %12zu %6d %12.1f %12.1f\n", entry->name,
+                registry_entry_bytes(entry), entry->weights->refs,
+                (requests - entry->last_requests) / elapsed,
+                (samples - entry->last_samples) / elapsed);
+        entry->last_requests = requests;
+        entry->last_samples = samples;
+        total += registry_entry_bytes(entry);
+    }
+    fprintf(fp, "%d models, %zu bytes\n", reg->n_entries, total);
+    pthread_mutex_unlock(&reg->lock);
+}
@@ -0,0 +1,63 @@
+#ifndef __REGISTRY__
+#define __REGISTRY__
+
+#include <stdio.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "neuron.h"
+#include "pool.h"
+
+/* A registry of many networks, looked up by name, which share one thread
+ * pool (and its per-thread scratch space) for inference.
+ *
+ * Networks loaded from files with identical contents are loaded only once
+ * and shared by all the names that refer to them. A file is mapped only
+ * while it is loaded: it matches a network already loaded when the CRC-32
+ * and length are the same and its contents, read again, are those of the
+ * network. Entries are never
+ * removed or replaced until the registry is destroyed, which is what lets
+ * registry_lookup go without locks.
+ */
+
+struct registry_weights {
+    struct network *net;
+    size_t len;         /* of the file */
+    unsigned int crc;
+    int refs;           /* entries using these weights */
+    struct registry_weights *next;
+};
+
+struct registry_entry {
+    char *name;
+    struct registry_weights *weights;
+    atomic_ulong requests;
+    atomic_ulong samples;
+    unsigned long last_requests, last_samples;  /* for registry_report */
+};
+
+struct registry {
+    int capacity;       /* a power of two */
+    _Atomic(struct registry_entry *) *entries;
+    struct registry_weights *weights;
+    struct pool *pool;
+    int n_entries;
+    pthread_mutex_t lock;   /* serializes additions and reports */
+    double last_report;
+};
+
+struct registry *registry_create(int capacity, struct pool *pool);
+
+void registry_destroy(struct registry *reg);
+
+int registry_add(struct registry *reg, char *name, char *filename);
+
+struct registry_entry *registry_lookup(struct registry *reg, char *name);
+
+int registry_infer(struct registry *reg, char *name, int n,
+                   float *input, float *output);
+
+size_t registry_entry_bytes(struct registry_entry *entry);
+
+void registry_report(struct registry *reg, FILE *fp);
+
+#endif
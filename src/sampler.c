@@ -0,0 +1,176 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "sampler.h"
+#include "neuron.h"
+#include "trace.h"
+
+#define SAMPLER_BATCH 64    /* samples of each batch of a screening pass */
+
+static double uniform(void)
+{
+    return (double)rand() / ((double)RAND_MAX + 1);
+}
+
+/* sampler_create: a sampler of n samples, all of them with the same cost
+ * until they are trained on or screened. mix, in (0, 1], is the share of
+ * the probability spread uniformly. Returns NULL on error */
+struct sampler *sampler_create(long n, float mix)
+{
+    struct sampler *s;
+    long i;
+
+    if (n < 1 || !(mix > 0 && mix <= 1)) {
+        fprintf(stderr, "sampler_create: %ld samples, mix %g\n", n, mix);
+        return NULL;
+    }
+    s = calloc(1, sizeof(struct sampler));
+    s->n = n;
+    s->mix = mix;
+    for (s->leaves = 1; s->leaves < n; s->leaves *= 2)
+        ;
+    s->tree = calloc(2 * s->leaves, sizeof(double));
+    for (i = 0; i < n; i++)
+        s->tree[s->leaves + i] = 1;
+    for (i = s->leaves - 1; i > 0; i--)
+        s->tree[i] = s->tree[2*i] + s->tree[2*i + 1];
+    return s;
+}
+
+void sampler_destroy(struct sampler *s)
+{
+    if (!s)
+        return;
+    free(s->tree);
+    free(s->scratch);
+    free(s->outputs);
+    free(s);
+}
+
+/* sampler_set: the cost of a sample */
+void sampler_set(struct sampler *s, long sample, float cost)
+{
+    long i = s->leaves + sample;
+
+    s->tree[i] = cost > 0 ? cost : 0;
+    for (i /= 2; i > 0; i /= 2)
+        s->tree[i] = s->tree[2*i] + s->tree[2*i + 1];
+}
+
+/* sampler_draw: draw batch_size samples, and the weight of the gradient of
+ * each */
+void sampler_draw(struct sampler *s, int batch_size, int *samples,
+                  float *weights)
+{
+    double total = s->tree[1], mix = total > 0 ? s->mix : 1, v, p;
+    long i;
+    int b;
+
+    for (b = 0; b < batch_size; b++) {
+        if (uniform() < mix) {
+            i = (long)(uniform() * s->n);
+        } else {
+            v = uniform() * total;
+            for (i = 1; i < s->leaves; ) {
+                if (v < s->tree[2*i] || s->tree[2*i + 1] <= 0) {
+                    i = 2*i;
+                } else {
+                    v -= s->tree[2*i];
+                    i = 2*i + 1;
+                }
+            }
+            i -= s->leaves;
+        }
+        p = mix / s->n + (total > 0 ? (1 - mix) * s->tree[s->leaves + i]
+                                      / total : 0);
+        samples[b] = i;
+        weights[b] = 1 / (s->n * p);
+    }
+}
+
+/* sampler_screen: update the costs of the next count samples with a
+ * forward-only pass, starting where the last one stopped */
+void sampler_screen(struct sampler *s, struct network *net, long count,
+                    float *input, float *output)
+{
+    int n_in = net->layers[0]->n_neurons;
+    int n_out = net->layers[net->n_layers-1]->n_neurons;
+    long first, i;
+    int n, b;
+
+    if (!s->scratch) {
+        s->scratch = malloc(2 * SAMPLER_BATCH * network_max_neurons(net)
+                            * sizeof(float));
+        s->outputs = malloc(SAMPLER_BATCH * n_out * sizeof(float));
+    }
+    if (count > s->n)
+        count = s->n;
+    TRACE_BEGIN("screen", -1);
+    while (count > 0) {
+        first = s->screen_next;
+        n = SAMPLER_BATCH;
+        if (n > count)
+            n = count;
+        if (n > s->n - first)
+            n = s->n - first;
+        feedforward_batch(net, n, (float (*)[n_in])(input + first * n_in),
+                          (float (*)[n_out])s->outputs, s->scratch);
+        for (b = 0; b < n; b++) {
+            i = first + b;
+            sampler_set(s, i, cost_function(n_out, s->outputs + b * n_out,
+                                            output + i * n_out));
+        }
+        s->screened += n;
+        count -= n;
+        s->screen_next = (first + n) % s->n;
+    }
+    TRACE_END();
+}
+
+/* sampler_SGD: train the network for the given number of epochs, each of
+ * as many minibatches of batch_size samples as network_SGD would run on
+ * the n samples of the sampler. Before each epoch the costs of the next
+ * screen samples are updated by a screening pass. If fun is given, it is
+ * called at the end of every epoch */
+void sampler_SGD(struct sampler *s, struct network *net, int batch_size,
+                 int epochs, float *input, float *output, float eta,
+                 long screen, void fun(struct network *, int))
+{
+    int n_in = net->layers[0]->n_neurons;
+    int n_out = net->layers[net->n_layers-1]->n_neurons;
+    int *samples, epoch, b;
+    float *weights, *losses;
+    long batch, n_batches = s->n / batch_size;
+
+    if (batch_size < 1 || batch_size > s->n)
+        return;
+    samples = malloc(batch_size * sizeof(int));
+    weights = malloc(batch_size * sizeof(float));
+    losses = malloc(batch_size * sizeof(float));
+    for (epoch = 0; epoch < epochs; epoch++) {
+        TRACE_BEGIN("epoch", epoch);
+        train_loss_reset(&net->epoch_loss);
+        if (screen > 0)
+            sampler_screen(s, net, screen, input, output);
+        for (batch = 0; batch < n_batches; batch++) {
+            TRACE_BEGIN("minibatch", batch);
+            sampler_draw(s, batch_size, samples, weights);
+            network_update_sampled(net, batch_size, (float (*)[n_in])input,
+                                   (float (*)[n_out])output, samples,
+                                   weights, eta, losses);
+            /* the costs before the update, as screening would give */
+            for (b = 0; b < batch_size; b++)
+                sampler_set(s, samples[b], losses[b]);
+            s->backward += batch_size;
+            TRACE_END();
+        }
+        if (fun) {
+            TRACE_BEGIN("eval", epoch);
+            fun(net, epoch);
+            TRACE_END();
+        }
+        TRACE_END();
+    }
+    free(samples);
+    free(weights);
+    free(losses);
+}
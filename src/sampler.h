@@ -0,0 +1,57 @@
+#ifndef __SAMPLER__
+#define __SAMPLER__
+
+#include "neuron.h"
+
+/* Importance sampling of the training set, so that the backward passes go
+ * to the samples the network still gets wrong.
+ *
+ * The sampler keeps the last cost of every sample: that of the forward
+ * pass done by training whenever the sample is trained on, and that of
+ * forward-only screening passes, made in batches, over a window of the
+ * samples that moves on every epoch. Minibatches are drawn, with
+ * replacement, with probability
+ *
+ *      p_i = mix / n + (1 - mix) * cost_i / sum of the costs
+ *
+ * and the gradient of each sample is weighted by 1 / (n * p_i), so that
+ * the mean of the weighted gradients of a minibatch is still an unbiased
+ * estimate of the gradient over the whole set. mix bounds those weights
+ * by 1 / mix. The costs are kept in a sum tree, in which drawing a sample
+ * and changing its cost take O(log n).
+ *
+ * The samples of the training set are not moved, so their indices stay
+ * the same from one epoch to the next.
+ */
+
+struct sampler {
+    long n;
+    long leaves;        /* the first power of two not below n */
+    double *tree;       /* [2 * leaves]: tree[leaves + i] is the cost of
+                           sample i, and every node the sum of its two
+                           children */
+    float mix;
+    long screen_next;   /* first sample of the next screening pass */
+    float *scratch;     /* for the screening passes */
+    float *outputs;
+    long backward;      /* samples trained on */
+    long screened;      /* samples run through the screening passes */
+};
+
+struct sampler *sampler_create(long n, float mix);
+
+void sampler_destroy(struct sampler *s);
+
+void sampler_set(struct sampler *s, long sample, float cost);
+
+void sampler_draw(struct sampler *s, int batch_size, int *samples,
+                  float *weights);
+
+void sampler_screen(struct sampler *s, struct network *net, long count,
+                    float *input, float *output);
+
+void sampler_SGD(struct sampler *s, struct network *net, int batch_size,
+                 int epochs, float *input, float *output, float eta,
+                 long screen, void fun(struct network *, int));
+
+#endif
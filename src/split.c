@@ -0,0 +1,407 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "split.h"
+#include "neuron.h"
+#include "mem.h"
+#include "trace.h"
+
+#define SPLIT_BLOCK 64      /* rows of weights applied to the whole batch
+                               at once, as in feedforward_layer */
+
+enum { OP_LOAD, OP_STORE, OP_FORWARD, OP_TRAIN, OP_EXIT };
+
+struct helper_args {
+    struct split *split;
+    int thread;
+};
+
+/* slice_of: the slice of layer l computed by thread t, or NULL */
+static struct split_slice *slice_of(struct split *s, int l, int t)
+{
+    struct split_layer *layer = &s->layers[l];
+    return t < layer->n_slices ? &layer->slices[t] : NULL;
+}
+
+static int n_neurons(struct split *s, int l)
+{
+    return s->net->layers[l]->n_neurons;
+}
+
+/* load, store: copy the slices of thread t from and to the network. The
+ * copies of a thread are allocated on its first load, by itself */
+static void load(struct split *s, int t)
+{
+    struct split_slice *sl;
+    int l, n1, n_prev, flags, node;
+
+    mem_get_policy(&flags, &node);
+    for (l = 1; l < s->net->n_layers; l++) {
+        if (s->layers[l].n_slices == 1 || !(sl = slice_of(s, l, t)))
+            continue;
+        n_prev = n_neurons(s, l-1);
+        if (!sl->weights) {
+            sl->weights = mem_alloc_on((size_t)n_prev * sl->count
+                                       * sizeof(float), flags, MEM_NODE_LOCAL);
+            sl->biases = mem_alloc_on(2 * sl->count * sizeof(float), flags,
+                                      MEM_NODE_LOCAL);
+            sl->grad = sl->biases + sl->count;
+        }
+        for (n1 = 0; n1 < n_prev; n1++)
+            memcpy(sl->weights + (size_t)n1 * sl->stride,
+                   s->net->weights[l][n1] + sl->start,
+                   sl->count * sizeof(float));
+        memcpy(sl->biases, s->net->biases[l] + sl->start,
+               sl->count * sizeof(float));
+    }
+}
+
+static void store(struct split *s, int t)
+{
+    struct split_slice *sl;
+    int l, n1;
+
+    for (l = 1; l < s->net->n_layers; l++) {
+        if (s->layers[l].n_slices == 1 || !(sl = slice_of(s, l, t)))
+            continue;
+        for (n1 = 0; n1 < n_neurons(s, l-1); n1++)
+            memcpy(s->net->weights[l][n1] + sl->start,
+                   sl->weights + (size_t)n1 * sl->stride,
+                   sl->count * sizeof(float));
+        memcpy(s->net->biases[l] + sl->start, sl->biases,
+               sl->count * sizeof(float));
+    }
+}
+
+/* forward: thread t computes its columns of every layer */
+static void forward(struct split *s, int t)
+{
+    struct split_slice *sl;
+    int l, b, n1, j, block, end, n_prev, n_cur, count;
+    float *in, *sum, *w, a;
+
+    for (l = 1; l < s->net->n_layers; l++) {
+        n_prev = n_neurons(s, l-1);
+        n_cur = n_neurons(s, l);
+        if ((sl = slice_of(s, l, t))) {
+            TRACE_BEGIN("split forward", l);
+            count = sl->count;
+            for (b = 0; b < s->batch; b++)
+                memset(s->sums[l] + b*n_cur + sl->start, 0,
+                       count * sizeof(float));
+            for (block = 0; block < n_prev; block += SPLIT_BLOCK) {
+                end = block + SPLIT_BLOCK < n_prev ? block + SPLIT_BLOCK
+                                                   : n_prev;
+                for (b = 0; b < s->batch; b++) {
+                    in = s->activs[l-1] + b*n_prev;
+                    sum = s->sums[l] + b*n_cur + sl->start;
+                    for (n1 = block; n1 < end; n1++) {
+                        a = in[n1];
+                        w = sl->weights + (size_t)n1 * sl->stride;
+                        for (j = 0; j < count; j++)
+                            sum[j] += a * w[j];
+                    }
+                }
+            }
+            for (b = 0; b < s->batch; b++) {
+                sum = s->sums[l] + b*n_cur + sl->start;
+                for (j = 0; j < count; j++) {
+                    sum[j] += sl->biases[j];
+                    s->activs[l][b*n_cur + sl->start + j] =
+                        activation_function(sum[j]);
+                }
+            }
+            TRACE_END();
+        }
+        pthread_barrier_wait(&s->barrier);
+    }
+}
+
+/* backward: thread t computes the errors of the previous layer due to its
+ * columns of layer l, unless l is the lowest trainable layer, and then
+ * updates its slice if the layer is trainable. Both use the weights as
+ * they were before the minibatch. The update adds up the gradient over
+ * the batch in the same order as network_backprop */
+static void backward(struct split *s, int l, struct split_slice *sl)
+{
+    int n_prev = n_neurons(s, l-1), n_cur = n_neurons(s, l);
+    float *delta, *w, *grad = sl->grad, g, a;
+    float rate = s->eta / (float)s->batch;
+    int b, n1, j, count = sl->count;
+
+    TRACE_BEGIN("split backward", l);
+    if (l > s->lowest)
+        for (b = 0; b < s->batch; b++) {
+            delta = s->deltas[l] + b*n_cur + sl->start;
+            for (n1 = 0; n1 < n_prev; n1++) {
+                w = sl->weights + (size_t)n1 * sl->stride;
+                for (g = 0, j = 0; j < count; j++)
+                    g += w[j] * delta[j];
+                sl->partial[b*n_prev + n1] = g;
+            }
+        }
+    if (!s->net->layers[l]->trainable) {
+        TRACE_END();
+        return;
+    }
+    for (n1 = 0; n1 < n_prev; n1++) {
+        memset(grad, 0, count * sizeof(float));
+        for (b = 0; b < s->batch; b++) {
+            a = s->activs[l-1][b*n_prev + n1];
+            delta = s->deltas[l] + b*n_cur + sl->start;
+            for (j = 0; j < count; j++)
+                grad[j] += a * delta[j];
+        }
+        w = sl->weights + (size_t)n1 * sl->stride;
+        for (j = 0; j < count; j++)
+            w[j] -= rate * grad[j];
+    }
+    memset(grad, 0, count * sizeof(float));
+    for (b = 0; b < s->batch; b++)
+        for (j = 0; j < count; j++)
+            grad[j] += s->deltas[l][b*n_cur + sl->start + j];
+    for (j = 0; j < count; j++)
+        sl->biases[j] -= rate * grad[j];
+    TRACE_END();
+}
+
+/* reduce: thread t adds up the partial errors of a range of the neurons of
+ * layer l-1, from all the slices of layer l */
+static void reduce(struct split *s, int l, int t)
+{
+    struct split_layer *layer = &s->layers[l];
+    int n = n_neurons(s, l-1), b, n1, k;
+    int first = (long)n * t / s->n_threads;
+    int last = (long)n * (t + 1) / s->n_threads;
+    float sum, a;
+
+    for (b = 0; b < s->batch; b++)
+        for (n1 = first; n1 < last; n1++) {
+            for (sum = 0, k = 0; k < layer->n_slices; k++)
+                sum += layer->slices[k].partial[b*n + n1];
+            a = s->activs[l-1][b*n + n1];
+            s->deltas[l-1][b*n + n1] = sum * (a * (1 - a));
+        }
+}
+
+/* train: one step of gradient descent on the batch */
+static void train(struct split *s, int t)
+{
+    struct split_slice *sl;
+    int last = s->net->n_layers - 1, n = n_neurons(s, last), l, b, j, i;
+    float a;
+
+    forward(s, t);
+    if (s->lowest > last)
+        return;
+    /* the errors of the output layer only depend on the same columns */
+    if ((sl = slice_of(s, last, t)))
+        for (b = 0; b < s->batch; b++)
+            for (j = sl->start; j < sl->start + sl->count; j++) {
+                i = b*n + j;
+                a = s->activs[last][i];
+                s->deltas[last][i] = (a - s->output[i]) * (a * (1 - a));
+            }
+    for (l = last; l >= s->lowest; l--) {
+        if ((sl = slice_of(s, l, t)))
+            backward(s, l, sl);
+        pthread_barrier_wait(&s->barrier);
+        if (l > s->lowest) {
+            reduce(s, l, t);
+            pthread_barrier_wait(&s->barrier);
+        }
+    }
+}
+
+static void run(struct split *s, int t)
+{
+    switch (s->op) {
+    case OP_LOAD: load(s, t); break;
+    case OP_STORE: store(s, t); break;
+    case OP_FORWARD: forward(s, t); return;
+    case OP_TRAIN: train(s, t); return;
+    case OP_EXIT: return;
+    }
+    pthread_barrier_wait(&s->barrier);
+}
+
+static void *helper(void *arg)
+{
+    struct helper_args *args = arg;
+    struct split *s = args->split;
+    int t = args->thread;
+
+    free(args);
+    for (;;) {
+        pthread_barrier_wait(&s->barrier);
+        if (s->op == OP_EXIT)
+            return NULL;
+        run(s, t);
+    }
+}
+
+/* dispatch: run op in all the threads, and return when all have done */
+static void dispatch(struct split *s, int op)
+{
+    s->op = op;
+    pthread_barrier_wait(&s->barrier);
+    run(s, 0);
+}
+
+/* grow: make room in the buffers for batch_size samples */
+static void grow(struct split *s, int batch_size)
+{
+    struct split_layer *layer;
+    int l, k, n;
+
+    if (batch_size <= s->batch_size)
+        return;
+    for (l = 1; l < s->net->n_layers; l++) {
+        n = n_neurons(s, l);
+        mem_free(s->activs[l]);
+        mem_free(s->sums[l]);
+        mem_free(s->deltas[l]);
+        s->activs[l] = mem_alloc((size_t)batch_size * n * sizeof(float));
+        s->sums[l] = mem_alloc((size_t)batch_size * n * sizeof(float));
+        s->deltas[l] = mem_alloc((size_t)batch_size * n * sizeof(float));
+        layer = &s->layers[l];
+        for (k = 0; l > 1 && k < layer->n_slices; k++) {
+            mem_free(layer->slices[k].partial);
+            layer->slices[k].partial = mem_alloc((size_t)batch_size
+                                       * n_neurons(s, l-1) * sizeof(float));
+        }
+    }
+    s->batch_size = batch_size;
+}
+
+/* split_create: split the layers of net of at least min_width neurons
+ * among n_threads threads (see split.h). Returns NULL on error */
+struct split *split_create(struct network *net, int n_threads,
+                           int min_width)
+{
+    struct split *s;
+    struct split_layer *layer;
+    struct split_slice *sl;
+    struct helper_args *args;
+    int l, t, n;
+
+    if (n_threads < 1) {
+        fprintf(stderr, "split_create: %d threads\n", n_threads);
+        return NULL;
+    }
+    s = calloc(1, sizeof(struct split));
+    s->net = net;
+    s->n_threads = n_threads;
+    s->layers = calloc(net->n_layers, sizeof(struct split_layer));
+    s->activs = calloc(net->n_layers, sizeof(float *));
+    s->sums = calloc(net->n_layers, sizeof(float *));
+    s->deltas = calloc(net->n_layers, sizeof(float *));
+    for (l = 1; l < net->n_layers; l++) {
+        layer = &s->layers[l];
+        n = net->layers[l]->n_neurons;
+        layer->n_slices = (n >= min_width && n >= n_threads) ? n_threads : 1;
+        layer->slices = calloc(layer->n_slices, sizeof(struct split_slice));
+        for (t = 0; t < layer->n_slices; t++) {
+            sl = &layer->slices[t];
+            sl->start = (long)n * t / layer->n_slices;
+            sl->count = (long)n * (t + 1) / layer->n_slices - sl->start;
+            sl->stride = sl->count;
+        }
+        if (layer->n_slices == 1) {
+            /* the layer stays in the network */
+            sl = &layer->slices[0];
+            sl->stride = n;
+            sl->weights = net->weights[l][0];
+            sl->biases = net->biases[l];
+            sl->grad = malloc(n * sizeof(float));
+        }
+    }
+    pthread_barrier_init(&s->barrier, NULL, n_threads);
+    s->threads = calloc(n_threads, sizeof(pthread_t));
+    for (t = 1; t < n_threads; t++) {
+        args = malloc(sizeof(struct helper_args));
+        args->split = s;
+        args->thread = t;
+        pthread_create(&s->threads[t], NULL, helper, args);
+    }
+    dispatch(s, OP_LOAD);
+    return s;
+}
+
+void split_destroy(struct split *s)
+{
+    struct split_layer *layer;
+    int l, k;
+
+    if (!s)
+        return;
+    s->op = OP_EXIT;
+    pthread_barrier_wait(&s->barrier);
+    for (k = 1; k < s->n_threads; k++)
+        pthread_join(s->threads[k], NULL);
+    pthread_barrier_destroy(&s->barrier);
+    for (l = 1; l < s->net->n_layers; l++) {
+        layer = &s->layers[l];
+        for (k = 0; k < layer->n_slices; k++) {
+            if (layer->n_slices > 1) {
+                mem_free(layer->slices[k].weights);
+                mem_free(layer->slices[k].biases);
+            } else {
+                free(layer->slices[k].grad);
+            }
+            mem_free(layer->slices[k].partial);
+        }
+        free(layer->slices);
+        mem_free(s->activs[l]);
+        mem_free(s->sums[l]);
+        mem_free(s->deltas[l]);
+    }
+    free(s->layers);
+    free(s->activs);
+    free(s->sums);
+    free(s->deltas);
+    free(s->threads);
+    free(s);
+}
+
+/* split_load: take the weights and biases of the network again */
+void split_load(struct split *s)
+{
+    dispatch(s, OP_LOAD);
+}
+
+/* split_store: write the weights and biases trained back to the network */
+void split_store(struct split *s)
+{
+    dispatch(s, OP_STORE);
+}
+
+/* split_feedforward: like feedforward_batch. Only one thread may use the
+ * split at a time */
+void split_feedforward(struct split *s, int batch_size, float *input,
+                       float *output)
+{
+    int last = s->net->n_layers - 1;
+
+    grow(s, batch_size);
+    s->batch = batch_size;
+    s->activs[0] = input;
+    dispatch(s, OP_FORWARD);
+    memcpy(output, s->activs[last],
+           (size_t)batch_size * n_neurons(s, last) * sizeof(float));
+}
+
+/* split_update_minibatch: like network_update_minibatch, for the batch_size
+ * samples of input and output. Layers not split are updated in the network
+ * itself, and the others in their slices until split_store */
+void split_update_minibatch(struct split *s, int batch_size, float *input,
+                            float *output, float eta)
+{
+    grow(s, batch_size);
+    s->lowest = network_lowest_trainable(s->net);
+    s->batch = batch_size;
+    s->activs[0] = input;
+    s->output = output;
+    s->eta = eta;
+    dispatch(s, OP_TRAIN);
+}
@@ -0,0 +1,80 @@
+#ifndef __SPLIT__
+#define __SPLIT__
+
+#include <pthread.h>
+#include "neuron.h"
+
+/* Model parallelism within layers, for networks with layers so wide that
+ * a single one is the bottleneck even for one sample at a time.
+ *
+ * split_create splits the layers of at least min_width neurons by columns
+ * (the neurons of the layer) among n_threads threads, the caller being the
+ * first one. Each thread keeps a copy of its slice of the weights and
+ * biases, allocated and first touched by itself, so that it lies in the
+ * memory of its node (see mem.h). Narrower layers are left whole to the
+ * first thread, which uses the weights of the network.
+ *
+ * In the forward pass every thread computes the outputs of its columns,
+ * which need no gathering but a barrier before the next layer. In the
+ * backward pass every thread computes, from its columns, a partial error
+ * for all the neurons of the previous layer, and updates its slice; after
+ * a barrier the threads add up the partials, each for a range of neurons,
+ * and meet at a second barrier. As in network_update_minibatch, frozen
+ * layers are not updated and the backward pass stops at the lowest
+ * trainable layer (see network_set_trainable).
+ *
+ * The slices are copies: split_load takes the weights of the network again
+ * after they have changed, and split_store writes back those trained with
+ * split_update_minibatch.
+ */
+
+struct split_slice {
+    int start;          /* first column */
+    int count;
+    int stride;         /* floats from a row of weights to the next */
+    float *weights;     /* [n_prev][stride], from column start */
+    float *biases;
+    float *grad;        /* count floats, for the update */
+    float *partial;     /* [batch][n_prev] errors of the previous layer */
+};
+
+struct split_layer {
+    int n_slices;       /* n_threads, or 1 if the layer is not split */
+    struct split_slice *slices;
+};
+
+struct split {
+    struct network *net;
+    int n_threads;
+    pthread_t *threads;
+    pthread_barrier_t barrier;
+    struct split_layer *layers;
+    int batch_size;     /* room in the buffers */
+    float **activs;     /* [n_layers][batch][neurons] */
+    float **sums;
+    float **deltas;
+    /* the job run by all the threads */
+    int op;
+    int batch;
+    float *input;
+    float *output;
+    float eta;
+    int lowest;         /* trainable layer of the job, or n_layers */
+};
+
+struct split *split_create(struct network *net, int n_threads,
+                           int min_width);
+
+void split_destroy(struct split *s);
+
+void split_load(struct split *s);
+
+void split_store(struct split *s);
+
+void split_feedforward(struct split *s, int batch_size, float *input,
+                       float *output);
+
+void split_update_minibatch(struct split *s, int batch_size, float *input,
+                            float *output, float eta);
+
+#endif
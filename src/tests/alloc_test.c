@@ -0,0 +1,70 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "neuron.h"
+#include "memcount.h"
+
+#define N_SAMPLES 100
+#define BATCH_SIZE 10
+
+/* Checks that, once the workspace has grown, training and inference with
+ * scratch space do not allocate memory, and that network_memory_stats
+ * agrees with what was actually allocated */
+int main()
+{
+    int sizes[3] = { 784, 30, 10 };
+    static float input[N_SAMPLES][784], output[N_SAMPLES][10];
+    static float out[N_SAMPLES][10], scratch[2 * N_SAMPLES * 784];
+    struct train_stats stats;
+    struct network_memory mem;
+    struct memcount mc;
+    struct network *net;
+    long params;
+    int i, j, errors = 0;
+
+    for (i = 0; i < N_SAMPLES; i++) {
+        for (j = 0; j < 784; j++)
+            input[i][j] = (float)rand() / (float)RAND_MAX;
+        output[i][i % 10] = 1;
+    }
+    memcount_reset();
+    net = create_network(3, sizes);
+    memcount_get(&mc);
+    network_memory_stats(net, &mem);
+    network_memory_print(stdout, &mem);
+    params = (network_n_weights(net) + 30 + 10) * sizeof(float);
+    if (mem.params != params || mem.blocks != mc.allocs
+            || mem.total - mem.overhead > mc.bytes || mem.workspace != 0) {
+        printf("create_network: %ld blocks, %zu bytes allocated\n",
+               mc.allocs, mc.bytes);
+        errors++;
+    }
+
+    /* the first minibatch grows the workspace */
+    network_set_stats(net, &stats, 0, NULL);
+    network_update_minibatch(net, BATCH_SIZE, input, output, 0.1, 0);
+    memcount_reset();
+    for (i = 0; i + BATCH_SIZE <= N_SAMPLES; i += BATCH_SIZE)
+        network_update_minibatch(net, BATCH_SIZE, input, output, 0.1, i);
+    network_SGD(net, N_SAMPLES, BATCH_SIZE, 2, input, output, 0.1, NULL);
+    for (i = 0; i < N_SAMPLES; i++)
+        feedforward(net, input[i], out[i]);
+    feedforward_batch(net, N_SAMPLES, input, out, scratch);
+    memcount_get(&mc);
+    if (mc.allocs != 0 || mc.frees != 0) {
+        printf("training allocated %ld blocks and freed %ld\n", mc.allocs,
+               mc.frees);
+        errors++;
+    }
+    network_memory_stats(net, &mem);
+    network_memory_print(stdout, &mem);
+    if (mem.workspace == 0 || stats.peak_bytes < mem.total
+            + network_dataset_bytes(net, N_SAMPLES)) {
+        printf("workspace %zu bytes, peak %zu bytes\n", mem.workspace,
+               stats.peak_bytes);
+        errors++;
+    }
+    train_stats_print(stdout, &stats);
+    destroy_network(net);
+    printf("%d errors\n", errors);
+    return errors != 0;
+}
@@ -0,0 +1,120 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include "neuron.h"
+#include "cache.h"
+
+#define N 150
+#define N_IN 20
+#define N_OUT 4
+#define LAYER 2
+#define EPOCHS 3
+#define TOLERANCE 1e-4
+
+static int errors;
+static int calls;
+static struct network *trained;
+
+static void count(struct network *net, int epoch)
+{
+    if (net == trained && epoch == calls)
+        calls++;
+}
+
+/* check_cache: the cache must hold the activations of the layer, within
+ * the precision of its encoding */
+static void check_cache(struct network *net, float *input, char *path,
+                        int encoding, float tolerance)
+{
+    int dim = net->layers[LAYER]->n_neurons, i, k;
+    float out[N_OUT], got[dim], want;
+    struct cache *f;
+
+    if (cache_build(net, LAYER, encoding, N, input, path, NULL) < 0
+            || !(f = cache_open(path))) {
+        printf("cache of encoding %d not built\n", encoding);
+        errors++;
+        return;
+    }
+    if (f->header.n_samples != N || f->header.dim != dim
+            || f->header.layer != LAYER) {
+        printf("header of encoding %d: %ld samples of %d\n", encoding,
+               (long)f->header.n_samples, f->header.dim);
+        errors++;
+    }
+    for (i = 0; i < N; i++) {
+        feedforward(net, input + i * N_IN, out);
+        cache_get(f, i, 1, got);
+        for (k = 0; k < dim; k++) {
+            want = net->layers[LAYER]->neurons[k]->out;
+            if (fabsf(got[k] - want) > tolerance * fabsf(want) + 1e-7) {
+                printf("encoding %d, sample %d: %g instead of %g\n",
+                       encoding, i, got[k], want);
+                errors++;
+                break;
+            }
+        }
+    }
+    cache_close(f);
+}
+
+int main()
+{
+    int sizes[4] = { N_IN, 30, 16, N_OUT }, i, j, l;
+    float input[N][N_IN], output[N][N_OUT];
+    float ref_input[N][N_IN], ref_output[N][N_OUT];
+    struct network *net = create_network(4, sizes), *ref;
+    struct cache *f;
+    char path[64];
+
+    snprintf(path, sizeof(path), "/tmp/cache_test-%d.feat", (int)getpid());
+    for (i = 0; i < N; i++)
+        for (j = 0; j < N_IN; j++)
+            input[i][j] = (float)rand() / RAND_MAX;
+    for (i = 0; i < N; i++)
+        for (j = 0; j < N_OUT; j++)
+            output[i][j] = rand() % 2;
+    check_cache(net, &input[0][0], path, CACHE_F16, 1.0 / 2048);
+    check_cache(net, &input[0][0], path, CACHE_F32, 1e-6);
+
+    /* training the head from the cache, in a single minibatch so that the
+     * order of the samples does not matter, must be the same as training
+     * the network with its lower layers frozen. network_SGD shuffles its
+     * own copy of the samples */
+    memcpy(ref_input, input, sizeof(input));
+    memcpy(ref_output, output, sizeof(output));
+    ref = network_clone(net, 0, -1);
+    for (l = 1; l <= LAYER; l++)
+        network_set_trainable(ref, l, 0);
+    network_SGD(ref, N, N, EPOCHS, ref_input, ref_output, 1.0, NULL);
+    f = cache_open(path);
+    trained = net;
+    cache_SGD(net, f, N, EPOCHS, &output[0][0], 1.0, count);
+    cache_close(f);
+    for (i = 0; i < net->n_params; i++)
+        if (fabsf(net->params[i] - ref->params[i]) > TOLERANCE) {
+            printf("parameter %d: %g instead of %g\n", i, net->params[i],
+                   ref->params[i]);
+            errors++;
+            break;
+        }
+    if (calls != EPOCHS) {
+        printf("%d calls instead of %d\n", calls, EPOCHS);
+        errors++;
+    }
+
+    /* anything else is not a cache */
+    network_save_to_file(net, path);
+    if ((f = cache_open(path))) {
+        printf("a network opened as a cache\n");
+        cache_close(f);
+        errors++;
+    }
+    unlink(path);
+    destroy_network(ref);
+    destroy_network(net);
+    printf("%d errors\n", errors);
+    return errors != 0;
+}
@@ -0,0 +1,161 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "neuron.h"
+#include "cascade.h"
+#include "trace.h"
+
+#define N 200
+#define N_IN 8
+#define N_OUT 4
+
+static int errors;
+static float input[N][N_IN];
+static int small_labels[N], large_labels[N];
+static float small_scores[N], large_scores[N];
+static int n_spans;     /* escalate spans seen so far */
+
+/* escalations: the sizes of the batches passed on to the large network
+ * since the last call, from the spans in the trace. Returns their number */
+static int escalations(int *sizes, int max)
+{
+    FILE *fp = tmpfile();
+    char *buf, *p;
+    long len;
+    int n = 0, seen = 0;
+
+    trace_write(fp);
+    len = ftell(fp);
+    rewind(fp);
+    buf = calloc(len + 1, 1);
+    fread(buf, 1, len, fp);
+    fclose(fp);
+    for (p = buf; (p = strstr(p, "\"name\": \"escalate\"")); p++) {
+        if (seen++ < n_spans)
+            continue;
+        if (n < max)
+            sizes[n] = atoi(strstr(p, "\"index\": ") + 9);
+        n++;
+    }
+    n_spans = seen;
+    free(buf);
+    return n;
+}
+
+/* check: classify with the given threshold, which must give each sample
+ * the label and confidence of the small network if it is confident enough,
+ * or else those of the large network; the samples passed on must go to the
+ * large network in a single batch */
+static void check(struct network *small, struct network *large,
+                  float threshold, struct cascade_stats *stats)
+{
+    int labels[N], sizes[2], i, m = 0, n;
+    float confidence[N];
+    long escalated = stats->escalated;
+
+    cascade_classify_batch(small, large, threshold, N, input, labels,
+                           confidence, stats);
+    for (i = 0; i < N; i++) {
+        if (small_scores[i] < threshold) {
+            m++;
+            if (labels[i] != large_labels[i]
+                    || confidence[i] != large_scores[i]) {
+                printf("threshold %g, sample %d: %d (%g) instead of the " \
+                       "large network's %d (%g)\n", threshold, i, labels[i],
+                       confidence[i], large_labels[i], large_scores[i]);
+                errors++;
+            }
+        } else if (labels[i] != small_labels[i]
+                   || confidence[i] != small_scores[i]) {
+            printf("threshold %g, sample %d: %d (%g) instead of the " \
+                   "small network's %d (%g)\n", threshold, i, labels[i],
+                   confidence[i], small_labels[i], small_scores[i]);
+            errors++;
+        }
+    }
+    if (stats->escalated - escalated != m) {
+        printf("threshold %g: %ld escalated instead of %d\n", threshold,
+               stats->escalated - escalated, m);
+        errors++;
+    }
+    n = escalations(sizes, 2);
+    if (m > 0 ? n != 1 || sizes[0] != m : n != 0) {
+        printf("threshold %g: %d batches for the large network, " \
+               "the first of %d, instead of one of %d\n", threshold, n,
+               n > 0 ? sizes[0] : 0, m);
+        errors++;
+    }
+}
+
+int main()
+{
+    int small_sizes[3] = { N_IN, 5, N_OUT }, large_sizes[4] = { N_IN, 20, 20,
+                                                               N_OUT };
+    struct network *small = create_network(3, small_sizes);
+    struct network *large = create_network(4, large_sizes);
+    struct cascade_stats stats = { 0, 0, 0 };
+    double cost, want;
+    float median, sorted[N], confidence;
+    int i, j, label;
+
+    for (i = 0; i < N; i++)
+        for (j = 0; j < N_IN; j++)
+            input[i][j] = 4 * (float)rand() / RAND_MAX - 2;
+    network_classify(small, N, input, small_labels, 1, small_scores, 1);
+    network_classify(large, N, input, large_labels, 1, large_scores, 1);
+    trace_start(0);
+
+    /* nothing is passed on with a threshold of 0, nearly everything with
+     * one of 1 */
+    check(small, large, 0, &stats);
+    if (stats.escalated != 0 || cascade_escalation_rate(&stats) != 0
+            || cascade_cost_per_sample(&stats) != network_n_weights(small)) {
+        printf("threshold 0: %ld escalated, cost %g\n", stats.escalated,
+               cascade_cost_per_sample(&stats));
+        errors++;
+    }
+    check(small, large, 1, &stats);
+
+    /* a sample whose confidence is the threshold is not passed on */
+    memcpy(sorted, small_scores, sizeof(sorted));
+    for (i = 1; i < N; i++)
+        for (j = i; j > 0 && sorted[j] < sorted[j-1]; j--) {
+            median = sorted[j];
+            sorted[j] = sorted[j-1];
+            sorted[j-1] = median;
+        }
+    median = sorted[N / 2];
+    for (i = 0; small_scores[i] != median; i++)
+        ;
+    check(small, large, median, &stats);
+    label = cascade_classify(small, large, median, input[i], &confidence,
+                             NULL);
+    if (label != small_labels[i] || confidence != median) {
+        printf("sample on the threshold passed on\n");
+        errors++;
+    }
+    if (escalations(NULL, 0) != 0) {
+        printf("sample on the threshold sent to the large network\n");
+        errors++;
+    }
+
+    /* the statistics of the three batches together */
+    for (i = j = 0; i < N; i++)
+        j += (small_scores[i] < 1) + (small_scores[i] < median);
+    cost = cascade_cost_per_sample(&stats);
+    want = network_n_weights(small)
+           + (double)j / (3 * N) * network_n_weights(large);
+    if (stats.samples != 3 * N || stats.escalated != j
+            || fabs(cascade_escalation_rate(&stats) - (double)j / (3 * N))
+               > 1e-12 || fabs(cost - want) > 1e-9 * want) {
+        printf("%ld samples, %ld escalated (rate %g), cost %g instead of " \
+               "%d, %d, %g\n", stats.samples, stats.escalated,
+               cascade_escalation_rate(&stats), cost, 3 * N, j, want);
+        errors++;
+    }
+    destroy_network(small);
+    destroy_network(large);
+    printf("%d errors\n", errors);
+    return errors != 0;
+}
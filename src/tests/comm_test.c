@@ -0,0 +1,173 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "neuron.h"
+#include "comm.h"
+
+#define RANKS 4
+#define N_SAMPLES 400
+#define BATCH_SIZE 10
+#define EPOCHS 20
+
+static char name[64];
+
+/* check_allreduce: sums of small integers, which are exact, for lengths
+ * shorter than the number of ranks, not a multiple of it, and of several
+ * segments */
+static int check_allreduce(struct comm *c)
+{
+    static const long lengths[] = { 0, 1, RANKS - 1, 1000, 100003 };
+    float *data = malloc(100003 * sizeof(float));
+    int i, errors = 0;
+    long j, n;
+
+    for (i = 0; i < (int)(sizeof(lengths) / sizeof(lengths[0])); i++) {
+        n = lengths[i];
+        for (j = 0; j < n; j++)
+            data[j] = (c->rank + 1) * (j % 7);
+        if (comm_allreduce(c, data, n) < 0)
+            return 1;
+        for (j = 0; j < n; j++)
+            if (data[j] != RANKS * (RANKS + 1) / 2 * (j % 7)) {
+                printf("rank %d: allreduce of %ld: %g at %ld\n", c->rank, n,
+                       data[j], j);
+                errors++;
+                break;
+            }
+    }
+    for (j = 0; j < 1000; j++)
+        data[j] = c->rank == 2 ? j : -1;
+    comm_broadcast(c, data, 1000, 2);
+    for (j = 0; j < 1000; j++)
+        if (data[j] != j) {
+            printf("rank %d: broadcast: %g at %ld\n", c->rank, data[j], j);
+            errors++;
+            break;
+        }
+    n = 100 + c->rank;
+    comm_min(c, &n);
+    if (n != 100) {
+        printf("rank %d: min %ld\n", c->rank, n);
+        errors++;
+    }
+    free(data);
+    return errors;
+}
+
+/* check_training: every rank trains on its part of the samples, and all
+ * must end with the same parameters, and a lower cost */
+static int check_training(struct comm *c)
+{
+    int sizes[3] = { 8, 16, 4 };
+    static float input[N_SAMPLES][8], output[N_SAMPLES][4];
+    static float out[N_SAMPLES][4];
+    struct network *net;
+    float *params, cost[2];
+    long start, count, i;
+    int j, k, errors = 0;
+
+    srand(1);
+    for (i = 0; i < N_SAMPLES; i++) {
+        for (j = 0; j < 8; j++)
+            input[i][j] = (float)rand() / RAND_MAX;
+        for (k = 0; k < 4; k++)
+            output[i][k] = input[i][2 * k] > input[i][2 * k + 1];
+    }
+    srand(c->rank + 2);     /* different weights and shuffles */
+    net = create_network(3, sizes);
+    network_set_comm(net, c);
+    comm_shard(c, N_SAMPLES, &start, &count);
+    for (k = 0; k < 2; k++) {
+        for (i = 0; i < count; i++)
+            feedforward(net, input[start + i], out[i]);
+        cost[k] = cost_function_batch(4, count, out, output + start);
+        if (k == 0)
+            network_SGD(net, count, BATCH_SIZE, EPOCHS, input + start,
+                        output + start, 3.0, NULL);
+    }
+    if (c->failed || !(cost[1] < cost[0])) {
+        printf("rank %d: cost from %g to %g\n", c->rank, cost[0], cost[1]);
+        errors++;
+    }
+    params = malloc(net->n_params * sizeof(float));
+    memcpy(params, net->params, net->n_params * sizeof(float));
+    comm_broadcast(c, params, net->n_params, 0);
+    if (memcmp(params, net->params, net->n_params * sizeof(float)) != 0) {
+        printf("rank %d: parameters differ from rank 0\n", c->rank);
+        errors++;
+    }
+    free(params);
+    destroy_network(net);
+    return errors;
+}
+
+/* check_failure: the last rank leaves without a word, and the others must
+ * notice instead of waiting for it */
+static int check_failure(struct comm *c)
+{
+    float data[100] = { 0 };
+
+    if (c->rank == RANKS - 1)
+        _exit(0);
+    if (comm_allreduce(c, data, 100) == 0 || !c->failed) {
+        printf("rank %d: allreduce did not fail\n", c->rank);
+        return 1;
+    }
+    return 0;
+}
+
+static int run(int rank, int check(struct comm *))
+{
+    struct comm *c;
+    int errors;
+
+    alarm(30);
+    if (!(c = comm_open(name, rank, RANKS)))
+        return 1;
+    errors = check(c);
+    comm_close(c);
+    return errors;
+}
+
+/* spawn: run check in RANKS processes, and add up their errors */
+static int spawn(const char *what, int check(struct comm *))
+{
+    int rank, status, errors = 0;
+    pid_t pids[RANKS];
+
+    printf("%s\n", what);
+    fflush(stdout);
+    for (rank = 0; rank < RANKS; rank++)
+        if ((pids[rank] = fork()) == 0)
+            exit(run(rank, check));
+    for (rank = 0; rank < RANKS; rank++) {
+        waitpid(pids[rank], &status, 0);
+        if (!WIFEXITED(status)) {
+            printf("rank %d killed by signal %d\n", rank, WTERMSIG(status));
+            errors++;
+        } else {
+            errors += WEXITSTATUS(status);
+        }
+    }
+    return errors;
+}
+
+int main()
+{
+    char path[80];
+    int errors = 0;
+
+    snprintf(name, sizeof(name), "/neurotic-comm-test-%d", (int)getpid());
+    errors += spawn("allreduce", check_allreduce);
+    errors += spawn("training", check_training);
+    errors += spawn("failure", check_failure);
+    snprintf(path, sizeof(path), "/dev/shm%s", name);
+    if (access(path, F_OK) == 0) {
+        printf("%s left in /dev/shm\n", name);
+        errors++;
+    }
+    printf("%d errors\n", errors);
+    return errors != 0;
+}
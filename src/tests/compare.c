@@ -0,0 +1,23 @@
+#include <math.h>
+#include "compare.h"
+
+/* compare_relative: whether n values are within tolerance of the
+ * reference, relative to its largest value. *worst is set to the index of
+ * the value farthest from its reference */
+int compare_relative(long n, float *got, float *want, float tolerance,
+                     long *worst)
+{
+    float max = 1e-6, diff = 0;
+    long i;
+
+    *worst = 0;
+    for (i = 0; i < n; i++)
+        if (fabsf(want[i]) > max)
+            max = fabsf(want[i]);
+    for (i = 0; i < n; i++)
+        if (fabsf(got[i] - want[i]) > diff) {
+            diff = fabsf(got[i] - want[i]);
+            *worst = i;
+        }
+    return diff <= tolerance * max;
+}
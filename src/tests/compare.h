@@ -0,0 +1,12 @@
+#ifndef __COMPARE__
+#define __COMPARE__
+
+/* Comparison of the values computed by a test against a reference, for
+ * results that may differ in rounding, such as those of sums taken in
+ * another order.
+ */
+
+int compare_relative(long n, float *got, float *want, float tolerance,
+                     long *worst);
+
+#endif
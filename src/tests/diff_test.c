@@ -0,0 +1,414 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include "neuron.h"
+#include "pool.h"
+#include "registry.h"
+
+/* Differential tests of the optimized paths against the reference math.
+ *
+ * For random topologies and batch sizes:
+ *  - the gradient computed by calc_activs_deltas is checked against finite
+ *    differences of the cost,
+ *  - the update made by network_update_minibatch is checked against the
+ *    sum of the gradients of each sample,
+ *  - the loss of the minibatch must be the cost and hits of its samples,
+ *  - with some layers frozen, the update must leave those as they are and
+ *    make the same changes as usual to the others,
+ *  - every inference backend in the table below is checked against
+ *    feedforward, within its budget of ULPs.
+ *
+ * New backends (a vectorized or quantized feedforward, for instance) are
+ * added to the table with the error they are allowed.
+ *
+ *      usage: diff_test [iterations [seed]]
+ */
+
+#define DEFAULT_ITERATIONS 200
+#define MAX_LAYERS 6
+#define MAX_NEURONS 80      /* over FF_BLOCK, to cross a block boundary */
+#define MAX_BATCH 100
+#define FD_STEP 1e-2
+#define FD_ATOL 2e-4
+#define FD_RTOL 2e-2
+#define UPDATE_RTOL 1e-4
+#define UPDATE_ATOL 1e-6
+#define ETA 0.5
+
+struct backend {
+    char *name;
+    void (*run)(struct network *, int, float *, float *);
+    int ulps;       /* allowed difference with feedforward */
+};
+
+static struct pool *pool;
+static struct registry *reg;
+static char reg_name[32];
+static char path[64];
+static int failures;
+
+static void run_batch(struct network *net, int n, float *in, float *out)
+{
+    int n_in = net->layers[0]->n_neurons;
+    int n_out = net->layers[net->n_layers-1]->n_neurons;
+    float *scratch = malloc(2 * n * network_max_neurons(net) * sizeof(float));
+    feedforward_batch(net, n, (float (*)[n_in])in, (float (*)[n_out])out,
+                      scratch);
+    free(scratch);
+}
+
+static void run_batch_alloc(struct network *net, int n, float *in, float *out)
+{
+    int n_in = net->layers[0]->n_neurons;
+    int n_out = net->layers[net->n_layers-1]->n_neurons;
+    feedforward_batch(net, n, (float (*)[n_in])in, (float (*)[n_out])out,
+                      NULL);
+}
+
+/* run_layers: one layer at a time, in batches of a single sample */
+static void run_layers(struct network *net, int n, float *in, float *out)
+{
+    int max = network_max_neurons(net), n_in = net->layers[0]->n_neurons;
+    int n_out = net->layers[net->n_layers-1]->n_neurons;
+    float cur[max], next[max];
+    int i, l;
+
+    for (i = 0; i < n; i++) {
+        memcpy(cur, in + i * n_in, n_in * sizeof(float));
+        for (l = 1; l < net->n_layers; l++) {
+            feedforward_layer(net, l, 1, cur, next, 1);
+            memcpy(cur, next, net->layers[l]->n_neurons * sizeof(float));
+        }
+        memcpy(out + i * n_out, cur, n_out * sizeof(float));
+    }
+}
+
+static void run_registry(struct network *net, int n, float *in, float *out)
+{
+    registry_infer(reg, reg_name, n, in, out);
+}
+
+static struct backend backends[] = {
+    { "feedforward_batch", run_batch, 0 },
+    { "feedforward_batch(NULL)", run_batch_alloc, 0 },
+    { "feedforward_layer", run_layers, 0 },
+    { "registry_infer", run_registry, 0 },
+};
+
+#define N_BACKENDS (sizeof(backends) / sizeof(backends[0]))
+
+static float uniform(float min, float max)
+{
+    return min + (max - min) * (float)rand() / (float)RAND_MAX;
+}
+
+/* ulps: distance between a and b in units in the last place */
+static long ulps(float a, float b)
+{
+    int ia, ib;
+    memcpy(&ia, &a, sizeof(int));
+    memcpy(&ib, &b, sizeof(int));
+    /* map the sign-magnitude floats to a monotonic integer scale */
+    if (ia < 0)
+        ia = (int)(0x80000000u - (unsigned)ia);
+    if (ib < 0)
+        ib = (int)(0x80000000u - (unsigned)ib);
+    return labs((long)ia - ib);
+}
+
+static void fail(char *what, int *sizes, int n_layers, char *fmt, double a,
+                 double b)
+{
+    int l;
+    failures++;
+    if (failures > 20)
+        return;
+    printf("FAIL %s, topology", what);
+    for (l = 0; l < n_layers; l++)
+        printf("%s%d", l ? "-" : " ", sizes[l]);
+    printf(": ");
+    printf(fmt, a, b);
+    printf("\n");
+}
+
+/* cost: the cost whose gradient calc_activs_deltas computes, half the
+ * squared error */
+static double cost(struct network *net, float *input, float *target)
+{
+    int n_out = net->layers[net->n_layers-1]->n_neurons, i;
+    float output[n_out];
+    double c = 0;
+
+    feedforward(net, input, output);
+    for (i = 0; i < n_out; i++)
+        c += 0.5 * (output[i] - target[i]) * (output[i] - target[i]);
+    return c;
+}
+
+static float **alloc_layers(struct network *net)
+{
+    float **v = malloc(net->n_layers * sizeof(float *));
+    int l;
+    for (l = 0; l < net->n_layers; l++)
+        v[l] = calloc(net->layers[l]->n_neurons, sizeof(float));
+    return v;
+}
+
+static void free_layers(struct network *net, float **v)
+{
+    int l;
+    for (l = 0; l < net->n_layers; l++)
+        free(v[l]);
+    free(v);
+}
+
+/* check_gradient: compare the gradient of every weight and bias with the
+ * central difference of the cost */
+static void check_gradient(struct network *net, int *sizes, float *input,
+                           float *target)
+{
+    float **activs = alloc_layers(net), **deltas = alloc_layers(net);
+    float output[sizes[net->n_layers-1]], *p, saved;
+    double analytic, numeric, plus;
+    int l, n1, n2;
+
+    calc_activs_deltas(net, input, target, activs, deltas);
+    for (l = 1; l < net->n_layers; l++) {
+        for (n2 = 0; n2 < sizes[l]; n2++) {
+            /* n1 == sizes[l-1] stands for the bias */
+            for (n1 = 0; n1 <= sizes[l-1]; n1++) {
+                if (n1 < sizes[l-1]) {
+                    p = &net->weights[l][n1][n2];
+                    analytic = activs[l-1][n1] * deltas[l][n2];
+                } else {
+                    p = &net->biases[l][n2];
+                    analytic = deltas[l][n2];
+                }
+                saved = *p;
+                *p = saved + FD_STEP;
+                plus = cost(net, input, target);
+                *p = saved - FD_STEP;
+                numeric = (plus - cost(net, input, target)) / (2 * FD_STEP);
+                *p = saved;
+                if (fabs(analytic - numeric) > FD_ATOL
+                        + FD_RTOL * fmax(fabs(analytic), fabs(numeric)))
+                    fail("gradient", sizes, net->n_layers,
+                         "analytic %g, finite differences %g", analytic,
+                         numeric);
+            }
+        }
+    }
+    /* calc_activs_deltas leaves the state of the network as feedforward */
+    feedforward(net, input, output);
+    free_layers(net, activs);
+    free_layers(net, deltas);
+}
+
+/* check_update: one step of network_update_minibatch must move each weight
+ * by -eta times the mean of the gradients of the samples */
+static void check_update(struct network *net, int *sizes, int batch,
+                         int offset, float *inputs, float *targets)
+{
+    int n_in = sizes[0], n_out = sizes[net->n_layers-1];
+    float **activs = alloc_layers(net), **deltas = alloc_layers(net);
+    double *expected = calloc(network_n_weights(net) + net->n_neurons,
+                              sizeof(double));
+    double e;
+    long i;
+    int l, n1, n2, s;
+
+    /* expected gradients, in the order of the loops below */
+    for (s = 0; s < batch; s++) {
+        calc_activs_deltas(net, inputs + (offset + s) * n_in,
+                           targets + (offset + s) * n_out, activs, deltas);
+        for (l = 1, i = 0; l < net->n_layers; l++)
+            for (n2 = 0; n2 < sizes[l]; n2++) {
+                for (n1 = 0; n1 < sizes[l-1]; n1++)
+                    expected[i++] += activs[l-1][n1] * deltas[l][n2];
+                expected[i++] += deltas[l][n2];
+            }
+    }
+    for (l = 1, i = 0; l < net->n_layers; l++)
+        for (n2 = 0; n2 < sizes[l]; n2++) {
+            for (n1 = 0; n1 < sizes[l-1]; n1++, i++)
+                expected[i] = net->weights[l][n1][n2]
+                              - ETA / batch * expected[i];
+            expected[i] = net->biases[l][n2] - ETA / batch * expected[i];
+            i++;
+        }
+
+    network_update_minibatch(net, batch, (float (*)[n_in])inputs,
+                             (float (*)[n_out])targets, ETA, offset);
+    for (l = 1, i = 0; l < net->n_layers; l++)
+        for (n2 = 0; n2 < sizes[l]; n2++)
+            for (n1 = 0; n1 <= sizes[l-1]; n1++, i++) {
+                e = n1 < sizes[l-1] ? net->weights[l][n1][n2]
+                                    : net->biases[l][n2];
+                if (fabs(e - expected[i]) > UPDATE_ATOL
+                        + UPDATE_RTOL * fabs(expected[i]))
+                    fail("network_update_minibatch", sizes, net->n_layers,
+                         "weight %g, expected %g", e, expected[i]);
+            }
+    free(expected);
+    free_layers(net, activs);
+    free_layers(net, deltas);
+}
+
+/* check_loss: the loss left by network_update_minibatch must be that of
+ * the outputs of the samples before the update */
+static void check_loss(struct network *net, int *sizes, int batch,
+                       int offset, float *inputs, float *targets)
+{
+    int n_in = sizes[0], n_out = sizes[net->n_layers-1], s;
+    struct network *copy = network_clone(net, 0, -1);
+    struct train_loss want;
+    float output[n_out];
+
+    train_loss_reset(&want);
+    for (s = 0; s < batch; s++) {
+        feedforward(net, inputs + (offset + s) * n_in, output);
+        train_loss_add(&want, n_out, output,
+                       targets + (offset + s) * n_out);
+    }
+    network_update_minibatch(copy, batch, (float (*)[n_in])inputs,
+                             (float (*)[n_out])targets, ETA, offset);
+    if (copy->batch_loss.samples != batch
+            || copy->batch_loss.hits != want.hits)
+        fail("batch_loss", sizes, net->n_layers, "%g hits, expected %g",
+             copy->batch_loss.hits, want.hits);
+    if (fabs(copy->batch_loss.cost - want.cost) > UPDATE_ATOL
+            + UPDATE_RTOL * want.cost)
+        fail("batch_loss", sizes, net->n_layers, "cost %g, expected %g",
+             copy->batch_loss.cost, want.cost);
+    if (copy->epoch_loss.samples != batch)
+        fail("epoch_loss", sizes, net->n_layers, "%g samples, expected %g",
+             copy->epoch_loss.samples, batch);
+    destroy_network(copy);
+}
+
+/* check_frozen: update a copy of the network with random layers frozen,
+ * and another one with none */
+static void check_frozen(struct network *net, int *sizes, int batch,
+                         int offset, float *inputs, float *targets)
+{
+    int n_in = sizes[0], n_out = sizes[net->n_layers-1], l, n1, n2;
+    struct network *frozen = network_clone(net, 0, -1);
+    struct network *full = network_clone(net, 0, -1);
+    float *got, *want;
+
+    for (l = 1; l < net->n_layers; l++)
+        network_set_trainable(frozen, l, rand() % 2);
+    network_update_minibatch(frozen, batch, (float (*)[n_in])inputs,
+                             (float (*)[n_out])targets, ETA, offset);
+    network_update_minibatch(full, batch, (float (*)[n_in])inputs,
+                             (float (*)[n_out])targets, ETA, offset);
+    for (l = 1; l < net->n_layers; l++)
+        for (n2 = 0; n2 < sizes[l]; n2++)
+            for (n1 = 0; n1 <= sizes[l-1]; n1++) {
+                got = n1 < sizes[l-1] ? &frozen->weights[l][n1][n2]
+                                      : &frozen->biases[l][n2];
+                if (frozen->layers[l]->trainable)
+                    want = n1 < sizes[l-1] ? &full->weights[l][n1][n2]
+                                           : &full->biases[l][n2];
+                else
+                    want = n1 < sizes[l-1] ? &net->weights[l][n1][n2]
+                                           : &net->biases[l][n2];
+                if (*got != *want)
+                    fail(frozen->layers[l]->trainable ? "trainable layer"
+                         : "frozen layer", sizes, net->n_layers,
+                         "weight %g, expected %g", *got, *want);
+            }
+    /* the workspace is laid out again for all the layers */
+    for (l = 1; l < net->n_layers; l++)
+        network_set_trainable(frozen, l, 1);
+    network_update_minibatch(frozen, batch, (float (*)[n_in])inputs,
+                             (float (*)[n_out])targets, ETA, offset);
+    destroy_network(frozen);
+    destroy_network(full);
+}
+
+/* check_backends: run the batch through every backend and compare */
+static void check_backends(struct network *net, int *sizes, int batch,
+                           float *inputs)
+{
+    int n_in = sizes[0], n_out = sizes[net->n_layers-1];
+    float *expected = malloc(batch * n_out * sizeof(float));
+    float *output = malloc(batch * n_out * sizeof(float));
+    int *labels = malloc(batch * sizeof(int));
+    int b, i, j, worst;
+
+    for (i = 0; i < batch; i++)
+        feedforward(net, inputs + i * n_in, expected + i * n_out);
+    for (b = 0; b < N_BACKENDS; b++) {
+        memset(output, 0, batch * n_out * sizeof(float));
+        backends[b].run(net, batch, inputs, output);
+        for (i = 0; i < batch * n_out; i++)
+            if (ulps(output[i], expected[i]) > backends[b].ulps) {
+                fail(backends[b].name, sizes, net->n_layers,
+                     "%.9g, feedforward %.9g", output[i], expected[i]);
+                break;
+            }
+    }
+    /* the label must be the largest output, unless it ties with it */
+    network_classify(net, batch, (float (*)[n_in])inputs, labels, 1, NULL, 0);
+    for (i = 0; i < batch; i++) {
+        for (j = worst = 0; j < n_out; j++)
+            if (expected[i * n_out + j] > expected[i * n_out + worst])
+                worst = j;
+        if (expected[i * n_out + labels[i]] != expected[i * n_out + worst])
+            fail("network_classify", sizes, net->n_layers,
+                 "label %g, largest output %g", labels[i], worst);
+    }
+    free(expected);
+    free(output);
+    free(labels);
+}
+
+int main(int argc, char *argv[])
+{
+    int iterations = argc > 1 ? atoi(argv[1]) : DEFAULT_ITERATIONS;
+    unsigned int seed = argc > 2 ? atoi(argv[2]) : 1;
+    int sizes[MAX_LAYERS], n_layers, batch, offset, it, l, n;
+    struct network *net;
+    float *inputs, *targets;
+
+    srand(seed);
+    pool = pool_create(0);
+    reg = registry_create(iterations, pool);
+    snprintf(path, sizeof(path), "/tmp/diff_test-%d.net", (int)getpid());
+    for (it = 0; it < iterations; it++) {
+        n_layers = 2 + rand() % (MAX_LAYERS - 1);
+        for (l = 0; l < n_layers; l++)
+            sizes[l] = 1 + rand() % MAX_NEURONS;
+        batch = 1 + rand() % MAX_BATCH;
+        offset = rand() % 4;
+        net = create_network(n_layers, sizes);
+        inputs = malloc((batch + offset) * sizes[0] * sizeof(float));
+        targets = malloc((batch + offset) * sizes[n_layers-1] * sizeof(float));
+        for (n = 0; n < (batch + offset) * sizes[0]; n++)
+            inputs[n] = uniform(-1, 1);
+        for (n = 0; n < (batch + offset) * sizes[n_layers-1]; n++)
+            targets[n] = uniform(0, 1);
+
+        network_save_to_file(net, path);
+        snprintf(reg_name, sizeof(reg_name), "net%d", it);
+        registry_add(reg, reg_name, path);
+        check_backends(net, sizes, batch, inputs);
+        /* finite differences are slow: only on the smaller networks */
+        if (network_n_weights(net) < 2000)
+            check_gradient(net, sizes, inputs, targets);
+        check_loss(net, sizes, batch, offset, inputs, targets);
+        check_frozen(net, sizes, batch, offset, inputs, targets);
+        check_update(net, sizes, batch, offset, inputs, targets);
+        free(inputs);
+        free(targets);
+        destroy_network(net);
+    }
+    unlink(path);
+    registry_destroy(reg);
+    pool_destroy(pool);
+    printf("%d networks, %d failures\n", iterations, failures);
+    return failures != 0;
+}
@@ -0,0 +1,120 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "neuron.h"
+#include "eval.h"
+
+#define N 64
+#define N_IN 6
+#define N_OUT 2
+#define BATCH 8
+#define EPOCHS 6
+#define MAX_EPOCHS 100
+#define PATIENCE 2
+#define BEST 3              /* epoch with the best score */
+#define SLEEP 20000         /* microseconds taken by each score */
+
+static int errors;
+static float *params[MAX_EPOCHS];   /* of the network after each epoch */
+static volatile int trained;        /* epochs trained so far */
+static int scored[MAX_EPOCHS];
+static int n_scored;
+static int overlapped;              /* scores seeing training go on */
+
+/* keep: called by network_SGD at the end of each epoch */
+static void keep(struct network *net, int epoch)
+{
+    params[epoch] = malloc(net->n_params * sizeof(float));
+    memcpy(params[epoch], net->params, net->n_params * sizeof(float));
+    trained = epoch + 1;
+}
+
+/* score: the snapshot must be the network after the epoch, and the scores
+ * must come in order. The best is that of epoch BEST */
+static double score(struct network *snap, int epoch, void *arg)
+{
+    usleep(SLEEP);
+    if (memcmp(snap->params, params[epoch],
+               snap->n_params * sizeof(float))) {
+        printf("snapshot of epoch %d differs\n", epoch);
+        errors++;
+    }
+    scored[n_scored++] = epoch;
+    if (trained > epoch + 1)
+        overlapped++;
+    return epoch <= BEST ? BEST - epoch : epoch;
+}
+
+static void reset(void)
+{
+    int i;
+
+    for (i = 0; i < MAX_EPOCHS; i++) {
+        free(params[i]);
+        params[i] = NULL;
+    }
+    trained = n_scored = overlapped = 0;
+}
+
+int main()
+{
+    int sizes[3] = { N_IN, 10, N_OUT }, i, j;
+    float input[N][N_IN], output[N][N_OUT];
+    struct network *net = create_network(3, sizes);
+    struct evaluator *ev;
+
+    for (i = 0; i < N; i++)
+        for (j = 0; j < N_IN; j++)
+            input[i][j] = (float)rand() / RAND_MAX;
+    for (i = 0; i < N; i++)
+        for (j = 0; j < N_OUT; j++)
+            output[i][j] = rand() % 2;
+
+    /* every epoch is scored, in order, while the next ones train */
+    ev = evaluator_create(net, score, NULL, 0);
+    network_set_evaluator(net, ev);
+    network_SGD(net, N, BATCH, EPOCHS, input, output, 0.5, keep);
+    if (n_scored != EPOCHS) {
+        printf("%d epochs scored instead of %d\n", n_scored, EPOCHS);
+        errors++;
+    }
+    for (i = 0; i < n_scored; i++)
+        if (scored[i] != i) {
+            printf("epoch %d scored in place of %d\n", scored[i], i);
+            errors++;
+        }
+    if (!overlapped) {
+        printf("no score overlapped with training\n");
+        errors++;
+    }
+    evaluator_destroy(ev);
+    reset();
+
+    /* early stopping, and the parameters of the best epoch */
+    ev = evaluator_create(net, score, NULL, PATIENCE);
+    network_set_evaluator(net, ev);
+    network_SGD(net, N, BATCH, MAX_EPOCHS, input, output, 0.5, keep);
+    if (!evaluator_stopped(ev) || trained < BEST + PATIENCE + 1
+            || trained == MAX_EPOCHS) {
+        printf("stopped %d after %d epochs\n", evaluator_stopped(ev),
+               trained);
+        errors++;
+    }
+    if (evaluator_best(ev, net) != BEST
+            || memcmp(net->params, params[BEST],
+                      net->n_params * sizeof(float))) {
+        printf("best epoch %d instead of %d\n", ev->best_epoch, BEST);
+        errors++;
+    }
+    evaluator_destroy(ev);
+    reset();
+
+    if (evaluator_create(net, score, NULL, -1)) {
+        printf("evaluator with a negative patience created\n");
+        errors++;
+    }
+    destroy_network(net);
+    printf("%d errors\n", errors);
+    return errors != 0;
+}
@@ -0,0 +1,142 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "neuron.h"
+#include "mem.h"
+
+#define HUGE_PAGE (2 << 20)
+#define SIZE (3 << 20)      /* more than a huge page, not a multiple */
+
+static int errors;
+
+/* check_list: a sysfs list of nodes must give exactly the nodes in want */
+static void check_list(const char *list, int n, int *want)
+{
+    int nodes[8], got = mem_parse_nodes(list, nodes, 8), i;
+
+    for (i = 0; i < n && i < got && nodes[i] == want[i]; i++)
+        ;
+    if (got != n || i < n) {
+        printf("\"%s\": %d nodes instead of %d\n", list, got, n);
+        errors++;
+    }
+}
+
+/* check_alloc: a block allocated with the given flags and node must be
+ * aligned, fully usable, and accounted for */
+static void check_alloc(int flags, int node)
+{
+    char *p = mem_alloc_on(SIZE, flags, node);
+
+    if (!p) {
+        printf("flags %d, node %d: no block\n", flags, node);
+        errors++;
+        return;
+    }
+    memset(p, 1, SIZE);
+    if ((uintptr_t)p % 64 || mem_usable_size(p) != SIZE
+            || mem_overhead(p) < 64
+            /* mapped blocks start with their header at a page */
+            || (flags && ((uintptr_t)p - 64) % HUGE_PAGE)
+            || (!flags && node != MEM_NODE_ANY
+                && ((uintptr_t)p - 64) % 4096)) {
+        printf("flags %d, node %d: block at %p of %zu bytes, %zu more\n",
+               flags, node, (void *)p, mem_usable_size(p),
+               mem_overhead(p));
+        errors++;
+    }
+    mem_free(p);
+}
+
+/* same: whether two networks have the same weights and biases */
+static int same(struct network *a, struct network *b)
+{
+    return a->n_params == b->n_params
+           && !memcmp(a->params, b->params, a->n_params * sizeof(float));
+}
+
+static void check_replicas(void)
+{
+    int sizes[3] = { 20, 30, 5 }, nodes[64], n = mem_nodes(nodes, 64), i;
+    struct network *net = create_network(3, sizes), *local;
+    struct network_replicas *r = network_replicate(net, MEM_HUGEPAGES), fake;
+
+    if (r->n_nodes != n || n != mem_n_nodes()) {
+        printf("%d replicas for %d nodes\n", r->n_nodes, n);
+        errors++;
+    }
+    for (i = 0; i < r->n_nodes; i++)
+        if (r->nodes[i] != nodes[i] || !same(r->nets[i], net)) {
+            printf("replica %d of node %d\n", i, r->nodes[i]);
+            errors++;
+        }
+    net->params[0] += 1;
+    net->params[net->n_params - 1] -= 1;
+    network_replicas_update(r, net);
+    for (i = 0; i < r->n_nodes; i++)
+        if (!same(r->nets[i], net)) {
+            printf("replica of node %d not updated\n", r->nodes[i]);
+            errors++;
+        }
+    local = network_local_replica(r);
+    for (i = 0; i < r->n_nodes && r->nets[i] != local; i++)
+        ;
+    if (i == r->n_nodes) {
+        printf("local replica not among the replicas\n");
+        errors++;
+    }
+
+    /* nodes 5 and the current one, as if the current one were not the
+     * second of contiguous nodes */
+    fake.n_nodes = 2;
+    fake.nodes = (int[]){ mem_current_node() + 5, mem_current_node() };
+    fake.nets = (struct network *[]){ r->nets[0], net };
+    if (network_local_replica(&fake) != net) {
+        printf("local replica of another node\n");
+        errors++;
+    }
+    fake.nodes[1] += 1;
+    if (network_local_replica(&fake) != r->nets[0]) {
+        printf("no fallback to the first replica\n");
+        errors++;
+    }
+    network_replicas_destroy(r);
+    destroy_network(net);
+}
+
+int main()
+{
+    int flags[3] = { 0, MEM_HUGEPAGES, MEM_HUGETLB };
+    int nodes[3] = { MEM_NODE_ANY, MEM_NODE_LOCAL, 0 };
+    int f, n, policy_flags, policy_node;
+    char *p;
+
+    check_list("0", 1, (int[]){ 0 });
+    check_list("3\n", 1, (int[]){ 3 });
+    check_list("0-3\n", 4, (int[]){ 0, 1, 2, 3 });
+    check_list("0,2\n", 2, (int[]){ 0, 2 });
+    check_list("1-2,5,7-8", 5, (int[]){ 1, 2, 5, 7, 8 });
+    check_list("", 0, NULL);
+    check_list("3-1", 0, NULL);
+
+    for (f = 0; f < 3; f++)
+        for (n = 0; n < 3; n++)
+            check_alloc(flags[f], nodes[n]);
+
+    mem_set_policy(MEM_HUGEPAGES, 0);
+    mem_get_policy(&policy_flags, &policy_node);
+    p = mem_alloc(SIZE);
+    if (policy_flags != MEM_HUGEPAGES || policy_node != 0 || !p
+            || ((uintptr_t)p - 64) % HUGE_PAGE) {
+        printf("policy %d, node %d: block at %p\n", policy_flags,
+               policy_node, (void *)p);
+        errors++;
+    }
+    mem_free(p);
+    mem_set_policy(0, MEM_NODE_ANY);
+
+    check_replicas();
+    printf("%d errors\n", errors);
+    return errors != 0;
+}
@@ -0,0 +1,229 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "neuron.h"
+#include "model.h"
+
+#define READERS 3
+#define UPDATES 2000
+#define PUBLISH_EVERY 500   /* a reload among the updates */
+
+static int errors;
+static struct model *model;
+static atomic_int done;
+
+/* reader: every version must be whole, its weights and biases all equal
+ * to its number, and the versions must never go back */
+static void *reader(void *arg)
+{
+    struct model_version *v;
+    struct network *nets[3] = { NULL, NULL, NULL };
+    int ticket, last = -1, n_nets = 0, k;
+    long i, reads = 0;
+
+    while (!atomic_load(&done) || reads == 0) {
+        v = model_acquire(model, &ticket);
+        for (i = 0; i < v->net->n_params; i++)
+            if (v->net->params[i] != v->version)
+                break;
+        if (i < v->net->n_params) {
+            printf("version %d: %g at %ld\n", v->version,
+                   v->net->params[i], i);
+            errors++;
+        }
+        if (v->version < last) {
+            printf("version %d after %d\n", v->version, last);
+            errors++;
+        }
+        last = v->version;
+        /* before the first reload, only the first version and the spare
+         * are ever updated */
+        for (k = 0; k < n_nets && nets[k] != v->net; k++)
+            ;
+        if (k == n_nets && v->version < PUBLISH_EVERY && n_nets < 3)
+            nets[n_nets++] = v->net;
+        model_release(model, ticket);
+        reads++;
+    }
+    if (n_nets > 2) {
+        printf("%d copies of the network updated\n", n_nets);
+        errors++;
+    }
+    return NULL;
+}
+
+static void fill(struct network *net, float value)
+{
+    long i;
+    for (i = 0; i < net->n_params; i++)
+        net->params[i] = value;
+}
+
+static pthread_mutex_t reload_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reload_cond = PTHREAD_COND_INITIALIZER;
+static int reload_status, reloaded;
+
+static void reload_done(struct model *model, int status)
+{
+    pthread_mutex_lock(&reload_lock);
+    reload_status = status;
+    reloaded = 1;
+    pthread_cond_broadcast(&reload_cond);
+    pthread_mutex_unlock(&reload_lock);
+}
+
+/* file_crc: the CRC-32 of a whole file */
+static unsigned int file_crc(char *path)
+{
+    char buf[4096];
+    unsigned int crc = 0;
+    ssize_t r;
+    int fd = open(path, O_RDONLY);
+
+    while ((r = read(fd, buf, sizeof(buf))) > 0)
+        crc = model_crc32(crc, buf, r);
+    close(fd);
+    return crc;
+}
+
+/* check_version: the current version must have the given number and the
+ * weights and biases of want */
+static void check_version(struct model *m, int version, struct network *want)
+{
+    struct model_version *v;
+    int ticket;
+
+    v = model_acquire(m, &ticket);
+    if (v->version != version || memcmp(v->net->params, want->params,
+                                        want->n_params * sizeof(float))) {
+        printf("version %d instead of %d\n", v->version, version);
+        errors++;
+    }
+    model_release(m, ticket);
+}
+
+/* check_reload: reloads of a model from files, synchronous and not */
+static void check_reload(void)
+{
+    int sizes[3] = { 30, 50, 10 }, bad_sizes[3] = { 30, 51, 10 }, ticket;
+    struct network *a = create_network(3, sizes), *b = network_clone(a, 0, -1);
+    struct network *bad = create_network(3, bad_sizes), *held;
+    struct model_version *v;
+    char path_a[64], path_b[64], path_bad[64];
+    struct model *m;
+    unsigned int crc_b;
+
+    snprintf(path_a, sizeof(path_a), "/tmp/model_test-%d-a.net",
+             (int)getpid());
+    snprintf(path_b, sizeof(path_b), "/tmp/model_test-%d-b.net",
+             (int)getpid());
+    snprintf(path_bad, sizeof(path_bad), "/tmp/model_test-%d-bad.net",
+             (int)getpid());
+    fill(a, 1);
+    fill(b, 2);
+    network_save_to_file(a, path_a);
+    network_save_to_file(b, path_b);
+    network_save_to_file(bad, path_bad);
+    crc_b = file_crc(path_b);
+    m = model_create(path_a);
+
+    /* another topology, or another CRC, keep the current version */
+    if (model_reload(m, path_bad, 0) == 0) {
+        printf("reload of another topology published\n");
+        errors++;
+    }
+    if (model_reload(m, path_b, crc_b + 1) == 0) {
+        printf("reload with a bad CRC published\n");
+        errors++;
+    }
+    check_version(m, 0, a);
+
+    /* a reader holding the current version keeps it whole until it
+     * releases it, and the reload only finishes then */
+    v = model_acquire(m, &ticket);
+    held = v->net;
+    if (model_reload_async(m, path_b, crc_b, reload_done) < 0) {
+        printf("could not start an asynchronous reload\n");
+        errors++;
+    }
+    usleep(50000);
+    pthread_mutex_lock(&reload_lock);
+    if (reloaded) {
+        printf("reload finished while the old version was held\n");
+        errors++;
+    }
+    pthread_mutex_unlock(&reload_lock);
+    if (v->version != 0 || v->net != held
+            || memcmp(held->params, a->params, a->n_params * sizeof(float))) {
+        printf("held version changed during the reload\n");
+        errors++;
+    }
+    model_release(m, ticket);
+    pthread_mutex_lock(&reload_lock);
+    while (!reloaded)
+        pthread_cond_wait(&reload_cond, &reload_lock);
+    pthread_mutex_unlock(&reload_lock);
+    if (reload_status != 0) {
+        printf("asynchronous reload failed\n");
+        errors++;
+    }
+    check_version(m, 1, b);
+    v = model_acquire(m, &ticket);
+    if (v->checksum != crc_b) {
+        printf("checksum %08x instead of %08x\n", v->checksum, crc_b);
+        errors++;
+    }
+    model_release(m, ticket);
+
+    model_destroy(m);
+    unlink(path_a);
+    unlink(path_b);
+    unlink(path_bad);
+    destroy_network(a);
+    destroy_network(b);
+    destroy_network(bad);
+}
+
+int main()
+{
+    int sizes[3] = { 30, 50, 10 }, bad_sizes[3] = { 30, 51, 10 };
+    struct network *net = create_network(3, sizes), *bad, *copy;
+    pthread_t threads[READERS];
+    int i;
+
+    check_reload();
+
+    fill(net, 0);
+    model = model_create_from_network(net);
+    atomic_init(&done, 0);
+    for (i = 0; i < READERS; i++)
+        pthread_create(&threads[i], NULL, reader, NULL);
+    for (i = 1; i <= UPDATES; i++) {
+        fill(net, i);
+        if (i % PUBLISH_EVERY) {
+            model_update(model, net);
+        } else {
+            copy = network_clone(net, 0, -1);
+            model_publish(model, copy, 0);
+        }
+        if (i % 64 == 0)
+            sched_yield();
+    }
+    atomic_store(&done, 1);
+    for (i = 0; i < READERS; i++)
+        pthread_join(threads[i], NULL);
+
+    bad = create_network(3, bad_sizes);
+    if (model_update(model, bad) == 0) {
+        printf("update of another topology published\n");
+        errors++;
+    }
+    destroy_network(bad);
+    model_destroy(model);
+    destroy_network(net);
+    printf("%d errors\n", errors);
+    return errors != 0;
+}
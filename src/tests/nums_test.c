@@ -3,6 +3,8 @@
 #include <fcntl.h>
 #include "neuron.h"
 #include "matrix.h"
+#include "trace.h"
+#include "eval.h"
 
 #undef RAND_MAX
 #define RAND_MAX 59999
@@ -20,6 +22,7 @@ static float training_labels[60000][10];
 static float training_images[60000][784];
 static float testing_labels[10000][10];
 static float testing_images[10000][784];
+static struct train_stats stats;
 
 void get_images_labels()
 {
@@ -62,26 +65,44 @@ void get_images_labels()
     printf("[OK]\n");
 }
 
-void test(struct network *net, int epoch) {
+/* score: classify the test images with a snapshot of the network, while
+ * the next epoch trains */
+double score(struct network *snap, int epoch, void *arg)
+{
     int i;
     int hits = 0;
-    static maxhits = 0;
-    float output[net->layers[net->n_layers-1]->n_neurons];
+    static int maxhits = 0;
+    static int labels[10000];
+    network_classify(snap, 10000, testing_images, labels, 1, NULL, 0);
     for (i = 0; i < 10000; i++) {
-        feedforward(net, testing_images[i], output);
-        if (testing_labels[i][max_index(10, output)] == 1)
+        if (testing_labels[i][labels[i]] == 1)
             hits++;
     }
     if (hits > maxhits) {
         maxhits = hits;
-        network_save_to_file(net, "mynet.net");
+        network_save_to_file(snap, "mynet.net");
     }
     printf("Epoch %d: %d / 10000 (%.2f%%)\n", epoch, hits,(float)hits/100);
+    return -hits;
+}
+
+void test(struct network *net, int epoch) {
+    printf("  training: loss %.5f, %.2f%% hits\n",
+           train_loss_mean(&net->epoch_loss),
+           100 * train_loss_accuracy(&net->epoch_loss));
+    train_stats_print(stdout, net->stats);
+}
+
+void progress(struct network *net, struct train_stats *stats)
+{
+    printf("  %ld samples, %.0f samples/s, loss %.5f\n", stats->samples,
+           train_stats_samples_per_sec(stats), stats->running_loss);
 }
 
 int main(int argc, char *argv[])
 {
     struct network *net;
+    struct evaluator *ev;
     get_images_labels();
     int net_structure[3] = {784, 30, 10};
 
@@ -89,6 +110,15 @@ int main(int argc, char *argv[])
     net = create_network(3, net_structure);
     network_load_from_file(net, "mynet.net");
     printf("[OK]\n");
+    network_set_stats(net, &stats, 1000, progress);
+    ev = evaluator_create(net, score, NULL, 0);
+    network_set_evaluator(net, ev);
+    /* nums_test trace.json: keep a timeline of the last spans */
+    if (argc > 1)
+        trace_start(0);
     network_SGD(net, 60000, BATCH_SIZE, EPOCHES, training_images,
                 training_labels, 10, test);
+    if (argc > 1)
+        trace_dump(argv[1]);
+    evaluator_destroy(ev);
 }
@@ -0,0 +1,152 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "neuron.h"
+#include "pipeline.h"
+
+#define N_SAMPLES 100
+
+static int errors;
+
+struct producer {
+    struct pipeline *p;
+    float *input;
+    int micro;
+};
+
+/* compare: the outputs of the pipeline must be those of feedforward_batch,
+ * bit for bit, since both compute every layer with feedforward_layer */
+static void compare(const char *what, struct network *net, float *got,
+                    float *want)
+{
+    int n_out = net->layers[net->n_layers-1]->n_neurons;
+
+    if (memcmp(got, want, N_SAMPLES * n_out * sizeof(float)) != 0) {
+        printf("%s: outputs differ\n", what);
+        errors++;
+    }
+}
+
+static void *produce(void *arg)
+{
+    struct producer *pr = arg;
+    int n_in = pr->p->net->layers[0]->n_neurons, i, n;
+
+    for (i = 0; i < N_SAMPLES; i += n) {
+        n = N_SAMPLES - i < pr->micro ? N_SAMPLES - i : pr->micro;
+        pipeline_submit(pr->p, n, pr->input + i * n_in, (void *)(long)i);
+    }
+    return NULL;
+}
+
+static void check(int n_layers, int *sizes, int stages, int micro)
+{
+    struct network *net = create_network(n_layers, sizes);
+    int n_in = sizes[0], n_out = sizes[n_layers-1], i, n;
+    float *input = malloc(N_SAMPLES * n_in * sizeof(float));
+    float *want = malloc(N_SAMPLES * n_out * sizeof(float));
+    float *got = malloc(N_SAMPLES * n_out * sizeof(float));
+    struct producer pr;
+    struct pipeline *p;
+    pthread_t thread;
+    void *tag;
+    char what[64];
+
+    for (i = 0; i < N_SAMPLES * n_in; i++)
+        input[i] = (float)rand() / RAND_MAX;
+    feedforward_batch(net, N_SAMPLES, (float (*)[n_in])input,
+                      (float (*)[n_out])want, NULL);
+    p = pipeline_create(net, stages, micro);
+    snprintf(what, sizeof(what), "%d stages, micro-batch %d", stages, micro);
+
+    memset(got, 0, N_SAMPLES * n_out * sizeof(float));
+    pipeline_run(p, N_SAMPLES, input, got);
+    compare(what, net, got, want);
+
+    /* from another thread, in order */
+    pr.p = p;
+    pr.input = input;
+    pr.micro = micro;
+    memset(got, 0, N_SAMPLES * n_out * sizeof(float));
+    pthread_create(&thread, NULL, produce, &pr);
+    for (i = 0; i < N_SAMPLES; i += n) {
+        n = pipeline_receive(p, got + i * n_out, &tag);
+        if ((long)tag != i) {
+            printf("%s: tag %ld after %d samples\n", what, (long)tag, i);
+            errors++;
+        }
+    }
+    pthread_join(thread, NULL);
+    compare(what, net, got, want);
+
+    pipeline_rebalance(p);
+    memset(got, 0, N_SAMPLES * n_out * sizeof(float));
+    pipeline_run(p, N_SAMPLES, input, got);
+    compare(what, net, got, want);
+    pipeline_stats_print(stdout, p);
+
+    pipeline_destroy(p);
+    free(input);
+    free(want);
+    free(got);
+    destroy_network(net);
+}
+
+/* check_balance: a layer far more costly than the rest gets a stage of its
+ * own */
+static void check_balance(void)
+{
+    int sizes[7] = { 16, 16, 16, 16, 16, 2000, 1 };
+    struct network *net = create_network(7, sizes);
+    struct pipeline *p = pipeline_create(net, 3, 8);
+    int i;
+
+    for (i = 0; i < p->n_stages; i++)
+        if (p->stages[i].first <= 5 && p->stages[i].last >= 5
+                && p->stages[i].first != p->stages[i].last) {
+            printf("layer 5 shares stage %d: layers %d-%d\n", i,
+                   p->stages[i].first, p->stages[i].last);
+            pipeline_stats_print(stdout, p);
+            errors++;
+        }
+    pipeline_destroy(p);
+    destroy_network(net);
+}
+
+/* check_in_flight: a pipeline can be destroyed with outputs nobody took,
+ * up to every queue full */
+static void check_in_flight(int stages, int micro_batches)
+{
+    int sizes[5] = { 8, 16, 16, 16, 4 }, i;
+    struct network *net = create_network(5, sizes);
+    struct pipeline *p = pipeline_create(net, stages, 2);
+    float input[2 * 8] = { 0 };
+
+    for (i = 0; i < micro_batches; i++)
+        pipeline_submit(p, 2, input, NULL);
+    pipeline_destroy(p);
+    destroy_network(net);
+}
+
+int main()
+{
+    int deep[8] = { 30, 64, 64, 64, 64, 64, 64, 5 };
+    int shallow[2] = { 10, 3 };
+
+    check(8, deep, 1, 1);
+    check(8, deep, 3, 7);
+    check(8, deep, 4, 16);
+    check(8, deep, 20, 4);
+    check(2, shallow, 2, 3);
+    check_balance();
+    /* a hang is reported by the alarm */
+    alarm(60);
+    check_in_flight(2, 1);
+    check_in_flight(2, 3 * PIPELINE_SLOTS);
+    check_in_flight(4, 5 * PIPELINE_SLOTS);
+    alarm(0);
+    printf("%d errors\n", errors);
+    return errors != 0;
+}
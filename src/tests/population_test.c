@@ -0,0 +1,158 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "neuron.h"
+#include "population.h"
+#include "compare.h"
+
+#define N_NETS 5
+#define N_IN 12
+#define N_OUT 3
+#define TRAIN 40
+#define BATCH 8
+#define EPOCHS 2
+#define TOLERANCE 1e-4
+
+static int errors;
+static int calls[N_NETS];
+static struct network *nets[N_NETS];
+
+/* compare: n values against the reference, relative to its largest */
+static void compare(int net, int threads, long n, float *got, float *want)
+{
+    long worst;
+
+    if (!compare_relative(n, got, want, TOLERANCE, &worst)) {
+        printf("net %d, %d threads: %g instead of %g at %ld\n", net, threads,
+               got[worst], want[worst], worst);
+        errors++;
+    }
+}
+
+static void count(struct network *net, int epoch)
+{
+    int k;
+
+    for (k = 0; k < N_NETS; k++)
+        if (nets[k] == net)
+            calls[k]++;
+}
+
+/* check_frozen: the frozen layers of the network must be as those of the
+ * reference, which training leaves as they were */
+static void check_frozen(int k, int threads, struct network *ref)
+{
+    int l;
+    size_t size;
+
+    for (l = 1; l < ref->n_layers; l++) {
+        size = (size_t)(ref->layers[l-1]->n_neurons + 1)
+               * ref->layers[l]->n_neurons * sizeof(float);
+        if (!ref->layers[l]->trainable && memcmp(nets[k]->weights[l][0],
+                                                 ref->weights[l][0], size)) {
+            printf("net %d, %d threads: frozen layer %d changed\n", k,
+                   threads, l);
+            errors++;
+        }
+    }
+}
+
+/* check: every network of the population must be trained as it would be
+ * on its own, with the same minibatches. If frozen, some layers of each
+ * network are, and all of those of network 2 */
+static void check(int threads, int frozen)
+{
+    int sizes[N_NETS][4] = {
+        { N_IN, 20, N_OUT }, { N_IN, 7, 9, N_OUT }, { N_IN, 20, N_OUT },
+        { N_IN, 33, N_OUT }, { N_IN, 1, 5, N_OUT }
+    };
+    int layers[N_NETS] = { 3, 4, 3, 3, 4 };
+    float eta[N_NETS] = { 0.5, 1.0, 0.1, 2.0, 0.3 };
+    int masks[N_NETS] = { 1 << 2, 1 << 1, 1 << 1 | 1 << 2, 1 << 1, 1 << 2 };
+    float input[TRAIN][N_IN], output[TRAIN][N_OUT];
+    struct network *ref[N_NETS];
+    struct population *p;
+    int i, j, k, l, epoch;
+
+    for (i = 0; i < TRAIN; i++)
+        for (j = 0; j < N_IN; j++)
+            input[i][j] = (float)rand() / RAND_MAX;
+    for (i = 0; i < TRAIN; i++)
+        for (j = 0; j < N_OUT; j++)
+            output[i][j] = rand() % 2;
+    for (k = 0; k < N_NETS; k++) {
+        nets[k] = create_network(layers[k], sizes[k]);
+        for (l = 1; frozen && l < layers[k]; l++)
+            network_set_trainable(nets[k], l, !(masks[k] & 1 << l));
+        ref[k] = network_clone(nets[k], 0, -1);
+        calls[k] = 0;
+    }
+    p = population_create(N_NETS, nets, eta, threads);
+    /* one epoch at a time, so that the order of the samples is known */
+    for (epoch = 0; epoch < EPOCHS; epoch++) {
+        population_SGD(p, TRAIN, BATCH, 1, &input[0][0], &output[0][0],
+                       count);
+        for (k = 0; k < N_NETS; k++) {
+            train_loss_reset(&ref[k]->epoch_loss);
+            for (i = 0; i + BATCH <= TRAIN; i += BATCH)
+                network_update_minibatch(ref[k], BATCH, input, output,
+                                         eta[k], i);
+            /* the loss of the epoch, as training on its own */
+            if (nets[k]->epoch_loss.samples != ref[k]->epoch_loss.samples
+                    || nets[k]->epoch_loss.hits != ref[k]->epoch_loss.hits
+                    || fabs(nets[k]->epoch_loss.cost
+                            - ref[k]->epoch_loss.cost) > TOLERANCE) {
+                printf("net %d, %d threads: loss %g of %ld, %ld hits " \
+                       "instead of %g of %ld, %ld hits\n", k, threads,
+                       nets[k]->epoch_loss.cost, nets[k]->epoch_loss.samples,
+                       nets[k]->epoch_loss.hits, ref[k]->epoch_loss.cost,
+                       ref[k]->epoch_loss.samples, ref[k]->epoch_loss.hits);
+                errors++;
+            }
+        }
+    }
+    for (k = 0; k < N_NETS; k++) {
+        compare(k, threads, nets[k]->n_params, nets[k]->params,
+                ref[k]->params);
+        check_frozen(k, threads, ref[k]);
+        if (calls[k] != EPOCHS) {
+            printf("net %d, %d threads: %d calls instead of %d\n", k,
+                   threads, calls[k], EPOCHS);
+            errors++;
+        }
+        if (!(p->loss[k] > 0)) {
+            printf("net %d, %d threads: loss %g\n", k, threads, p->loss[k]);
+            errors++;
+        }
+    }
+    population_destroy(p);
+    for (k = 0; k < N_NETS; k++) {
+        destroy_network(ref[k]);
+        destroy_network(nets[k]);
+    }
+}
+
+int main()
+{
+    int sizes[2][3] = { { N_IN, 4, N_OUT }, { N_IN + 1, 4, N_OUT } };
+    float eta[2] = { 1, 1 };
+    struct network *bad[2];
+    int threads;
+
+    for (threads = 1; threads <= 4; threads++) {
+        check(threads, 0);
+        check(threads, 1);
+    }
+    /* the inputs must be the same for all */
+    bad[0] = create_network(3, sizes[0]);
+    bad[1] = create_network(3, sizes[1]);
+    if (population_create(2, bad, eta, 1)) {
+        printf("population of different inputs created\n");
+        errors++;
+    }
+    destroy_network(bad[0]);
+    destroy_network(bad[1]);
+    printf("%d errors\n", errors);
+    return errors != 0;
+}
@@ -0,0 +1,130 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "neuron.h"
+#include "ps.h"
+
+#define WORKERS 3
+#define STALENESS 4
+#define N_SAMPLES 600
+#define BATCH_SIZE 10
+#define EPOCHS 10
+
+static float input[N_SAMPLES][8], output[N_SAMPLES][4];
+static int sizes[3] = { 8, 16, 4 };
+static char path[64];
+
+static float cost(struct network *net, int n, float in[][8], float out[][4])
+{
+    static float result[N_SAMPLES][4];
+    int i;
+
+    for (i = 0; i < n; i++)
+        feedforward(net, in[i], result[i]);
+    return cost_function_batch(4, n, result, out);
+}
+
+/* server: the cost on all the samples must go down, and the pushes add up */
+static int server(void)
+{
+    struct network *net;
+    struct ps_stats stats;
+    float before, after;
+    long accepted = 0;
+    int i, errors = 0;
+
+    srand(1);
+    net = create_network(3, sizes);
+    before = cost(net, N_SAMPLES, input, output);
+    if (ps_serve(net, path, STALENESS, WORKERS, &stats) < 0)
+        return 1;
+    after = cost(net, N_SAMPLES, input, output);
+    printf("server: cost from %g to %g\n  ", before, after);
+    ps_stats_print(stdout, &stats);
+    for (i = 0; i < PS_HIST; i++)
+        accepted += stats.staleness[i];
+    if (!(after < 0.5 * before) || stats.pushes != accepted + stats.stale
+            || stats.pushes != WORKERS * EPOCHS
+                               * (N_SAMPLES / WORKERS / BATCH_SIZE)) {
+        printf("server: %ld pushes, %ld accepted, %ld stale\n",
+               stats.pushes, accepted, stats.stale);
+        errors++;
+    }
+    destroy_network(net);
+    return errors;
+}
+
+/* worker: trains on its third of the samples, sending at most max_bytes
+ * per push */
+static int worker(int rank, int encoding, float density, double max_bytes)
+{
+    struct network *net;
+    struct ps_worker *w;
+    int n = N_SAMPLES / WORKERS, errors = 0;
+
+    srand(rank + 2);
+    net = create_network(3, sizes);
+    if (!(w = ps_connect(path, net, encoding, density))
+            || ps_SGD(w, n, BATCH_SIZE, EPOCHS, input + rank * n,
+                      output + rank * n, 3.0) < 0)
+        return 1;
+    printf("worker %d: ", rank);
+    ps_stats_print(stdout, &w->stats);
+    if (w->stats.push_bytes / w->stats.pushes > max_bytes) {
+        printf("worker %d: %.0f bytes per push\n", rank,
+               w->stats.push_bytes / w->stats.pushes);
+        errors++;
+    }
+    ps_disconnect(w);
+    destroy_network(net);
+    return errors;
+}
+
+/* run: a server and its workers, each in a process of its own */
+static int run(const char *what, int encoding, float density,
+               double max_bytes)
+{
+    pid_t pids[WORKERS + 1];
+    int i, status, errors = 0;
+
+    printf("%s\n", what);
+    fflush(stdout);
+    if ((pids[0] = fork()) == 0) {
+        alarm(60);
+        exit(server());
+    }
+    for (i = 0; i < WORKERS; i++)
+        if ((pids[i + 1] = fork()) == 0) {
+            alarm(60);
+            exit(worker(i, encoding, density, max_bytes));
+        }
+    for (i = 0; i <= WORKERS; i++) {
+        waitpid(pids[i], &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status))
+            errors++;
+    }
+    fflush(stdout);
+    return errors;
+}
+
+int main()
+{
+    long n_params = 8 * 16 + 16 + 16 * 4 + 4;
+    int i, k, errors = 0;
+
+    for (i = 0; i < N_SAMPLES; i++) {
+        for (k = 0; k < 8; k++)
+            input[i][k] = (float)rand() / RAND_MAX;
+        for (k = 0; k < 4; k++)
+            output[i][k] = input[i][2 * k] > input[i][2 * k + 1];
+    }
+    snprintf(path, sizeof(path), "/tmp/neurotic-ps-test-%d.sock",
+             (int)getpid());
+    errors += run("dense", PS_DENSE, 0, 32 + 4 * n_params);
+    errors += run("sparse", PS_SPARSE, 0.1, 32 + 8 * (n_params / 10));
+    errors += run("q8", PS_Q8, 0, 32 + 4 + n_params);
+    printf("%d errors\n", errors);
+    return errors != 0;
+}
@@ -0,0 +1,68 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "neuron.h"
+#include "registry.h"
+
+#define N_MODELS 20
+#define N_SAMPLES 100
+
+/* Registers the same network under many names, runs inference through the
+ * registry from all of them, and compares the results with feedforward */
+int main()
+{
+    struct pool *pool = pool_create(0);
+    struct registry *reg = registry_create(N_MODELS, pool);
+    struct network *net = network_create_from_file("mynet.net");
+    static float input[N_SAMPLES][784], output[N_SAMPLES][10];
+    float expected[10];
+    struct registry_entry *entry;
+    char name[32], other[64];
+    int i, j, k, errors = 0;
+
+    for (i = 0; i < N_SAMPLES; i++)
+        for (j = 0; j < 784; j++)
+            input[i][j] = (float)rand() / (float)RAND_MAX;
+    for (i = 0; i < N_MODELS; i++) {
+        sprintf(name, "model%d", i);
+        if (registry_add(reg, name, "mynet.net") < 0)
+            errors++;
+    }
+    if (registry_add(reg, "model0", "mynet.net") == 0)
+        errors++;
+    if (registry_lookup(reg, "nonexistent"))
+        errors++;
+    /* the same network, but for one weight, is not shared */
+    snprintf(other, sizeof(other), "/tmp/registry_test-%d.net",
+             (int)getpid());
+    net->weights[1][0][0] += 1;
+    network_save_to_file(net, other);
+    net->weights[1][0][0] -= 1;
+    if (registry_add(reg, "other", other) < 0)
+        errors++;
+    unlink(other);
+    entry = registry_lookup(reg, "model0");
+    if (!entry || entry->weights->refs != N_MODELS)
+        errors++;
+    entry = registry_lookup(reg, "other");
+    if (!entry || entry->weights->refs != 1
+            || entry->weights->net->weights[1][0][0]
+               != net->weights[1][0][0] + 1)
+        errors++;
+    for (i = 0; i < N_MODELS; i++) {
+        sprintf(name, "model%d", i);
+        registry_infer(reg, name, N_SAMPLES, &input[0][0], &output[0][0]);
+        for (j = 0; j < N_SAMPLES; j++) {
+            feedforward(net, input[j], expected);
+            for (k = 0; k < 10; k++)
+                if (output[j][k] != expected[k])
+                    errors++;
+        }
+    }
+    registry_report(reg, stdout);
+    printf("%d errors\n", errors);
+    registry_destroy(reg);
+    pool_destroy(pool);
+    destroy_network(net);
+    return errors != 0;
+}
@@ -0,0 +1,162 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "neuron.h"
+#include "sampler.h"
+
+#define N 200
+#define N_IN 8
+#define N_OUT 2
+#define BATCH 10
+#define DRAWS 400000
+#define MIX 0.2
+
+static int errors;
+
+/* check_update: network_update_sampled must match network_update_minibatch
+ * on consecutive samples, and weighting a sample by 2 must be the same as
+ * drawing it twice */
+static void check_update(float input[N][N_IN], float output[N][N_OUT])
+{
+    int sizes[3] = { N_IN, 15, N_OUT }, samples[BATCH], twice[BATCH], i;
+    float weights[BATCH], ones[BATCH], losses[BATCH], out[N_OUT], cost;
+    struct network *net = create_network(3, sizes);
+    struct network *ref = network_clone(net, 0, -1);
+
+    for (i = 0; i < BATCH; i++) {
+        samples[i] = 7 + i;
+        ones[i] = 1;
+    }
+    network_update_sampled(net, BATCH, input, output, samples, ones, 0.5,
+                           losses);
+    /* the costs are those before the update */
+    for (i = 0; i < BATCH; i++) {
+        feedforward(ref, input[samples[i]], out);
+        cost = cost_function(N_OUT, out, output[samples[i]]);
+        if (losses[i] != cost) {
+            printf("cost of sample %d: %g instead of %g\n", samples[i],
+                   losses[i], cost);
+            errors++;
+        }
+    }
+    network_update_minibatch(ref, BATCH, input, output, 0.5, 7);
+    if (memcmp(net->params, ref->params, net->n_params * sizeof(float))) {
+        printf("network_update_sampled differs from " \
+               "network_update_minibatch\n");
+        errors++;
+    }
+    /* a single pair, for the sums to be exact */
+    samples[0] = samples[1] = twice[0] = twice[1] = 42;
+    weights[0] = 2;
+    weights[1] = 0;
+    network_update_sampled(net, 2, input, output, samples, weights, 0.5,
+                           NULL);
+    network_update_sampled(ref, 2, input, output, twice, NULL, 0.5, NULL);
+    if (memcmp(net->params, ref->params, net->n_params * sizeof(float))) {
+        printf("a weight of 2 differs from drawing twice\n");
+        errors++;
+    }
+    destroy_network(ref);
+    destroy_network(net);
+}
+
+/* check_draw: the expected weight of a sample in a draw, counting zero if
+ * it is not drawn, must be 1 / n whatever its cost */
+static void check_draw(void)
+{
+    struct sampler *s = sampler_create(N, MIX);
+    int samples[BATCH], i, d, b, worst = 0;
+    float weights[BATCH];
+    double *sum = calloc(N, sizeof(double)), err, max = 0;
+
+    for (i = 0; i < N; i++)
+        sampler_set(s, i, i % 10 == 0 ? 5.0 : 0.01 * (i % 7));
+    for (d = 0; d < DRAWS / BATCH; d++) {
+        sampler_draw(s, BATCH, samples, weights);
+        for (b = 0; b < BATCH; b++) {
+            if (weights[b] > 1 / MIX + 1e-3) {
+                printf("weight %g over 1 / mix\n", weights[b]);
+                errors++;
+                d = DRAWS;
+                break;
+            }
+            sum[samples[b]] += weights[b];
+        }
+    }
+    for (i = 0; i < N; i++) {
+        err = fabs(sum[i] / DRAWS * N - 1);
+        if (err > max) {
+            max = err;
+            worst = i;
+        }
+    }
+    /* a few standard deviations for the rarest samples */
+    if (max > 0.25) {
+        printf("sample %d: mean weight %g instead of %g\n", worst,
+               sum[worst] / DRAWS, 1.0 / N);
+        errors++;
+    }
+    free(sum);
+    sampler_destroy(s);
+}
+
+/* check_training: the costs must go down, and those kept by the sampler
+ * must be those of a screening pass over all the samples */
+static void check_training(float input[N][N_IN], float output[N][N_OUT])
+{
+    int sizes[3] = { N_IN, 10, N_OUT }, i;
+    struct network *net = create_network(3, sizes);
+    struct sampler *s = sampler_create(N, MIX);
+    double before = 0, after = 0, kept = 0;
+
+    sampler_screen(s, net, N, &input[0][0], &output[0][0]);
+    before = s->tree[1];
+    sampler_SGD(s, net, BATCH, 30, &input[0][0], &output[0][0], 2.0, N / 4,
+                NULL);
+    for (i = 0; i < N; i++)
+        kept += s->tree[s->leaves + i];
+    if (fabs(kept - s->tree[1]) > 1e-6 * kept) {
+        printf("sum tree of %g, costs of %g\n", s->tree[1], kept);
+        errors++;
+    }
+    sampler_screen(s, net, N, &input[0][0], &output[0][0]);
+    after = s->tree[1];
+    if (!(after < 0.5 * before)) {
+        printf("cost from %g to %g\n", before, after);
+        errors++;
+    }
+    if (s->backward != 30L * (N / BATCH) * BATCH
+            || s->screened != 2 * N + 30 * (N / 4)) {
+        printf("%ld samples trained on, %ld screened\n", s->backward,
+               s->screened);
+        errors++;
+    }
+    sampler_destroy(s);
+    destroy_network(net);
+}
+
+int main()
+{
+    float input[N][N_IN], output[N][N_OUT];
+    struct sampler *s;
+    int i, j;
+
+    for (i = 0; i < N; i++) {
+        for (j = 0; j < N_IN; j++)
+            input[i][j] = (float)rand() / RAND_MAX;
+        /* mostly easy samples, and some hard ones */
+        output[i][0] = input[i][0] > 0.5;
+        output[i][1] = i % 10 == 0 ? input[i][1] > 0.5 : 0;
+    }
+    check_update(input, output);
+    check_draw();
+    check_training(input, output);
+    if ((s = sampler_create(N, 0))) {
+        printf("sampler with no uniform share created\n");
+        sampler_destroy(s);
+        errors++;
+    }
+    printf("%d errors\n", errors);
+    return errors != 0;
+}
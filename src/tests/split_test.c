@@ -0,0 +1,105 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "neuron.h"
+#include "split.h"
+#include "compare.h"
+
+#define MAX_BATCH 5
+#define TOLERANCE 1e-4
+
+static int errors;
+
+/* compare: n values against the reference, relative to its largest */
+static void compare(const char *what, int threads, int batch, long n,
+                    float *got, float *want)
+{
+    long worst;
+
+    if (!compare_relative(n, got, want, TOLERANCE, &worst)) {
+        printf("%s, %d threads, batch %d: %g instead of %g at %ld\n", what,
+               threads, batch, got[worst], want[worst], worst);
+        errors++;
+    }
+}
+
+/* check_frozen: the layers in the mask frozen must be as they were */
+static void check_frozen(struct network *net, struct network *init,
+                         int frozen, int threads)
+{
+    int l;
+    size_t size;
+
+    for (l = 1; l < net->n_layers; l++) {
+        size = (size_t)(net->layers[l-1]->n_neurons + 1)
+               * net->layers[l]->n_neurons * sizeof(float);
+        if (frozen & 1 << l && memcmp(net->weights[l][0],
+                                      init->weights[l][0], size)) {
+            printf("frozen layer %d, %d threads: changed\n", l, threads);
+            errors++;
+        }
+    }
+}
+
+/* check: the split network must compute the same outputs and updates as
+ * the network itself, with the layers in the mask frozen */
+static void check(int n_layers, int *sizes, int threads, int min_width,
+                  int frozen)
+{
+    int n_in = sizes[0], n_out = sizes[n_layers-1], batch, i, j;
+    struct network *net = create_network(n_layers, sizes);
+    struct network *ref, *init;
+    float input[MAX_BATCH][n_in], output[MAX_BATCH][n_out];
+    float got[MAX_BATCH][n_out], want[MAX_BATCH][n_out];
+    struct split *s;
+
+    for (i = 1; i < n_layers; i++)
+        network_set_trainable(net, i, !(frozen & 1 << i));
+    ref = network_clone(net, 0, -1);
+    init = network_clone(net, 0, -1);
+    s = split_create(net, threads, min_width);
+    for (batch = 1; batch <= MAX_BATCH; batch += MAX_BATCH - 1) {
+        for (i = 0; i < batch; i++)
+            for (j = 0; j < n_in; j++)
+                input[i][j] = (float)rand() / RAND_MAX;
+        for (i = 0; i < batch; i++)
+            for (j = 0; j < n_out; j++)
+                output[i][j] = rand() % 2;
+        split_feedforward(s, batch, &input[0][0], &got[0][0]);
+        feedforward_batch(ref, batch, input, want, NULL);
+        compare("feedforward", threads, batch, batch * n_out, &got[0][0],
+                &want[0][0]);
+        for (i = 0; i < 3; i++) {
+            split_update_minibatch(s, batch, &input[0][0], &output[0][0],
+                                   0.5);
+            network_update_minibatch(ref, batch, input, output, 0.5, 0);
+        }
+        split_store(s);
+        compare("update", threads, batch, net->n_params, net->params,
+                ref->params);
+        check_frozen(net, init, frozen, threads);
+    }
+    split_destroy(s);
+    destroy_network(init);
+    destroy_network(ref);
+    destroy_network(net);
+}
+
+int main()
+{
+    int wide[4] = { 20, 300, 257, 7 };
+    int narrow[3] = { 10, 30, 10 };
+    int threads;
+
+    for (threads = 1; threads <= 4; threads++) {
+        check(4, wide, threads, 100, 0);
+        check(4, wide, threads, 1, 0);
+        check(3, narrow, threads, 100, 0);
+        /* down to the lowest trainable layer, past the frozen ones */
+        check(4, wide, threads, 1, 1 << 1);
+        check(4, wide, threads, 100, 1 << 2 | 1 << 3);
+        check(3, narrow, threads, 1, 1 << 1 | 1 << 2);
+    }
+    printf("%d errors\n", errors);
+    return errors != 0;
+}
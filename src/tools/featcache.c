@@ -0,0 +1,87 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "neuron.h"
+#include "pool.h"
+#include "cache.h"
+#include "io.h"
+
+/* featcache: build a feature cache (see cache.h). Runs the samples of
+ * an input file through the layers of a network saved with
+ * network_save_to_file, up to the given layer (by default the last hidden
+ * one), on all the cores, and writes the activations of that layer to the
+ * output file, as 32 bit floats or, with -e f16, as half precision ones.
+ *
+ * The input is raw native 32 bit floats, one sample after the other, as
+ * read by score -f raw. Training of the layers above then reads the cache
+ * with cache_SGD.
+ */
+
+static void usage(char *prog)
+{
+    fprintf(stderr, "usage: %s [-l layer] [-e f32|f16] [-t threads] " \
+            "model.net input.raw output.feat\n", prog);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    int layer = -1, encoding = CACHE_F32, n_threads = 0, n_in, opt;
+    struct network *net;
+    struct pool *pool;
+    struct stat st;
+    float *input;
+    double start;
+    long n;
+    int fd;
+
+    while ((opt = getopt(argc, argv, "l:e:t:")) != -1) {
+        switch (opt) {
+        case 'l': layer = atoi(optarg); break;
+        case 'e':
+            if (!strcmp(optarg, "f32")) encoding = CACHE_F32;
+            else if (!strcmp(optarg, "f16")) encoding = CACHE_F16;
+            else usage(argv[0]);
+            break;
+        case 't': n_threads = atoi(optarg); break;
+        default: usage(argv[0]);
+        }
+    }
+    if (optind != argc-3)
+        usage(argv[0]);
+    if (!(net = network_create_from_file(argv[optind])))
+        return 1;
+    if (layer < 0)
+        layer = net->n_layers - 2;
+    n_in = net->layers[0]->n_neurons;
+    fd = open(argv[optind+1], O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0 || st.st_size == 0
+            || st.st_size % (n_in * sizeof(float))) {
+        fprintf(stderr, "%s is not a file of samples of %d floats\n",
+                argv[optind+1], n_in);
+        return 1;
+    }
+    n = st.st_size / (n_in * sizeof(float));
+    input = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (input == MAP_FAILED) {
+        fprintf(stderr, "Could not map file %s\n", argv[optind+1]);
+        return 1;
+    }
+    pool = pool_create(n_threads);
+    start = io_now();
+    if (cache_build(net, layer, encoding, n, input, argv[optind+2],
+                    pool) < 0)
+        return 1;
+    fprintf(stderr, "%ld samples, layer %d of %d neurons, %.2f s\n", n,
+            layer, net->layers[layer]->n_neurons, io_now() - start);
+    pool_destroy(pool);
+    munmap(input, st.st_size);
+    destroy_network(net);
+    return 0;
+}
@@ -0,0 +1,142 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "protocol.h"
+#include "io.h"
+
+/* loadgen: load generator for serve. Opens a number of connections, each
+ * one sending random inputs back to back, and reports the throughput and
+ * the latency percentiles of the requests.
+ */
+
+#define DEFAULT_SOCKET "/tmp/neurotic.sock"
+#define DEFAULT_CLIENTS 8
+#define DEFAULT_REQUESTS 1000
+
+struct client {
+    pthread_t thread;
+    int n_requests;
+    double *latencies; /* seconds */
+    int n_done;
+};
+
+static char *path = DEFAULT_SOCKET;
+
+static void *client(void *arg)
+{
+    struct client *c = arg;
+    struct sockaddr_un addr;
+    struct proto_hello hello;
+    struct proto_header header;
+    unsigned int seed = (unsigned int)(long)c;
+    float *input, *output;
+    double start;
+    int fd, i;
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror(path);
+        return NULL;
+    }
+    if (io_read_all(fd, &hello, sizeof(hello)) < 0
+            || hello.magic != PROTO_MAGIC) {
+        fprintf(stderr, "loadgen: bad handshake\n");
+        close(fd);
+        return NULL;
+    }
+    input = malloc(hello.n_in * sizeof(float));
+    output = malloc(hello.n_out * sizeof(float));
+    for (i = 0; i < hello.n_in; i++)
+        input[i] = (float)rand_r(&seed) / (float)RAND_MAX;
+
+    for (c->n_done = 0; c->n_done < c->n_requests; c->n_done++) {
+        header.status = PROTO_OK;
+        header.n_floats = hello.n_in;
+        start = io_now();
+        if (io_write_all(fd, &header, sizeof(header)) < 0
+                || io_write_all(fd, input, hello.n_in * sizeof(float)) < 0
+                || io_read_all(fd, &header, sizeof(header)) < 0
+                || header.status != PROTO_OK
+                || io_read_all(fd, output, header.n_floats * sizeof(float)) < 0) {
+            fprintf(stderr, "loadgen: request failed\n");
+            break;
+        }
+        c->latencies[c->n_done] = io_now() - start;
+        /* vary the input a little between requests */
+        input[c->n_done % hello.n_in] = (float)rand_r(&seed) / (float)RAND_MAX;
+    }
+    free(input);
+    free(output);
+    close(fd);
+    return NULL;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static void usage(char *prog)
+{
+    fprintf(stderr, "usage: %s [-s socket] [-c clients] " \
+            "[-n requests_per_client]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    int n_clients = DEFAULT_CLIENTS, n_requests = DEFAULT_REQUESTS;
+    struct client *clients;
+    double *all, start, elapsed;
+    int opt, i, total;
+
+    while ((opt = getopt(argc, argv, "s:c:n:")) != -1) {
+        switch (opt) {
+        case 's': path = optarg; break;
+        case 'c': n_clients = atoi(optarg); break;
+        case 'n': n_requests = atoi(optarg); break;
+        default: usage(argv[0]);
+        }
+    }
+    if (optind != argc || n_clients < 1 || n_requests < 1)
+        usage(argv[0]);
+
+    clients = calloc(n_clients, sizeof(struct client));
+    start = io_now();
+    for (i = 0; i < n_clients; i++) {
+        clients[i].n_requests = n_requests;
+        clients[i].latencies = malloc(n_requests * sizeof(double));
+        pthread_create(&clients[i].thread, NULL, client, &clients[i]);
+    }
+    for (i = 0; i < n_clients; i++)
+        pthread_join(clients[i].thread, NULL);
+    elapsed = io_now() - start;
+
+    all = malloc(n_clients * n_requests * sizeof(double));
+    for (i = total = 0; i < n_clients; i++) {
+        memcpy(all + total, clients[i].latencies,
+               clients[i].n_done * sizeof(double));
+        total += clients[i].n_done;
+    }
+    if (total == 0) {
+        fprintf(stderr, "loadgen: no request succeeded\n");
+        return 1;
+    }
+    qsort(all, total, sizeof(double), compare_double);
+    printf("%d requests in %.3f s: %.1f requests/s\n", total, elapsed,
+           total / elapsed);
+    printf("latency: p50 %.1f us, p99 %.1f us, max %.1f us\n",
+           all[total / 2] * 1e6, all[(int)(total * 0.99)] * 1e6,
+           all[total-1] * 1e6);
+    return total == n_clients * n_requests ? 0 : 1;
+}
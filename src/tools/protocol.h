@@ -0,0 +1,35 @@
+#ifndef __PROTOCOL__
+#define __PROTOCOL__
+
+#include <stdint.h>
+
+/* Binary protocol spoken by serve and loadgen over a unix domain socket.
+ * All fields are in host byte order, since both ends live on the same
+ * machine.
+ *
+ *   server -> client, on connect:   struct proto_hello
+ *   client -> server:               struct proto_header, n_in floats
+ *   server -> client:               struct proto_header, n_out floats
+ *
+ * A client may send any number of requests over the same connection, one
+ * at a time. In a response, "status" is PROTO_OK or PROTO_ERROR, and no
+ * floats follow an error.
+ */
+
+#define PROTO_MAGIC 0x4e455552 /* "NEUR" */
+
+#define PROTO_OK 0
+#define PROTO_ERROR 1
+
+struct proto_hello {
+    uint32_t magic;
+    uint32_t n_in;
+    uint32_t n_out;
+};
+
+struct proto_header {
+    uint32_t status;
+    uint32_t n_floats;
+};
+
+#endif
@@ -0,0 +1,58 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "neuron.h"
+#include "ps.h"
+
+/* pserver: parameter server (see ps.h). Loads a network saved with
+ * network_save_to_file, serves its parameters to the given number of
+ * workers until all of them have disconnected, and saves the network
+ * trained to the output file (by default, over the input one).
+ *
+ * The traffic and a histogram of the staleness of the updates are written
+ * to stderr at the end.
+ */
+
+#define DEFAULT_SOCKET "/tmp/neurotic-ps.sock"
+#define DEFAULT_STALENESS 4
+
+static void usage(char *prog)
+{
+    fprintf(stderr, "usage: %s [-s socket] [-S staleness] [-w workers] " \
+            "[-o output.net] model.net\n", prog);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    char *path = DEFAULT_SOCKET, *output = NULL;
+    int staleness = DEFAULT_STALENESS, n_workers = 1, opt;
+    struct network *net;
+    struct ps_stats stats;
+
+    while ((opt = getopt(argc, argv, "s:S:w:o:")) != -1) {
+        switch (opt) {
+        case 's': path = optarg; break;
+        case 'S': staleness = atoi(optarg); break;
+        case 'w': n_workers = atoi(optarg); break;
+        case 'o': output = optarg; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (optind != argc-1 || staleness < 0 || n_workers < 1)
+        usage(argv[0]);
+    if (!output)
+        output = argv[optind];
+    if (!(net = network_create_from_file(argv[optind])))
+        return 1;
+    fprintf(stderr, "serving %ld parameters of %s on %s to %d workers, " \
+            "staleness %d\n", net->n_params, argv[optind], path, n_workers,
+            staleness);
+    if (ps_serve(net, path, staleness, n_workers, &stats) < 0)
+        return 1;
+    ps_stats_print(stderr, &stats);
+    if (network_save_to_file(net, output) < 0)
+        return 1;
+    destroy_network(net);
+    return 0;
+}
@@ -0,0 +1,304 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include "neuron.h"
+#include "pool.h"
+#include "trace.h"
+#include "io.h"
+
+/* score: offline batch inference. Reads samples from a file (or stdin),
+ * runs them through a network saved with network_save_to_file on all the
+ * cores, and writes the predicted labels or the full outputs.
+ *
+ * Input formats:
+ *      idx -> IDX file, as in MNIST, of unsigned bytes (scaled to [0, 1])
+ *             or floats. Each sample must have as many values as inputs
+ *             has the network.
+ *      raw -> native 32 bit floats, one sample after the other.
+ *      csv -> one sample per line, values separated by commas or spaces.
+ * Output (to stdout):
+ *      labels -> the topk best labels of each sample
+ *      scores -> the whole output vector of each sample
+ * as text, one sample per line, or with -b as native 32 bit ints (labels)
+ * or floats (scores).
+ *
+ * With -T, a timeline of the run (see trace.h) is written to the given file.
+ */
+
+#define DEFAULT_BATCH 256
+
+enum { FORMAT_IDX, FORMAT_RAW, FORMAT_CSV };
+
+struct reader {
+    FILE *fp;
+    int format;
+    int n_in;
+    int idx_type;       /* 0x08: unsigned byte, 0x0d: float */
+    long remaining;     /* samples left in an IDX file */
+    unsigned char *buf;
+    char *line;
+    size_t line_size;
+    long line_no;
+};
+
+struct job {
+    struct network *net;
+    struct pool *pool;
+    int n, chunk, topk, labels_only;
+    float *input, *output;
+    int *labels;
+};
+
+static uint32_t read_be32(unsigned char *p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16
+           | (uint32_t)p[2] << 8 | p[3];
+}
+
+/* open_idx: read the header of an IDX file and check that its samples fit
+ * the network. Returns -1 on error */
+static int open_idx(struct reader *r)
+{
+    unsigned char header[4], dim[4];
+    long size = 1;
+    int i;
+
+    if (fread(header, 1, 4, r->fp) != 4 || header[0] || header[1]
+            || (header[2] != 0x08 && header[2] != 0x0d) || header[3] < 1) {
+        fprintf(stderr, "score: not an IDX file of bytes or floats\n");
+        return -1;
+    }
+    r->idx_type = header[2];
+    for (i = 0; i < header[3]; i++) {
+        if (fread(dim, 1, 4, r->fp) != 4)
+            return -1;
+        if (i == 0)
+            r->remaining = read_be32(dim);
+        else
+            size *= read_be32(dim);
+    }
+    if (size != r->n_in) {
+        fprintf(stderr, "score: samples have %ld values, but the network " \
+                "has %d inputs\n", size, r->n_in);
+        return -1;
+    }
+    r->buf = malloc(r->n_in * 4);
+    return 0;
+}
+
+/* read_sample: read one sample into x. Returns 1 if a sample was read, 0
+ * at the end of the input and -1 on error */
+static int read_sample(struct reader *r, float *x)
+{
+    uint32_t u;
+    char *p, *end;
+    int i;
+
+    switch (r->format) {
+    case FORMAT_IDX:
+        if (r->remaining == 0)
+            return 0;
+        r->remaining--;
+        if (fread(r->buf, r->idx_type == 0x08 ? 1 : 4, r->n_in, r->fp)
+                != r->n_in)
+            return -1;
+        for (i = 0; i < r->n_in; i++) {
+            if (r->idx_type == 0x08) {
+                x[i] = (float)r->buf[i] / 255;
+            } else {
+                u = read_be32(r->buf + 4*i);
+                memcpy(&x[i], &u, 4);
+            }
+        }
+        return 1;
+    case FORMAT_RAW:
+        i = fread(x, sizeof(float), r->n_in, r->fp);
+        if (i == 0 && feof(r->fp))
+            return 0;
+        return i == r->n_in ? 1 : -1;
+    case FORMAT_CSV:
+        do {
+            if (getline(&r->line, &r->line_size, r->fp) < 0)
+                return 0;
+            r->line_no++;
+            for (p = r->line; *p == ' ' || *p == '\t'; p++)
+                ;
+        } while (*p == '\n' || *p == '\r' || *p == '\0');
+        for (i = 0; i < r->n_in; i++) {
+            x[i] = strtof(p, &end);
+            if (end == p)
+                break;
+            for (p = end; *p == ',' || *p == ' ' || *p == '\t'; p++)
+                ;
+        }
+        if (i != r->n_in || (*p != '\n' && *p != '\r' && *p != '\0')) {
+            fprintf(stderr, "score: line %ld does not have %d values\n",
+                    r->line_no, r->n_in);
+            return -1;
+        }
+        return 1;
+    }
+    return -1;
+}
+
+static void task(void *arg, int i, int thread)
+{
+    struct job *job = arg;
+    int n_in = job->net->layers[0]->n_neurons;
+    int n_out = job->net->layers[job->net->n_layers-1]->n_neurons;
+    int start = i * job->chunk;
+    int n = (start + job->chunk < job->n) ? job->chunk : job->n - start;
+
+    if (job->labels_only)
+        network_classify(job->net, n,
+                         (float (*)[n_in])(job->input + start * n_in),
+                         job->labels + start * job->topk, job->topk, NULL, 0);
+    else
+        feedforward_batch(job->net, n,
+                          (float (*)[n_in])(job->input + start * n_in),
+                          (float (*)[n_out])(job->output + start * n_out),
+                          pool_scratch(job->pool, thread,
+                                  2 * n * network_max_neurons(job->net)));
+}
+
+static void write_results(struct job *job, int n_out, int binary)
+{
+    int i, j;
+
+    if (binary) {
+        if (job->labels_only)
+            fwrite(job->labels, sizeof(int), job->n * job->topk, stdout);
+        else
+            fwrite(job->output, sizeof(float), job->n * n_out, stdout);
+        return;
+    }
+    for (i = 0; i < job->n; i++) {
+        if (job->labels_only)
+            for (j = 0; j < job->topk; j++)
+                printf("%d%c", job->labels[i * job->topk + j],
+                       j < job->topk - 1 ? ' ' : '\n');
+        else
+            for (j = 0; j < n_out; j++)
+                printf("%.6g%c", job->output[i * n_out + j],
+                       j < n_out - 1 ? ' ' : '\n');
+    }
+}
+
+static void usage(char *prog)
+{
+    fprintf(stderr, "usage: %s [-f idx|raw|csv] [-o labels|scores] [-k topk]"
+            " [-b] [-n batch] [-t threads] [-q] [-T trace.json] model.net" \
+            " [input]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    struct reader r = { 0 };
+    struct network *net;
+    struct pool *pool;
+    struct job job;
+    char *trace_path = NULL;
+    int batch = DEFAULT_BATCH, n_threads = 0, binary = 0, quiet = 0;
+    int opt, n_out, n_tasks, status;
+    long total = 0;
+    double start, last;
+
+    job.labels_only = 1;
+    job.topk = 1;
+    r.format = FORMAT_RAW;
+    while ((opt = getopt(argc, argv, "f:o:k:bn:t:qT:")) != -1) {
+        switch (opt) {
+        case 'f':
+            if (strcmp(optarg, "idx") == 0) r.format = FORMAT_IDX;
+            else if (strcmp(optarg, "raw") == 0) r.format = FORMAT_RAW;
+            else if (strcmp(optarg, "csv") == 0) r.format = FORMAT_CSV;
+            else usage(argv[0]);
+            break;
+        case 'o':
+            if (strcmp(optarg, "labels") == 0) job.labels_only = 1;
+            else if (strcmp(optarg, "scores") == 0) job.labels_only = 0;
+            else usage(argv[0]);
+            break;
+        case 'k': job.topk = atoi(optarg); break;
+        case 'b': binary = 1; break;
+        case 'n': batch = atoi(optarg); break;
+        case 't': n_threads = atoi(optarg); break;
+        case 'q': quiet = 1; break;
+        case 'T': trace_path = optarg; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (optind != argc-1 && optind != argc-2)
+        usage(argv[0]);
+    if (batch < 1 || job.topk < 1)
+        usage(argv[0]);
+    if (!(net = network_create_from_file(argv[optind])))
+        return 1;
+    r.n_in = net->layers[0]->n_neurons;
+    n_out = net->layers[net->n_layers-1]->n_neurons;
+    if (job.topk > n_out)
+        job.topk = n_out;
+    if (optind == argc-1 || strcmp(argv[optind+1], "-") == 0) {
+        r.fp = stdin;
+    } else if (!(r.fp = fopen(argv[optind+1], "rb"))) {
+        perror(argv[optind+1]);
+        return 1;
+    }
+    if (r.format == FORMAT_IDX && open_idx(&r) < 0)
+        return 1;
+
+    if (trace_path) {
+        trace_start(0);
+        trace_thread_name("main");
+    }
+    pool = pool_create(n_threads);
+    /* Each read fills one batch per thread */
+    job.net = net;
+    job.pool = pool;
+    job.chunk = batch;
+    job.input = malloc((size_t)batch * pool->n_threads * r.n_in
+                       * sizeof(float));
+    job.output = malloc((size_t)batch * pool->n_threads * n_out
+                        * sizeof(float));
+    job.labels = malloc((size_t)batch * pool->n_threads * job.topk
+                        * sizeof(int));
+
+    start = last = io_now();
+    for (;;) {
+        TRACE_BEGIN("read", -1);
+        for (job.n = 0; job.n < batch * pool->n_threads; job.n++)
+            if ((status = read_sample(&r, job.input + job.n * r.n_in)) <= 0)
+                break;
+        TRACE_END();
+        n_tasks = (job.n + batch - 1) / batch;
+        pool_run(pool, n_tasks, task, &job);
+        TRACE_BEGIN("write", -1);
+        write_results(&job, n_out, binary);
+        TRACE_END();
+        total += job.n;
+        if (!quiet && io_now() - last >= 1) {
+            last = io_now();
+            fprintf(stderr, "\r%ld samples, %.0f samples/s", total,
+                    total / (last - start));
+        }
+        if (status <= 0)
+            break;
+    }
+    fflush(stdout);
+    if (!quiet)
+        fprintf(stderr, "\r%ld samples in %.3f s, %.0f samples/s on %d " \
+                "threads\n", total, io_now() - start,
+                total / (io_now() - start), pool->n_threads);
+    if (status < 0)
+        fprintf(stderr, "score: error reading sample %ld\n", total + 1);
+
+    if (trace_path)
+        trace_dump(trace_path);
+    pool_destroy(pool);
+    destroy_network(net);
+    return status < 0;
+}
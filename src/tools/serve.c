@@ -0,0 +1,313 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "neuron.h"
+#include "model.h"
+#include "trace.h"
+#include "protocol.h"
+#include "io.h"
+
+/* serve: inference daemon. Loads a network saved with network_save_to_file
+ * and answers requests on a unix domain socket (see protocol.h).
+ *
+ * Requests coming from all the connections are put in a single queue.
+ * Each worker takes up to max_batch requests from the queue, waiting at
+ * most "deadline" microseconds since the oldest one arrived for the batch
+ * to fill up, runs them through one call to feedforward_batch, and hands
+ * the outputs back to the connections.
+ *
+ * On SIGHUP the model file is loaded again and, if it is valid and has the
+ * same topology, swapped in without interrupting the requests in flight.
+ *
+ * With -T, a timeline of the workers (see trace.h) is written to the given
+ * file on every SIGUSR1.
+ */
+
+#define DEFAULT_SOCKET "/tmp/neurotic.sock"
+#define DEFAULT_BATCH 32
+#define DEFAULT_DEADLINE 500
+#define DEFAULT_WORKERS 1
+
+struct request {
+    float *input;
+    float *output;
+    struct timespec arrival;
+    int done;
+    pthread_cond_t cond;
+    struct request *next;
+};
+
+static struct model *model;
+static char *model_path;
+static char *trace_path;
+static int n_in, n_out;
+static int max_batch = DEFAULT_BATCH;
+static long deadline = DEFAULT_DEADLINE; /* microseconds */
+
+/* Queue of pending requests, shared by connections and workers */
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static struct request *queue_head, *queue_tail;
+static int queue_len;
+
+static void enqueue(struct request *req)
+{
+    pthread_mutex_lock(&queue_lock);
+    req->next = NULL;
+    if (queue_tail)
+        queue_tail->next = req;
+    else
+        queue_head = req;
+    queue_tail = req;
+    queue_len++;
+    /* wake up a worker waiting for work, or for its batch to fill up */
+    pthread_cond_broadcast(&queue_cond);
+    pthread_mutex_unlock(&queue_lock);
+}
+
+/* add_usec: add usec microseconds to the time t */
+static void add_usec(struct timespec *t, long usec)
+{
+    t->tv_sec += usec / 1000000;
+    t->tv_nsec += (usec % 1000000) * 1000;
+    if (t->tv_nsec >= 1000000000) {
+        t->tv_sec++;
+        t->tv_nsec -= 1000000000;
+    }
+}
+
+/* dequeue_batch: wait for requests and take up to max_batch of them. Returns
+ * the number of requests saved in batch */
+static int dequeue_batch(struct request *batch[])
+{
+    struct timespec limit;
+    int n;
+
+    pthread_mutex_lock(&queue_lock);
+    TRACE_BEGIN("idle", -1);
+    while (queue_len == 0)
+        pthread_cond_wait(&queue_cond, &queue_lock);
+    TRACE_END();
+    /* The oldest request decides how long we may wait for the rest */
+    limit = queue_head->arrival;
+    add_usec(&limit, deadline);
+    TRACE_BEGIN("fill_batch", -1);
+    while (queue_len < max_batch)
+        if (pthread_cond_timedwait(&queue_cond, &queue_lock, &limit)
+                == ETIMEDOUT)
+            break;
+    TRACE_END();
+    for (n = 0; n < max_batch && queue_head; n++) {
+        batch[n] = queue_head;
+        queue_head = queue_head->next;
+        queue_len--;
+    }
+    if (!queue_head)
+        queue_tail = NULL;
+    pthread_mutex_unlock(&queue_lock);
+    return n;
+}
+
+static void *worker(void *arg)
+{
+    struct request *batch[max_batch];
+    float (*input)[n_in] = malloc(max_batch * sizeof(*input));
+    float (*output)[n_out] = malloc(max_batch * sizeof(*output));
+    float *scratch;
+    struct model_version *version;
+    char name[32];
+    int i, n, ticket;
+
+    snprintf(name, sizeof(name), "worker %d", (int)(long)arg);
+    trace_thread_name(name);
+
+    version = model_acquire(model, &ticket);
+    scratch = malloc(2 * max_batch * network_max_neurons(version->net)
+                     * sizeof(float));
+    model_release(model, ticket);
+
+    for (;;) {
+        n = dequeue_batch(batch);
+        TRACE_BEGIN("batch", n);
+        /* gather */
+        for (i = 0; i < n; i++)
+            memcpy(input[i], batch[i]->input, n_in * sizeof(float));
+        version = model_acquire(model, &ticket);
+        feedforward_batch(version->net, n, input, output, scratch);
+        model_release(model, ticket);
+        /* scatter */
+        pthread_mutex_lock(&queue_lock);
+        for (i = 0; i < n; i++) {
+            memcpy(batch[i]->output, output[i], n_out * sizeof(float));
+            batch[i]->done = 1;
+            pthread_cond_signal(&batch[i]->cond);
+        }
+        pthread_mutex_unlock(&queue_lock);
+        TRACE_END();
+    }
+    return NULL;
+}
+
+static void *connection(void *arg)
+{
+    int fd = (int)(long)arg;
+    struct proto_hello hello = { PROTO_MAGIC, n_in, n_out };
+    struct proto_header header;
+    struct request req;
+    float input[n_in], output[n_out];
+
+    req.input = input;
+    req.output = output;
+    pthread_cond_init(&req.cond, NULL);
+    if (io_write_all(fd, &hello, sizeof(hello)) < 0)
+        goto out;
+    while (io_read_all(fd, &header, sizeof(header)) == 0) {
+        if (header.n_floats != n_in) {
+            /* we cannot resynchronize with the client, so drop it */
+            header.status = PROTO_ERROR;
+            header.n_floats = 0;
+            io_write_all(fd, &header, sizeof(header));
+            break;
+        }
+        if (io_read_all(fd, input, sizeof(input)) < 0)
+            break;
+        clock_gettime(CLOCK_REALTIME, &req.arrival);
+        req.done = 0;
+        enqueue(&req);
+        pthread_mutex_lock(&queue_lock);
+        while (!req.done)
+            pthread_cond_wait(&req.cond, &queue_lock);
+        pthread_mutex_unlock(&queue_lock);
+        header.status = PROTO_OK;
+        header.n_floats = n_out;
+        if (io_write_all(fd, &header, sizeof(header)) < 0
+                || io_write_all(fd, output, sizeof(output)) < 0)
+            break;
+    }
+out:
+    pthread_cond_destroy(&req.cond);
+    close(fd);
+    return NULL;
+}
+
+static void reloaded(struct model *model, int status)
+{
+    struct model_version *version;
+    int ticket;
+    if (status == 0) {
+        version = model_acquire(model, &ticket);
+        fprintf(stderr, "reloaded %s: version %d, crc %08x\n", model_path,
+                version->version, version->checksum);
+        model_release(model, ticket);
+    } else {
+        fprintf(stderr, "could not reload %s, keeping the old version\n",
+                model_path);
+    }
+}
+
+/* reloader: reload the model whenever we get a SIGHUP, and write the
+ * trace on SIGUSR1 */
+static void *reloader(void *arg)
+{
+    sigset_t *set = arg;
+    int sig;
+
+    trace_thread_name("reloader");
+    for (;;) {
+        if (sigwait(set, &sig) != 0)
+            continue;
+        if (sig == SIGHUP) {
+            TRACE_BEGIN("reload", -1);
+            reloaded(model, model_reload(model, model_path, 0));
+            TRACE_END();
+        } else if (trace_path && trace_dump(trace_path) == 0) {
+            fprintf(stderr, "trace written to %s\n", trace_path);
+        }
+    }
+    return NULL;
+}
+
+static void usage(char *prog)
+{
+    fprintf(stderr, "usage: %s [-s socket] [-b max_batch] " \
+            "[-d deadline_usec] [-w workers] [-T trace.json] model.net\n",
+            prog);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    char *path = DEFAULT_SOCKET;
+    int n_workers = DEFAULT_WORKERS;
+    struct sockaddr_un addr;
+    pthread_t thread;
+    pthread_attr_t attr;
+    struct model_version *version;
+    sigset_t hup;
+    int ticket;
+    int opt, sock, fd, i;
+
+    while ((opt = getopt(argc, argv, "s:b:d:w:T:")) != -1) {
+        switch (opt) {
+        case 's': path = optarg; break;
+        case 'b': max_batch = atoi(optarg); break;
+        case 'd': deadline = atol(optarg); break;
+        case 'w': n_workers = atoi(optarg); break;
+        case 'T': trace_path = optarg; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (optind != argc-1 || max_batch < 1 || n_workers < 1 || deadline < 0)
+        usage(argv[0]);
+    model_path = argv[optind];
+    if (trace_path)
+        trace_start(0);
+    if (!(model = model_create(model_path)))
+        return 1;
+    version = model_acquire(model, &ticket);
+    n_in = version->net->layers[0]->n_neurons;
+    n_out = version->net->layers[version->net->n_layers-1]->n_neurons;
+    model_release(model, ticket);
+
+    signal(SIGPIPE, SIG_IGN);
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    unlink(path);
+    if (sock < 0 || bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0
+            || listen(sock, 128) < 0) {
+        perror(path);
+        return 1;
+    }
+
+    /* Only the reloader thread gets SIGHUP and SIGUSR1 */
+    sigemptyset(&hup);
+    sigaddset(&hup, SIGHUP);
+    sigaddset(&hup, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &hup, NULL);
+    pthread_create(&thread, NULL, reloader, &hup);
+    for (i = 0; i < n_workers; i++)
+        pthread_create(&thread, NULL, worker, (void *)(long)i);
+    fprintf(stderr, "serving %s (%d -> %d) on %s, %d workers, " \
+            "batches of up to %d, deadline %ld us\n", argv[optind], n_in,
+            n_out, path, n_workers, max_batch, deadline);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    for (;;) {
+        if ((fd = accept(sock, NULL, NULL)) < 0) {
+            if (errno != EINTR)
+                perror("accept");
+            continue;
+        }
+        pthread_create(&thread, &attr, connection, (void *)(long)fd);
+    }
+}
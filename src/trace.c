@@ -0,0 +1,208 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include "trace.h"
+
+atomic_int trace_enabled;
+_Thread_local int trace_depth;
+
+/* Spans begun, but not yet ended, by this thread */
+static _Thread_local struct {
+    const char *name;
+    long start;
+    int index;
+} stack[TRACE_DEPTH];
+static _Thread_local struct trace_buffer *local;
+static _Thread_local char local_name[32];
+
+static _Atomic(struct trace_buffer *) buffers;
+static unsigned long buffer_size = TRACE_DEFAULT_EVENTS;
+static long origin;
+static pthread_key_t owner_key;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+static long now_ns(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000L + t.tv_nsec;
+}
+
+/* release_buffer: called when a thread exits, so that a thread created
+ * later can take over its buffer. The spans already in it are kept */
+static void release_buffer(void *arg)
+{
+    struct trace_buffer *b = arg;
+    atomic_store(&b->owned, 0);
+}
+
+static void init(void)
+{
+    pthread_key_create(&owner_key, release_buffer);
+}
+
+/* get_buffer: the buffer of the calling thread, which is either one left by
+ * a thread that has exited or a new one added to the list */
+static struct trace_buffer *get_buffer(void)
+{
+    struct trace_buffer *b;
+    int free_ = 0;
+
+    if (local)
+        return local;
+    for (b = atomic_load(&buffers); b; b = b->next, free_ = 0)
+        if (atomic_compare_exchange_strong(&b->owned, &free_, 1))
+            break;
+    if (!b) {
+        if (!(b = malloc(sizeof(struct trace_buffer))))
+            return NULL;
+        if (!(b->events = malloc(buffer_size * sizeof(struct trace_event)))) {
+            free(b);
+            return NULL;
+        }
+        b->size = buffer_size;
+        atomic_init(&b->head, 0);
+        atomic_init(&b->owned, 1);
+        b->next = atomic_load(&buffers);
+        while (!atomic_compare_exchange_weak(&buffers, &b->next, b))
+            ;
+    }
+    b->tid = (int)syscall(SYS_gettid);
+    memcpy(b->name, local_name, sizeof(b->name));
+    pthread_setspecific(owner_key, b);
+    return local = b;
+}
+
+/* trace_start: start recording spans, in buffers of events_per_thread
+ * spans (TRACE_DEFAULT_EVENTS if 0), rounded up to a power of 2. If tracing
+ * was stopped before, the new spans are added to the old ones */
+int trace_start(unsigned long events_per_thread)
+{
+    unsigned long size = 1;
+
+    if (pthread_once(&once, init) != 0)
+        return -1;
+    if (events_per_thread == 0)
+        events_per_thread = TRACE_DEFAULT_EVENTS;
+    while (size < events_per_thread)
+        size *= 2;
+    buffer_size = size;
+    if (!origin)
+        origin = now_ns();
+    atomic_store(&trace_enabled, 1);
+    return 0;
+}
+
+/* trace_stop: stop recording new spans. Those already begun are recorded
+ * when they end */
+void trace_stop(void)
+{
+    atomic_store(&trace_enabled, 0);
+}
+
+/* trace_thread_name: name the calling thread in the timeline. It can be
+ * called before tracing starts */
+void trace_thread_name(const char *name)
+{
+    strncpy(local_name, name, sizeof(local_name) - 1);
+    if (local)
+        memcpy(local->name, local_name, sizeof(local->name));
+}
+
+void trace_begin(const char *name, int index)
+{
+    if (trace_depth < TRACE_DEPTH) {
+        stack[trace_depth].name = name;
+        stack[trace_depth].index = index;
+        stack[trace_depth].start = now_ns();
+    }
+    trace_depth++;
+}
+
+void trace_end(void)
+{
+    struct trace_buffer *b;
+    struct trace_event *e;
+    unsigned long head;
+    long end = now_ns();
+
+    /* spans nested too deep are not recorded */
+    if (--trace_depth >= TRACE_DEPTH || !(b = get_buffer()))
+        return;
+    head = atomic_load_explicit(&b->head, memory_order_relaxed);
+    e = &b->events[head & (b->size - 1)];
+    e->name = stack[trace_depth].name;
+    e->index = stack[trace_depth].index;
+    e->start = stack[trace_depth].start - origin;
+    e->duration = end - stack[trace_depth].start;
+    e->tid = b->tid;
+    atomic_store_explicit(&b->head, head + 1, memory_order_release);
+}
+
+/* write_buffer: write the spans of b. The owner may keep writing while we
+ * read, so the events are copied first, and then those that may have been
+ * overwritten during the copy are dropped */
+static int write_buffer(FILE *fp, struct trace_buffer *b, int pid, int first)
+{
+    struct trace_event *copy, *e;
+    unsigned long head, n, i, last;
+
+    head = atomic_load_explicit(&b->head, memory_order_acquire);
+    n = head < b->size ? head : b->size;
+    if (!(copy = malloc((n ? n : 1) * sizeof(struct trace_event))))
+        return first;
+    for (i = head - n; i < head; i++)
+        copy[i - (head - n)] = b->events[i & (b->size - 1)];
+    /* event i is overwritten by event i + size, which may be being written
+     * as soon as head reaches i + size */
+    last = atomic_load_explicit(&b->head, memory_order_acquire);
+    if (b->name[0]) {
+        fprintf(fp, "%s\n{\"name\": \"thread_name\", \"ph\": \"M\", " \
+                "\"pid\": %d, \"tid\": %d, \"args\": {\"name\": \"%s\"}}",
+                first ? "" : ",", pid, b->tid, b->name);
+        first = 0;
+    }
+    for (i = head - n; i < head; i++) {
+        if (i + b->size <= last)
+            continue;
+        e = &copy[i - (head - n)];
+        fprintf(fp, "%s\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": %d, " \
+                "\"tid\": %d, \"ts\": %.3f, \"dur\": %.3f", first ? "" : ",",
+                e->name, pid, e->tid, e->start * 1e-3, e->duration * 1e-3);
+        if (e->index >= 0)
+            fprintf(fp, ", \"args\": {\"index\": %d}", e->index);
+        fputc('}', fp);
+        first = 0;
+    }
+    free(copy);
+    return first;
+}
+
+/* trace_write: write the spans recorded so far in the Chrome trace JSON
+ * format. Threads may keep tracing meanwhile */
+void trace_write(FILE *fp)
+{
+    struct trace_buffer *b;
+    int pid = getpid(), first = 1;
+
+    fprintf(fp, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [");
+    for (b = atomic_load(&buffers); b; b = b->next)
+        first = write_buffer(fp, b, pid, first);
+    fprintf(fp, "\n]}\n");
+}
+
+/* trace_dump: trace_write into the file "filename". Returns -1 on error */
+int trace_dump(char *filename)
+{
+    FILE *fp = fopen(filename, "w");
+
+    if (!fp) {
+        fprintf(stderr, "Could not open file %s\n", filename);
+        return -1;
+    }
+    trace_write(fp);
+    return fclose(fp) == 0 ? 0 : -1;
+}
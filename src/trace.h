@@ -0,0 +1,78 @@
+#ifndef __TRACE__
+#define __TRACE__
+
+#include <stdio.h>
+#include <stdatomic.h>
+
+/* Timeline tracing, to be opened with chrome://tracing or Perfetto.
+ *
+ * Code is instrumented with spans:
+ *
+ *      TRACE_BEGIN("forward", l);
+ *      ...
+ *      TRACE_END();
+ *
+ * which do nothing but test a flag until trace_start is called. While
+ * tracing, each thread records its spans, as they end, into a ring buffer
+ * of its own, so that threads never wait for each other; when a buffer is
+ * full the oldest spans are overwritten. trace_dump writes the spans of
+ * every thread as a Chrome trace JSON file.
+ *
+ * "index" is shown as an argument of the span (the epoch, the batch, the
+ * layer...), or not at all if it is negative. Spans nest up to TRACE_DEPTH
+ * levels per thread, and must end in the same function they begin.
+ */
+
+#define TRACE_DEPTH 32
+#define TRACE_DEFAULT_EVENTS (1 << 16)
+
+struct trace_event {
+    const char *name;   /* must be a string literal, or otherwise live */
+    long start;         /* nanoseconds since trace_start */
+    long duration;
+    int index;
+    int tid;
+};
+
+struct trace_buffer {
+    struct trace_event *events;
+    unsigned long size;         /* a power of 2 */
+    atomic_ulong head;          /* number of events ever written */
+    atomic_int owned;           /* whether a live thread writes to it */
+    int tid;                    /* of the thread that owns it */
+    char name[32];
+    struct trace_buffer *next;  /* list of all the buffers */
+};
+
+extern atomic_int trace_enabled;
+extern _Thread_local int trace_depth;
+
+/* Once a span has begun it is recorded even if tracing stops meanwhile, so
+ * that the nesting of the spans of the thread stays balanced */
+#define TRACE_BEGIN(name, index) \
+    do { \
+        if (trace_depth \
+                || atomic_load_explicit(&trace_enabled, memory_order_relaxed)) \
+            trace_begin(name, index); \
+    } while (0)
+#define TRACE_END() \
+    do { \
+        if (trace_depth) \
+            trace_end(); \
+    } while (0)
+
+int trace_start(unsigned long events_per_thread);
+
+void trace_stop(void);
+
+void trace_thread_name(const char *name);
+
+void trace_begin(const char *name, int index);
+
+void trace_end(void);
+
+void trace_write(FILE *fp);
+
+int trace_dump(char *filename);
+
+#endif